@@ -0,0 +1,431 @@
+// Throughput and latency benchmark for the AsyncFTP server.
+//
+//   asyncftp_bench [-q] [-o results.json] [-p port] [-m max_bytes]
+//
+// Runs the unmodified server on its own thread (the host stand-in for the
+// async_tcp task) against a scratch directory and drives it over loopback
+// with a built-in scripted FTP client. Reports, as JSON:
+//   - RETR and STOR throughput for files from 1 KB to 64 MB
+//   - LIST time for directories of 10, 1k and 10k entries
+//   - NOOP/PWD round-trip latency (p50, p99)
+//   - heap allocations made on the server thread per operation
+// -q runs a reduced set (files up to 1 MB, directories up to 1k entries).
+
+#include "AsyncFTP.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+//---------------------------------------------------------------------
+// Allocation counting
+//---------------------------------------------------------------------
+
+// Only allocations made on the server thread are counted. glibc's malloc is
+// wrapped here; operator new and the String stand-in all end up in it.
+// Sanitizer builds replace malloc themselves, so counting is off there.
+#if defined(__SANITIZE_ADDRESS__)
+#define BENCH_COUNT_ALLOCS 0
+#else
+#define BENCH_COUNT_ALLOCS 1
+#endif
+
+static __thread bool countThisThread = false;
+static std::atomic<uint64_t> allocCount{0};
+static std::atomic<uint64_t> allocBytes{0};
+
+#if BENCH_COUNT_ALLOCS
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    if (countThisThread) { allocCount++; allocBytes += size; }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (countThisThread) { allocCount++; allocBytes += n * size; }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (countThisThread) { allocCount++; allocBytes += size; }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+#endif
+
+struct AllocSnapshot {
+    uint64_t count, bytes;
+    static AllocSnapshot now() { return { allocCount.load(), allocBytes.load() }; }
+};
+
+//---------------------------------------------------------------------
+// Scripted FTP client
+//---------------------------------------------------------------------
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = { 30, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+class BenchClient {
+public:
+    bool open(uint16_t port, const char *user, const char *pass) {
+        _fd = connectTo(port);
+        if (_fd < 0 || reply() != 220) return false;
+        return command("USER %s", user) == 331 && command("PASS %s", pass) == 230 &&
+               command("TYPE I") == 200;
+    }
+
+    ~BenchClient() {
+        if (_fd >= 0) {
+            command("QUIT");
+            close(_fd);
+        }
+    }
+
+    // Send a command and return the reply code.
+    int command(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        char line[512];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(line, sizeof(line) - 2, format, args);
+        va_end(args);
+        memcpy(line + n, "\r\n", 2);
+        if (::send(_fd, line, n + 2, MSG_NOSIGNAL) != n + 2) return -1;
+        return reply();
+    }
+
+    // Read one (possibly multi-line) reply and return its code.
+    int reply() {
+        for (;;) {
+            size_t eol = _in.find("\r\n");
+            while (eol == std::string::npos) {
+                char buf[1024];
+                ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+                if (n <= 0) return -1;
+                _in.append(buf, n);
+                eol = _in.find("\r\n");
+            }
+            std::string line = _in.substr(0, eol);
+            _in.erase(0, eol + 2);
+            if (line.size() >= 4 && isdigit((unsigned char)line[0]) && line[3] == ' ') {
+                _last = line;
+                return atoi(line.c_str());
+            }
+        }
+    }
+
+    // Enter passive mode and open the data connection.
+    int openData() {
+        if (command("PASV") != 227) return -1;
+        unsigned h1, h2, h3, h4, p1, p2;
+        const char *open = strchr(_last.c_str(), '(');
+        if (!open || sscanf(open, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) return -1;
+        return connectTo((uint16_t)(p1 * 256 + p2));
+    }
+
+    // Run a download command, returning the byte count or -1 on failure.
+    long long download(const char *format, const char *arg) {
+        int data = openData();
+        if (data < 0) return -1;
+        if (command(format, arg) != 150) { close(data); return -1; }
+        long long total = 0;
+        static char buf[65536];
+        ssize_t n;
+        while ((n = recv(data, buf, sizeof(buf), 0)) > 0) total += n;
+        close(data);
+        return reply() == 226 ? total : -1;
+    }
+
+    bool upload(const char *path, const std::vector<char> &payload) {
+        int data = openData();
+        if (data < 0) return false;
+        if (command("STOR %s", path) != 150) { close(data); return false; }
+        size_t sent = 0;
+        while (sent < payload.size()) {
+            ssize_t n = ::send(data, payload.data() + sent, payload.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(data);
+        return reply() == 226 && sent == payload.size();
+    }
+
+private:
+    int _fd = -1;
+    std::string _in;
+    std::string _last;
+};
+
+//---------------------------------------------------------------------
+// Benchmarks
+//---------------------------------------------------------------------
+
+struct Options {
+    bool quick = false;
+    const char *output = nullptr;
+    uint16_t port = 21210;
+    size_t maxBytes = 64u << 20;
+};
+
+static std::string root;
+static std::string json;
+
+static void writeFile(const std::string &path, const std::vector<char> &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) return;
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+// Enough repetitions to move ~budget bytes, within [1, 200].
+static int iterationsFor(size_t size, size_t budget) {
+    size_t n = budget / size;
+    return (int)std::max<size_t>(1, std::min<size_t>(200, n));
+}
+
+static void appendf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void appendf(const char *format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    json += buf;
+}
+
+static bool benchTransfers(BenchClient &client, const Options &opt) {
+    const size_t sizes[] = { 1u << 10, 16u << 10, 256u << 10, 1u << 20, 16u << 20, 64u << 20 };
+    size_t budget = opt.quick ? (8u << 20) : (128u << 20);
+    size_t maxSize = opt.quick ? std::min<size_t>(opt.maxBytes, 1u << 20) : opt.maxBytes;
+
+    std::string retr = "  \"retr\": [", stor = "  \"stor\": [";
+    bool first = true;
+    for (size_t size : sizes) {
+        if (size > maxSize) break;
+        std::vector<char> payload(size);
+        for (size_t i = 0; i < size; i++) payload[i] = (char)(i * 2654435761u >> 13);
+        char name[64];
+        snprintf(name, sizeof(name), "/retr_%zu.bin", size);
+        writeFile(root + name, payload);
+
+        int iterations = iterationsFor(size, budget);
+        AllocSnapshot before = AllocSnapshot::now();
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            if (client.download("RETR %s", name) != (long long)size) {
+                fprintf(stderr, "RETR %s failed\n", name);
+                return false;
+            }
+        }
+        double seconds = secondsSince(start);
+        AllocSnapshot after = AllocSnapshot::now();
+        char entry[256];
+        snprintf(entry, sizeof(entry),
+                 "%s\n    { \"bytes\": %zu, \"iterations\": %d, \"mb_per_s\": %.2f, \"ms_per_op\": %.3f, "
+                 "\"allocs_per_op\": %.1f, \"alloc_bytes_per_op\": %.0f }",
+                 first ? "" : ",", size, iterations, size * (double)iterations / seconds / 1e6,
+                 seconds * 1e3 / iterations, (after.count - before.count) / (double)iterations,
+                 (after.bytes - before.bytes) / (double)iterations);
+        retr += entry;
+
+        snprintf(name, sizeof(name), "/stor_%zu.bin", size);
+        before = AllocSnapshot::now();
+        start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            if (!client.upload(name, payload)) {
+                fprintf(stderr, "STOR %s failed\n", name);
+                return false;
+            }
+        }
+        seconds = secondsSince(start);
+        after = AllocSnapshot::now();
+        snprintf(entry, sizeof(entry),
+                 "%s\n    { \"bytes\": %zu, \"iterations\": %d, \"mb_per_s\": %.2f, \"ms_per_op\": %.3f, "
+                 "\"allocs_per_op\": %.1f, \"alloc_bytes_per_op\": %.0f }",
+                 first ? "" : ",", size, iterations, size * (double)iterations / seconds / 1e6,
+                 seconds * 1e3 / iterations, (after.count - before.count) / (double)iterations,
+                 (after.bytes - before.bytes) / (double)iterations);
+        stor += entry;
+        first = false;
+        fprintf(stderr, "  transfers: %zu bytes done\n", size);
+    }
+    json += retr + "\n  ],\n" + stor + "\n  ],\n";
+    return true;
+}
+
+static bool benchList(BenchClient &client, const Options &opt) {
+    const int counts[] = { 10, 1000, 10000 };
+    json += "  \"list\": [";
+    bool first = true;
+    for (int count : counts) {
+        if (opt.quick && count > 1000) break;
+        char dir[64];
+        snprintf(dir, sizeof(dir), "/list_%d", count);
+        mkdir((root + dir).c_str(), 0755);
+        for (int i = 0; i < count; i++) {
+            char name[96];
+            snprintf(name, sizeof(name), "%s%s/sensor_%06d.csv", root.c_str(), dir, i);
+            FILE *f = fopen(name, "wb");
+            if (f) fclose(f);
+        }
+        if (client.command("CWD %s", dir) != 250) return false;
+
+        int iterations = std::max(1, 2000 / count);
+        long long bytes = 0;
+        AllocSnapshot before = AllocSnapshot::now();
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            bytes = client.download("%s", "LIST");
+            if (bytes < 0) {
+                fprintf(stderr, "LIST %s failed\n", dir);
+                return false;
+            }
+        }
+        double seconds = secondsSince(start);
+        AllocSnapshot after = AllocSnapshot::now();
+        appendf("%s\n    { \"entries\": %d, \"iterations\": %d, \"ms_per_op\": %.3f, \"bytes\": %lld, "
+                "\"allocs_per_op\": %.1f, \"alloc_bytes_per_op\": %.0f }",
+                first ? "" : ",", count, iterations, seconds * 1e3 / iterations, bytes,
+                (after.count - before.count) / (double)iterations,
+                (after.bytes - before.bytes) / (double)iterations);
+        first = false;
+        client.command("CWD /");
+    }
+    json += "\n  ],\n";
+    return true;
+}
+
+static bool benchControl(BenchClient &client, const Options &opt) {
+    const char *commands[] = { "NOOP", "PWD" };
+    int samples = opt.quick ? 500 : 5000;
+    json += "  \"control\": [";
+    bool first = true;
+    for (const char *command : commands) {
+        std::vector<double> rtt;
+        rtt.reserve(samples);
+        AllocSnapshot before = AllocSnapshot::now();
+        for (int i = 0; i < samples; i++) {
+            Clock::time_point start = Clock::now();
+            int code = client.command("%s", command);
+            rtt.push_back(secondsSince(start) * 1e6);
+            if (code < 200 || code >= 300) return false;
+        }
+        AllocSnapshot after = AllocSnapshot::now();
+        std::sort(rtt.begin(), rtt.end());
+        appendf("%s\n    { \"command\": \"%s\", \"samples\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                "\"allocs_per_op\": %.2f }",
+                first ? "" : ",", command, samples, rtt[samples / 2], rtt[samples * 99 / 100],
+                (after.count - before.count) / (double)samples);
+        first = false;
+    }
+    json += "\n  ]\n";
+    return true;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return ::remove(path);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "qo:p:m:h")) != -1) {
+        switch (c) {
+            case 'q': opt.quick = true; break;
+            case 'o': opt.output = optarg; break;
+            case 'p': opt.port = (uint16_t)atoi(optarg); break;
+            case 'm': opt.maxBytes = (size_t)strtoull(optarg, nullptr, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-q] [-o results.json] [-p port] [-m max_bytes]\n", argv[0]);
+                return c == 'h' ? 0 : 2;
+        }
+    }
+
+    char scratch[] = "/tmp/asyncftp_bench.XXXXXX";
+    if (!mkdtemp(scratch) || !LittleFS.begin(scratch)) {
+        fprintf(stderr, "cannot create scratch directory\n");
+        return 1;
+    }
+    root = scratch;
+
+    AsyncTCPHost::setBindAddress(IPAddress(127, 0, 0, 1));
+    AsyncFTP server(opt.port, FTP_FS::LITTLEFS);
+    server.begin("bench", "bench");
+    std::thread loop([] {
+        countThisThread = true;
+        AsyncTCPHost::run();
+    });
+
+    // The server logs every command; keep that out of the measurements.
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    if (!freopen("/dev/null", "w", stdout)) {}
+
+    bool ok;
+    {
+        BenchClient client;
+        ok = client.open(opt.port, "bench", "bench");
+        if (ok) {
+            appendf("{\n  \"asyncftp_bench\": 1,\n  \"quick\": %s,\n  \"count_allocs\": %s,\n"
+                    "  \"snd_buf\": %d,\n  \"rcv_wnd\": %d,\n",
+                    opt.quick ? "true" : "false", BENCH_COUNT_ALLOCS ? "true" : "false",
+                    ASYNCTCP_HOST_SND_BUF, ASYNCTCP_HOST_RCV_WND);
+            ok = benchTransfers(client, opt) && benchList(client, opt) && benchControl(client, opt);
+            json += "}\n";
+        }
+    }
+
+    AsyncTCPHost::stop();
+    loop.join();
+    nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    if (!ok) {
+        fprintf(stderr, "benchmark failed\n");
+        return 1;
+    }
+    FILE *out = opt.output ? fopen(opt.output, "w") : stdout;
+    if (!out) return 1;
+    fputs(json.c_str(), out);
+    if (out != stdout) fclose(out);
+    return 0;
+}
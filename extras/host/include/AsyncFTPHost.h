@@ -0,0 +1,38 @@
+#ifndef ASYNCFTPHOST_H
+#define ASYNCFTPHOST_H
+
+// POSIX implementation of the platform layer used by AsyncFTP (see
+// src/AsyncFTPPort.h). Pulled in instead of the Arduino, FS and AsyncTCP
+// headers when the library is built for a Linux host.
+
+#include "HostArduino.h"
+#include "HostFreeRTOS.h"
+#include "HostFS.h"
+#include "HostAsyncTCP.h"
+#include <atomic>
+
+// Raise a poll event on one connection from any task (see the ESP32 version
+// in src/AsyncFTPPort.h): the loop runs the connection's onPoll handler on
+// its next iteration, if the client is still open.
+class AsyncFTPPoke {
+public:
+    void bind(AsyncClient *client) { _client = client; }
+    void unbind() { bind(nullptr); }
+    void fire() {
+        if (!_client.load() || _pending.exchange(true)) return;
+        AsyncTCPHost::post(_run, this);
+    }
+
+private:
+    static void _run(void *arg) {
+        AsyncFTPPoke *poke = (AsyncFTPPoke *)arg;
+        poke->_pending = false;
+        AsyncClient *client = poke->_client;
+        if (client) AsyncTCPHost::poll(client);
+    }
+
+    std::atomic<AsyncClient *> _client{nullptr};
+    std::atomic<bool> _pending{false};
+};
+
+#endif // ASYNCFTPHOST_H
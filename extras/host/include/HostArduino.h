@@ -0,0 +1,162 @@
+#ifndef HOSTARDUINO_H
+#define HOSTARDUINO_H
+
+// Minimal Arduino core replacement for building AsyncFTP on a POSIX host.
+// Only the subset of the Arduino API used by the library is provided.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+//---------------------------------------------------------------------
+// String
+//---------------------------------------------------------------------
+
+class String {
+public:
+    String(const char *cstr = "") : _s(cstr ? cstr : "") {}
+    String(const char *cstr, size_t len) : _s(cstr, len) {}
+    String(const std::string &s) : _s(s) {}
+    explicit String(char c) : _s(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(long long value, unsigned char base = 10);
+    explicit String(unsigned long long value, unsigned char base = 10);
+
+    unsigned int length() const { return (unsigned int)_s.length(); }
+    bool isEmpty() const { return _s.empty(); }
+    const char *c_str() const { return _s.c_str(); }
+    bool reserve(unsigned int size) { _s.reserve(size); return true; }
+
+    String &operator+=(const String &rhs) { _s += rhs._s; return *this; }
+    String &operator+=(const char *rhs) { if (rhs) _s += rhs; return *this; }
+    String &operator+=(char c) { _s += c; return *this; }
+    bool concat(const String &rhs) { _s += rhs._s; return true; }
+    bool concat(const char *rhs) { if (rhs) _s += rhs; return true; }
+    bool concat(const char *rhs, unsigned int len) { _s.append(rhs, len); return true; }
+    bool concat(char c) { _s += c; return true; }
+
+    bool equals(const String &rhs) const { return _s == rhs._s; }
+    bool equals(const char *rhs) const { return _s == (rhs ? rhs : ""); }
+    bool equalsIgnoreCase(const String &rhs) const;
+    bool operator==(const String &rhs) const { return equals(rhs); }
+    bool operator==(const char *rhs) const { return equals(rhs); }
+    bool operator!=(const String &rhs) const { return !equals(rhs); }
+    bool operator!=(const char *rhs) const { return !equals(rhs); }
+    bool operator<(const String &rhs) const { return _s < rhs._s; }
+
+    char charAt(unsigned int index) const { return index < _s.length() ? _s[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+    char &operator[](unsigned int index) { return _s[index]; }
+
+    bool startsWith(const String &prefix) const;
+    bool endsWith(const String &suffix) const;
+    int indexOf(char ch, unsigned int from = 0) const;
+    int indexOf(const String &str, unsigned int from = 0) const;
+    int lastIndexOf(char ch) const;
+    int lastIndexOf(const String &str) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+
+    void trim();
+    void toUpperCase();
+    void toLowerCase();
+    void replace(const String &find, const String &replace);
+    void remove(unsigned int index, unsigned int count = (unsigned int)-1);
+    long toInt() const { return strtol(_s.c_str(), nullptr, 10); }
+
+private:
+    std::string _s;
+};
+
+String operator+(const String &lhs, const String &rhs);
+String operator+(const String &lhs, const char *rhs);
+String operator+(const char *lhs, const String &rhs);
+String operator+(const String &lhs, char rhs);
+
+//---------------------------------------------------------------------
+// IPAddress
+//---------------------------------------------------------------------
+
+class IPAddress {
+public:
+    IPAddress() : _addr{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _addr{a, b, c, d} {}
+    // Address in network byte order, as stored in sockaddr_in.
+    explicit IPAddress(uint32_t address);
+
+    uint8_t operator[](int index) const { return _addr[index]; }
+    uint8_t &operator[](int index) { return _addr[index]; }
+    operator uint32_t() const;
+    bool operator==(const IPAddress &rhs) const { return memcmp(_addr, rhs._addr, 4) == 0; }
+    String toString() const;
+
+private:
+    uint8_t _addr[4];
+};
+
+//---------------------------------------------------------------------
+// Serial
+//---------------------------------------------------------------------
+
+class HostSerial {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    size_t print(const char *s);
+    size_t print(const String &s) { return print(s.c_str()); }
+    size_t print(char c);
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t print(long n);
+    size_t print(unsigned long n);
+    size_t print(const IPAddress &ip) { return print(ip.toString()); }
+    size_t println() { return print("\n"); }
+    template <typename T> size_t println(const T &v) { size_t n = print(v); return n + println(); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t write(const uint8_t *buffer, size_t size);
+};
+
+extern HostSerial Serial;
+
+//---------------------------------------------------------------------
+// ESP
+//---------------------------------------------------------------------
+
+#ifndef ASYNCFTP_HOST_HEAP_SIZE
+#define ASYNCFTP_HOST_HEAP_SIZE (320 * 1024)  // Heap of an ESP32 without PSRAM
+#endif
+
+// Heap figures as if the process ran in ASYNCFTP_HOST_HEAP_SIZE bytes: free
+// heap is that size minus what the program has allocated since startup.
+// The minimum only covers the moments getFreeHeap() was called.
+class EspClass {
+public:
+    uint32_t getHeapSize();
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+};
+
+extern EspClass ESP;
+
+// The host has no PSRAM; ps_malloc() is plain malloc(), as on an ESP32
+// without it.
+bool psramFound();
+void *ps_malloc(size_t size);
+
+#endif // HOSTARDUINO_H
@@ -0,0 +1,158 @@
+#ifndef HOSTASYNCTCP_H
+#define HOSTASYNCTCP_H
+
+// epoll-based replacement for the AsyncTCP AsyncClient/AsyncServer API.
+//
+// All callbacks run on the thread that calls AsyncTCPHost::loop()/run(),
+// mirroring the single async_tcp task on the ESP32. The lwIP send buffer and
+// receive window are emulated so that space(), onAck and ackLater()/ack()
+// behave like they do on the device.
+
+#include "HostArduino.h"
+#include <functional>
+#include <string>
+
+#ifndef ASYNCTCP_HOST_SND_BUF
+#define ASYNCTCP_HOST_SND_BUF 5744   // lwIP TCP_SND_BUF on ESP32 (4 * MSS)
+#endif
+#ifndef ASYNCTCP_HOST_RCV_WND
+#define ASYNCTCP_HOST_RCV_WND 5744   // lwIP TCP_WND on ESP32 (4 * MSS)
+#endif
+#ifndef ASYNCTCP_HOST_MSS
+#define ASYNCTCP_HOST_MSS 1436       // Largest chunk handed to onData()
+#endif
+
+// Window parameters under the names the ESP32 sdkconfig uses.
+#define CONFIG_LWIP_TCP_WND_DEFAULT ASYNCTCP_HOST_RCV_WND
+#define CONFIG_LWIP_TCP_MSS ASYNCTCP_HOST_MSS
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+class AsyncClient;
+class AsyncServer;
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t error)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t time)> AcTimeoutHandler;
+
+namespace AsyncTCPHost {
+class Endpoint;
+}
+
+class AsyncClient {
+public:
+    explicit AsyncClient(int fd = -1);
+    ~AsyncClient();
+
+    bool connect(IPAddress ip, uint16_t port);
+    void close(bool now = false);
+    int8_t abort();
+    bool connected() const { return _fd >= 0 && !_connecting; }
+    bool canSend() const { return space() > 0; }
+
+    size_t space() const;
+    size_t add(const char *data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+    bool send();
+    size_t write(const char *data);
+    size_t write(const char *data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+
+    // Withhold the window update for the segment being delivered to onData().
+    void ackLater() { _ackNow = false; }
+    // Reopen the receive window by up to len previously withheld bytes.
+    size_t ack(size_t len);
+
+    void setNoDelay(bool nodelay);
+    IPAddress localIP() const;
+    uint16_t localPort() const;
+    IPAddress remoteIP() const;
+    uint16_t remotePort() const;
+
+    void onConnect(AcConnectHandler cb, void *arg = nullptr)    { _connectCb = cb; _connectArg = arg; }
+    void onDisconnect(AcConnectHandler cb, void *arg = nullptr) { _discardCb = cb; _discardArg = arg; }
+    void onAck(AcAckHandler cb, void *arg = nullptr)            { _ackCb = cb; _ackArg = arg; }
+    void onError(AcErrorHandler cb, void *arg = nullptr)        { _errorCb = cb; _errorArg = arg; }
+    void onData(AcDataHandler cb, void *arg = nullptr)          { _dataCb = cb; _dataArg = arg; }
+    void onTimeout(AcTimeoutHandler cb, void *arg = nullptr)    { _timeoutCb = cb; _timeoutArg = arg; }
+    void onPoll(AcConnectHandler cb, void *arg = nullptr)       { _pollCb = cb; _pollArg = arg; }
+
+private:
+    friend class AsyncTCPHost::Endpoint;
+
+    void _handleEvents(uint32_t events);
+    void _handleAck();
+    void _handlePoll();
+    // Write out _tx; false if the connection has failed.
+    bool _flush();
+    void _updateInterest();
+    void _close();
+    void _error(int8_t err);
+
+    int _fd;
+    uint64_t _id = 0;
+    bool _connecting = false;
+    bool _ackNow = true;
+    std::string _tx;              // added but not yet accepted by the kernel
+    size_t _ackPending = 0;       // accepted by the kernel, onAck not yet delivered
+    size_t _rxUnacked = 0;        // delivered with ackLater() and not yet ack()ed
+    uint32_t _sentAt = 0;
+
+    AcConnectHandler _connectCb;  void *_connectArg = nullptr;
+    AcConnectHandler _discardCb;  void *_discardArg = nullptr;
+    AcAckHandler     _ackCb;      void *_ackArg = nullptr;
+    AcErrorHandler   _errorCb;    void *_errorArg = nullptr;
+    AcDataHandler    _dataCb;     void *_dataArg = nullptr;
+    AcTimeoutHandler _timeoutCb;  void *_timeoutArg = nullptr;
+    AcConnectHandler _pollCb;     void *_pollArg = nullptr;
+};
+
+class AsyncServer {
+public:
+    AsyncServer(uint16_t port);
+    AsyncServer(IPAddress addr, uint16_t port);
+    ~AsyncServer();
+
+    void onClient(AcConnectHandler cb, void *arg) { _connectCb = cb; _connectArg = arg; }
+    void begin();
+    void end();
+    void setNoDelay(bool nodelay) { _noDelay = nodelay; }
+    // 1 (LISTEN) once begin() succeeded, 0 otherwise.
+    uint8_t status() const { return _fd >= 0 ? 1 : 0; }
+
+private:
+    friend class AsyncTCPHost::Endpoint;
+
+    void _handleEvents(uint32_t events);
+
+    IPAddress _addr;
+    uint16_t _port;
+    int _fd = -1;
+    uint64_t _id = 0;
+    bool _noDelay = false;
+    AcConnectHandler _connectCb;
+    void *_connectArg = nullptr;
+};
+
+namespace AsyncTCPHost {
+
+// Run one iteration of the event loop: wait up to timeoutMs for socket
+// activity, then dispatch callbacks, acks and the 500 ms poll tick.
+void loop(int timeoutMs);
+// Run the event loop until stop() is called.
+void run();
+// Make run() return; safe to call from any thread.
+void stop();
+// Run fn(arg) on the loop thread during its next iteration; safe to call
+// from any thread.
+void post(void (*fn)(void *), void *arg);
+// Run client's onPoll handler now, as the 500 ms tick would, if it is
+// still open. Loop thread only.
+void poll(AsyncClient *client);
+// Address that AsyncServer(port) listens on (default 0.0.0.0).
+void setBindAddress(IPAddress addr);
+
+} // namespace AsyncTCPHost
+
+#endif // HOSTASYNCTCP_H
@@ -0,0 +1,112 @@
+#ifndef HOSTFS_H
+#define HOSTFS_H
+
+// Directory-rooted replacement for the Arduino-ESP32 fs::FS / fs::File API.
+// Every path the library passes in is resolved below a host directory, so a
+// LittleFS or SD card image can be served straight from a dev box.
+
+#include "HostArduino.h"
+#include <time.h>
+#include <memory>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class FileImpl;
+typedef std::shared_ptr<FileImpl> FileImplPtr;
+
+class File {
+public:
+    File(FileImplPtr impl = FileImplPtr()) : _p(impl) {}
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size);
+    size_t read(uint8_t *buf, size_t size);
+    int read();
+    int available();
+    void flush();
+    bool seek(uint32_t pos, SeekMode mode);
+    bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+    size_t position() const;
+    size_t size() const;
+    void close();
+    operator bool() const;
+    time_t getLastWrite();
+    const char *path() const;
+    const char *name() const;
+
+    bool isDirectory();
+    File openNextFile(const char *mode = FILE_READ);
+    void rewindDirectory();
+
+private:
+    FileImplPtr _p;
+};
+
+class FS {
+public:
+    virtual ~FS() {}
+
+    File open(const char *path, const char *mode = FILE_READ, const bool create = false);
+    File open(const String &path, const char *mode = FILE_READ, const bool create = false) {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char *path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char *pathFrom, const char *pathTo);
+    bool rename(const String &pathFrom, const String &pathTo) { return rename(pathFrom.c_str(), pathTo.c_str()); }
+    bool mkdir(const char *path);
+    bool mkdir(const String &path) { return mkdir(path.c_str()); }
+    bool rmdir(const char *path);
+    bool rmdir(const String &path) { return rmdir(path.c_str()); }
+
+protected:
+    // Map a filesystem path to a host path; returns false for paths that
+    // would escape the root (e.g. "..").
+    virtual bool hostPath(const char *path, std::string &out) const = 0;
+};
+
+// A filesystem rooted at a host directory.
+class HostFS : public FS {
+public:
+    bool begin(const char *rootDir);
+    void end() { _root.clear(); }
+    const char *root() const { return _root.c_str(); }
+    // Size and use of the host filesystem holding the root, like
+    // LittleFS.totalBytes() and SD.usedBytes() on the ESP32.
+    uint64_t totalBytes();
+    uint64_t usedBytes();
+
+protected:
+    bool hostPath(const char *path, std::string &out) const override;
+
+private:
+    std::string _root;
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+// Stand-ins for the ESP32 LittleFS and SD singletons.
+extern fs::HostFS LittleFS;
+extern fs::HostFS SD;
+
+// Flash partitions are image files on the host: name is the file's path,
+// mapped read-only with mmap().
+const uint8_t *asyncftpMapPartition(const char *name, size_t &size, uint32_t &handle);
+void asyncftpUnmapPartition(const uint8_t *data, size_t size, uint32_t handle);
+
+#endif // HOSTFS_H
@@ -0,0 +1,45 @@
+#ifndef HOSTFREERTOS_H
+#define HOSTFREERTOS_H
+
+// The few FreeRTOS task and semaphore calls AsyncFTP uses, on POSIX threads.
+// Priorities, stack sizes and core affinity are accepted and ignored.
+
+#include <stdint.h>
+
+typedef int32_t  BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct HostTask *TaskHandle_t;
+typedef struct HostSemaphore *SemaphoreHandle_t;
+
+#define pdFALSE            0
+#define pdTRUE             1
+#define pdPASS             1
+#define pdFAIL             0
+#define portMAX_DELAY      ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+#define tskNO_AFFINITY     0x7fffffff
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created,
+                                   BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created);
+// Only vTaskDelete(NULL) as a task's last statement is supported: the
+// thread ends when the task function returns.
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+
+// Direct-to-task notifications used as a counting semaphore.
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#endif // HOSTFREERTOS_H
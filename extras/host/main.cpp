@@ -0,0 +1,126 @@
+// Linux loopback build of the AsyncFTP server.
+//
+//   asyncftp_host [-r root_dir] [-p port] [-a address] [-u user] [-w password] [-n sessions]
+//                 [-P first:count] [-c bytes:ttl_ms] [-f bytes:max_file]
+//                 [-l session_bps:total_bps] [-m budget:min_free] [-s | -i image]
+//
+// Serves root_dir (default: current directory) on 127.0.0.1, or on address,
+// through the unmodified AsyncFTP protocol logic, so it can be profiled, run
+// under sanitizers or driven by load generators without flashing a device.
+// Pass -s to serve the directory as the SD card instead of LittleFS, or -i to
+// serve a read-only image built by extras/mkftpimage.py instead, and -n to
+// change the number of simultaneous sessions (default FTP_MAX_SESSIONS). -P sets
+// the passive port range (default: one port per session from FTP_PASV_PORT_MIN),
+// -c the directory cache (default FTP_DIRCACHE_SIZE:FTP_DIRCACHE_TTL) and -f the
+// file cache (default FTP_FILECACHE_SIZE:FTP_FILECACHE_MAXFILE). -l limits
+// transfers to bytes per second per session and in total (default 0:0, none),
+// and -m sets the heap budget (default 0:FTP_HEAP_MIN_FREE, of the emulated
+// ASYNCFTP_HOST_HEAP_SIZE).
+
+#include "AsyncFTP.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+static void onSignal(int) {
+    AsyncTCPHost::stop();
+}
+
+int main(int argc, char **argv) {
+    const char *root = ".";
+    uint16_t port = 2121;
+    String username = "esp32";
+    String password = "esp32";
+    FTP_FS ftpfs = FTP_FS::LITTLEFS;
+    const char *image = nullptr;
+    IPAddress address(127, 0, 0, 1);
+    uint8_t sessions = FTP_MAX_SESSIONS;
+    unsigned passiveFirst = 0, passiveCount = 0;
+    unsigned cacheBytes = FTP_DIRCACHE_SIZE, cacheTTL = FTP_DIRCACHE_TTL;
+    unsigned fileCacheBytes = FTP_FILECACHE_SIZE, fileCacheMax = FTP_FILECACHE_MAXFILE;
+    unsigned sessionRate = 0, totalRate = 0;
+    unsigned heapBudget = 0, heapMinFree = FTP_HEAP_MIN_FREE;
+    unsigned a, b, c, d;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:p:a:u:w:n:P:c:f:l:m:i:sh")) != -1) {
+        switch (opt) {
+            case 'r': root = optarg; break;
+            case 'p': port = (uint16_t)atoi(optarg); break;
+            case 'a':
+                if (sscanf(optarg, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) {
+                    fprintf(stderr, "invalid address %s\n", optarg);
+                    return 2;
+                }
+                address = IPAddress(a, b, c, d);
+                break;
+            case 'u': username = optarg; break;
+            case 'w': password = optarg; break;
+            case 'n': sessions = (uint8_t)atoi(optarg); break;
+            case 'P':
+                if (sscanf(optarg, "%u:%u", &passiveFirst, &passiveCount) != 2 ||
+                    passiveFirst == 0 || passiveFirst > 65535 || passiveCount == 0) {
+                    fprintf(stderr, "invalid passive port range %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%u:%u", &cacheBytes, &cacheTTL) != 2) {
+                    fprintf(stderr, "invalid cache setting %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'f':
+                if (sscanf(optarg, "%u:%u", &fileCacheBytes, &fileCacheMax) != 2) {
+                    fprintf(stderr, "invalid file cache setting %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'l':
+                if (sscanf(optarg, "%u:%u", &sessionRate, &totalRate) != 2) {
+                    fprintf(stderr, "invalid rate limit %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u", &heapBudget, &heapMinFree) != 2) {
+                    fprintf(stderr, "invalid heap budget %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 's': ftpfs = FTP_FS::SD_CARD; break;
+            case 'i': ftpfs = FTP_FS::IMAGE; image = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r root_dir] [-p port] [-a address] [-u user] [-w password]\n"
+                                "       [-n sessions] [-P first:count] [-c bytes:ttl_ms] [-f bytes:max_file]\n"
+                                "       [-l session_bps:total_bps] [-m budget:min_free] [-s | -i image]\n", argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    fs::HostFS &filesystem = ftpfs == FTP_FS::SD_CARD ? SD : LittleFS;
+    if (!image && !filesystem.begin(root)) {
+        fprintf(stderr, "cannot serve %s: not a directory\n", root);
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    AsyncTCPHost::setBindAddress(address);
+    AsyncFTP ftpServer(port, ftpfs);
+    if (passiveCount) ftpServer.setPassivePortRange((uint16_t)passiveFirst, (uint16_t)passiveCount);
+    ftpServer.setDirectoryCache(cacheBytes, cacheTTL);
+    ftpServer.setFileCache(fileCacheBytes, fileCacheMax);
+    ftpServer.setRateLimit(sessionRate, totalRate);
+    ftpServer.setHeapBudget(heapBudget, heapMinFree);
+    if (image && !ftpServer.mountImage(image)) {
+        fprintf(stderr, "cannot serve %s: not an FTP image\n", image);
+        return 1;
+    }
+    ftpServer.begin(username, password, sessions);
+    Serial.printf("FTP server serving %s on %s:%u\n", image ? image : root, address.toString().c_str(), port);
+
+    AsyncTCPHost::run();
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include "HostArduino.h"
+
+#include <ctype.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <mutex>
+#include <random>
+
+HostSerial Serial;
+EspClass ESP;
+
+//---------------------------------------------------------------------
+// Time and random
+//---------------------------------------------------------------------
+
+static uint64_t monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static const uint64_t bootMicros = monotonicMicros();
+
+unsigned long millis() { return (unsigned long)((monotonicMicros() - bootMicros) / 1000ULL); }
+unsigned long micros() { return (unsigned long)(monotonicMicros() - bootMicros); }
+void delay(unsigned long ms) { usleep((useconds_t)ms * 1000); }
+void yield() {}
+
+static std::mt19937 &rng() {
+    static std::mt19937 engine{std::random_device{}()};
+    return engine;
+}
+
+long random(long howbig) {
+    if (howbig <= 0) return 0;
+    return (long)(rng()() % (unsigned long)howbig);
+}
+
+long random(long howsmall, long howbig) {
+    if (howsmall >= howbig) return howsmall;
+    return howsmall + random(howbig - howsmall);
+}
+
+//---------------------------------------------------------------------
+// String
+//---------------------------------------------------------------------
+
+static std::string formatUnsigned(unsigned long long value, unsigned char base) {
+    if (base < 2 || base > 36) base = 10;
+    char buf[66];
+    char *p = buf + sizeof(buf);
+    *--p = '\0';
+    do {
+        unsigned digit = (unsigned)(value % base);
+        *--p = (char)(digit < 10 ? '0' + digit : 'a' + digit - 10);
+        value /= base;
+    } while (value);
+    return p;
+}
+
+static std::string formatSigned(long long value, unsigned char base) {
+    if (value < 0 && base == 10) return "-" + formatUnsigned(0ULL - (unsigned long long)value, base);
+    return formatUnsigned((unsigned long long)value, base);
+}
+
+String::String(unsigned char value, unsigned char base) : _s(formatUnsigned(value, base)) {}
+String::String(int value, unsigned char base) : _s(formatSigned(value, base)) {}
+String::String(unsigned int value, unsigned char base) : _s(formatUnsigned(value, base)) {}
+String::String(long value, unsigned char base) : _s(formatSigned(value, base)) {}
+String::String(unsigned long value, unsigned char base) : _s(formatUnsigned(value, base)) {}
+String::String(long long value, unsigned char base) : _s(formatSigned(value, base)) {}
+String::String(unsigned long long value, unsigned char base) : _s(formatUnsigned(value, base)) {}
+
+bool String::equalsIgnoreCase(const String &rhs) const {
+    return _s.length() == rhs._s.length() && strcasecmp(_s.c_str(), rhs._s.c_str()) == 0;
+}
+
+bool String::startsWith(const String &prefix) const {
+    return _s.compare(0, prefix._s.length(), prefix._s) == 0;
+}
+
+bool String::endsWith(const String &suffix) const {
+    return _s.length() >= suffix._s.length() &&
+           _s.compare(_s.length() - suffix._s.length(), suffix._s.length(), suffix._s) == 0;
+}
+
+int String::indexOf(char ch, unsigned int from) const {
+    size_t pos = _s.find(ch, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::indexOf(const String &str, unsigned int from) const {
+    size_t pos = _s.find(str._s, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(char ch) const {
+    size_t pos = _s.rfind(ch);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(const String &str) const {
+    size_t pos = _s.rfind(str._s);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+String String::substring(unsigned int from) const {
+    if (from >= _s.length()) return String();
+    return String(_s.substr(from));
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= _s.length()) return String();
+    if (to > _s.length()) to = (unsigned int)_s.length();
+    return String(_s.substr(from, to - from));
+}
+
+void String::trim() {
+    size_t begin = 0, end = _s.length();
+    while (begin < end && isspace((unsigned char)_s[begin])) begin++;
+    while (end > begin && isspace((unsigned char)_s[end - 1])) end--;
+    _s = _s.substr(begin, end - begin);
+}
+
+void String::toUpperCase() {
+    for (auto &c : _s) c = (char)toupper((unsigned char)c);
+}
+
+void String::toLowerCase() {
+    for (auto &c : _s) c = (char)tolower((unsigned char)c);
+}
+
+void String::replace(const String &find, const String &replace) {
+    if (find._s.empty()) return;
+    size_t pos = 0;
+    while ((pos = _s.find(find._s, pos)) != std::string::npos) {
+        _s.replace(pos, find._s.length(), replace._s);
+        pos += replace._s.length();
+    }
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+    if (index < _s.length()) _s.erase(index, count);
+}
+
+String operator+(const String &lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String &lhs, const char *rhs)   { String r(lhs); r += rhs; return r; }
+String operator+(const char *lhs, const String &rhs)   { String r(lhs); r += rhs; return r; }
+String operator+(const String &lhs, char rhs)          { String r(lhs); r += rhs; return r; }
+
+//---------------------------------------------------------------------
+// IPAddress
+//---------------------------------------------------------------------
+
+IPAddress::IPAddress(uint32_t address) {
+    memcpy(_addr, &address, 4);
+}
+
+IPAddress::operator uint32_t() const {
+    uint32_t address;
+    memcpy(&address, _addr, 4);
+    return address;
+}
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _addr[0], _addr[1], _addr[2], _addr[3]);
+    return String(buf);
+}
+
+//---------------------------------------------------------------------
+// Serial (stdout, line-buffered across threads)
+//---------------------------------------------------------------------
+
+static std::mutex serialMutex;
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size) {
+    std::lock_guard<std::mutex> lock(serialMutex);
+    size_t n = fwrite(buffer, 1, size, stdout);
+    fflush(stdout);
+    return n;
+}
+
+size_t HostSerial::print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+size_t HostSerial::print(char c) { return write((const uint8_t *)&c, 1); }
+size_t HostSerial::print(long n) { return print(String(n)); }
+size_t HostSerial::print(unsigned long n) { return print(String(n)); }
+
+size_t HostSerial::printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len < 0) return 0;
+    return write((const uint8_t *)buf, std::min((size_t)len, sizeof(buf) - 1));
+}
+
+//---------------------------------------------------------------------
+// ESP heap
+//---------------------------------------------------------------------
+
+// Allocations made before main() (the C++ runtime, stdio) are not counted.
+static std::mutex heapLock;
+static const size_t heapBaseline = mallinfo2().uordblks;
+static uint32_t heapMinimum = ASYNCFTP_HOST_HEAP_SIZE;
+
+uint32_t EspClass::getHeapSize() {
+    return ASYNCFTP_HOST_HEAP_SIZE;
+}
+
+uint32_t EspClass::getFreeHeap() {
+    size_t used = mallinfo2().uordblks;
+    std::lock_guard<std::mutex> guard(heapLock);
+    size_t grown = used > heapBaseline ? used - heapBaseline : 0;
+    uint32_t free = grown < ASYNCFTP_HOST_HEAP_SIZE ? (uint32_t)(ASYNCFTP_HOST_HEAP_SIZE - grown) : 0;
+    if (free < heapMinimum) heapMinimum = free;
+    return free;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+    getFreeHeap();
+    std::lock_guard<std::mutex> guard(heapLock);
+    return heapMinimum;
+}
+
+bool psramFound() {
+    return false;
+}
+
+void *ps_malloc(size_t size) {
+    return malloc(size);
+}
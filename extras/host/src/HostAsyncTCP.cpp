@@ -0,0 +1,528 @@
+#include "HostAsyncTCP.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#define ASYNCTCP_HOST_POLL_MS 500     // lwIP tcp_poll interval used by AsyncTCP
+
+// lwIP error codes as reported through onError().
+#define ERR_CONN (-11)
+#define ERR_RST  (-14)
+#define ERR_ABRT (-13)
+
+namespace AsyncTCPHost {
+
+// Friend shim that gives the event loop access to the private handlers.
+class Endpoint {
+public:
+    static uint64_t id(AsyncClient *c) { return c->_id; }
+    static uint64_t id(AsyncServer *s) { return s->_id; }
+    static void events(AsyncClient *c, uint32_t ev) { c->_handleEvents(ev); }
+    static void events(AsyncServer *s, uint32_t ev) { s->_handleEvents(ev); }
+    static void ack(AsyncClient *c) { c->_handleAck(); }
+    static void poll(AsyncClient *c) { c->_handlePoll(); }
+};
+
+namespace {
+
+struct Entry {
+    AsyncClient *client = nullptr;
+    AsyncServer *server = nullptr;
+    int lingerFd = -1;            // closed client still flushing its send buffer
+    std::string lingerTx;
+};
+
+struct Loop {
+    int epfd = -1;
+    int wakefd = -1;
+    uint64_t nextId = 1;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::vector<uint64_t> acks;
+    unsigned long nextPoll = 0;
+    std::atomic<bool> stopping{false};
+    std::mutex postLock;
+    std::vector<std::pair<void (*)(void *), void *>> posted;
+    std::vector<std::pair<void (*)(void *), void *>> running;  // swapped with posted
+
+    Loop() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+};
+
+Loop &L() {
+    static Loop loop;
+    return loop;
+}
+
+uint64_t registerFd(int fd, uint32_t events, const Entry &entry) {
+    uint64_t id = L().nextId++;
+    L().entries[id] = entry;
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = id;
+    epoll_ctl(L().epfd, EPOLL_CTL_ADD, fd, &ev);
+    return id;
+}
+
+void modifyFd(int fd, uint64_t id, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = id;
+    epoll_ctl(L().epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void unregisterFd(int fd, uint64_t id) {
+    epoll_ctl(L().epfd, EPOLL_CTL_DEL, fd, nullptr);
+    L().entries.erase(id);
+}
+
+bool alive(uint64_t id) {
+    return L().entries.count(id) != 0;
+}
+
+void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Keep flushing the unsent tail of a closed connection, like tcp_close().
+void lingerClose(int fd, std::string &tx) {
+    Entry entry;
+    entry.lingerFd = fd;
+    entry.lingerTx.swap(tx);
+    registerFd(fd, EPOLLOUT, entry);
+}
+
+void flushLinger(uint64_t id, Entry &entry, uint32_t events) {
+    if (!(events & (EPOLLERR | EPOLLHUP))) {
+        ssize_t n = ::send(entry.lingerFd, entry.lingerTx.data(), entry.lingerTx.size(), MSG_NOSIGNAL);
+        if (n > 0) entry.lingerTx.erase(0, (size_t)n);
+        if (!entry.lingerTx.empty() && (n > 0 || errno == EAGAIN || errno == EINTR)) return;
+    }
+    int fd = entry.lingerFd;
+    unregisterFd(fd, id);
+    ::close(fd);
+}
+
+} // namespace
+
+void loop(int timeoutMs) {
+    Loop &l = L();
+    unsigned long now = millis();
+    if (l.nextPoll == 0) l.nextPoll = now + ASYNCTCP_HOST_POLL_MS;
+    if (!l.acks.empty()) timeoutMs = 0;
+    long untilPoll = (long)(l.nextPoll - now);
+    if (untilPoll < 0) untilPoll = 0;
+    if (timeoutMs < 0 || untilPoll < timeoutMs) timeoutMs = (int)untilPoll;
+
+    struct epoll_event events[64];
+    int n = epoll_wait(l.epfd, events, 64, timeoutMs);
+    for (int i = 0; i < n; i++) {
+        uint64_t id = events[i].data.u64;
+        if (id == 0) {
+            uint64_t value;
+            while (read(l.wakefd, &value, sizeof(value)) > 0) {}
+            continue;
+        }
+        auto it = l.entries.find(id);
+        if (it == l.entries.end()) continue;
+        if (it->second.client)      Endpoint::events(it->second.client, events[i].events);
+        else if (it->second.server) Endpoint::events(it->second.server, events[i].events);
+        else                        flushLinger(id, it->second, events[i].events);
+    }
+
+    // Calls posted from other threads.
+    {
+        std::lock_guard<std::mutex> guard(l.postLock);
+        l.posted.swap(l.running);
+    }
+    for (auto &call : l.running) call.first(call.second);
+    l.running.clear();
+
+    // Deliver acks outside of the send() call that produced them.
+    std::vector<uint64_t> acks;
+    acks.swap(l.acks);
+    for (uint64_t id : acks) {
+        auto it = l.entries.find(id);
+        if (it != l.entries.end() && it->second.client) Endpoint::ack(it->second.client);
+    }
+
+    now = millis();
+    if ((long)(now - l.nextPoll) >= 0) {
+        l.nextPoll = now + ASYNCTCP_HOST_POLL_MS;
+        std::vector<uint64_t> ids;
+        for (auto &entry : l.entries)
+            if (entry.second.client) ids.push_back(entry.first);
+        for (uint64_t id : ids) {
+            auto it = l.entries.find(id);
+            if (it != l.entries.end() && it->second.client) Endpoint::poll(it->second.client);
+        }
+    }
+}
+
+void run() {
+    L().stopping = false;
+    while (!L().stopping) loop(-1);
+}
+
+static IPAddress bindAddress(0, 0, 0, 0);
+
+void setBindAddress(IPAddress addr) {
+    bindAddress = addr;
+}
+
+IPAddress getBindAddress() {
+    return bindAddress;
+}
+
+void stop() {
+    L().stopping = true;
+    uint64_t one = 1;
+    if (write(L().wakefd, &one, sizeof(one)) < 0) {}
+}
+
+void poll(AsyncClient *client) {
+    for (auto &entry : L().entries) {
+        if (entry.second.client == client) {
+            Endpoint::poll(client);
+            return;
+        }
+    }
+}
+
+void post(void (*fn)(void *), void *arg) {
+    {
+        std::lock_guard<std::mutex> guard(L().postLock);
+        L().posted.emplace_back(fn, arg);
+    }
+    uint64_t one = 1;
+    if (write(L().wakefd, &one, sizeof(one)) < 0) {}
+}
+
+} // namespace AsyncTCPHost
+
+using namespace AsyncTCPHost;
+
+//---------------------------------------------------------------------
+// AsyncClient
+//---------------------------------------------------------------------
+
+AsyncClient::AsyncClient(int fd) : _fd(fd) {
+    if (_fd >= 0) {
+        setNonBlocking(_fd);
+        Entry entry;
+        entry.client = this;
+        _id = registerFd(_fd, EPOLLIN, entry);
+    }
+}
+
+AsyncClient::~AsyncClient() {
+    _close();
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port) {
+    if (_fd >= 0) return false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = (uint32_t)ip;
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        ::close(fd);
+        return false;
+    }
+    // Even an immediate success is reported through onConnect from the loop.
+    _fd = fd;
+    _connecting = true;
+    Entry entry;
+    entry.client = this;
+    _id = registerFd(_fd, EPOLLOUT, entry);
+    return true;
+}
+
+void AsyncClient::close(bool now) {
+    if (now) abort();
+    else     _close();
+}
+
+int8_t AsyncClient::abort() {
+    if (_fd >= 0) {
+        struct linger lin = {1, 0};
+        setsockopt(_fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        _tx.clear();
+        _close();
+    }
+    return ERR_ABRT;
+}
+
+void AsyncClient::_close() {
+    if (_fd < 0) return;
+    unregisterFd(_fd, _id);
+    if (!_tx.empty() && !_connecting) {
+        lingerClose(_fd, _tx);
+    } else {
+        ::close(_fd);
+    }
+    _fd = -1;
+    _connecting = false;
+    if (_discardCb) {
+        AcConnectHandler cb = _discardCb;
+        cb(_discardArg, this);
+    }
+}
+
+void AsyncClient::_error(int8_t err) {
+    if (_fd < 0) return;
+    unregisterFd(_fd, _id);
+    ::close(_fd);
+    _fd = -1;
+    _connecting = false;
+    _tx.clear();
+    if (_errorCb) {
+        AcErrorHandler cb = _errorCb;
+        cb(_errorArg, this, err);
+    }
+    if (_discardCb) {
+        AcConnectHandler cb = _discardCb;
+        cb(_discardArg, this);
+    }
+}
+
+size_t AsyncClient::space() const {
+    if (_fd < 0 || _connecting) return 0;
+    return _tx.size() >= ASYNCTCP_HOST_SND_BUF ? 0 : ASYNCTCP_HOST_SND_BUF - _tx.size();
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+    (void)apiflags;
+    size_t room = space();
+    if (!data || size == 0 || room == 0) return 0;
+    size_t n = size < room ? size : room;
+    _tx.append(data, n);
+    return n;
+}
+
+bool AsyncClient::send() {
+    if (_fd < 0 || _connecting) return false;
+    _sentAt = millis();
+    // Like tcp_output(), never report a reset from here: callers are often
+    // in the middle of a callback, and the error is picked up by the event
+    // loop (EPOLLERR) instead.
+    _flush();
+    return true;
+}
+
+size_t AsyncClient::write(const char *data) {
+    return data ? write(data, strlen(data)) : 0;
+}
+
+size_t AsyncClient::write(const char *data, size_t size, uint8_t apiflags) {
+    size_t n = add(data, size, apiflags);
+    if (n) send();
+    return n;
+}
+
+size_t AsyncClient::ack(size_t len) {
+    if (len > _rxUnacked) len = _rxUnacked;
+    bool wasClosed = _rxUnacked >= ASYNCTCP_HOST_RCV_WND;
+    _rxUnacked -= len;
+    if (wasClosed && _rxUnacked < ASYNCTCP_HOST_RCV_WND) _updateInterest();
+    return len;
+}
+
+void AsyncClient::setNoDelay(bool nodelay) {
+    if (_fd < 0) return;
+    int flag = nodelay ? 1 : 0;
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+static bool sockName(int fd, bool peer, struct sockaddr_in &addr) {
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (fd < 0) return false;
+    int rc = peer ? getpeername(fd, (struct sockaddr *)&addr, &len)
+                  : getsockname(fd, (struct sockaddr *)&addr, &len);
+    return rc == 0;
+}
+
+IPAddress AsyncClient::localIP() const {
+    struct sockaddr_in addr;
+    return sockName(_fd, false, addr) ? IPAddress((uint32_t)addr.sin_addr.s_addr) : IPAddress();
+}
+
+uint16_t AsyncClient::localPort() const {
+    struct sockaddr_in addr;
+    return sockName(_fd, false, addr) ? ntohs(addr.sin_port) : 0;
+}
+
+IPAddress AsyncClient::remoteIP() const {
+    struct sockaddr_in addr;
+    return sockName(_fd, true, addr) ? IPAddress((uint32_t)addr.sin_addr.s_addr) : IPAddress();
+}
+
+uint16_t AsyncClient::remotePort() const {
+    struct sockaddr_in addr;
+    return sockName(_fd, true, addr) ? ntohs(addr.sin_port) : 0;
+}
+
+void AsyncClient::_updateInterest() {
+    if (_fd < 0) return;
+    uint32_t events = 0;
+    if (_connecting || !_tx.empty()) events |= EPOLLOUT;
+    if (!_connecting && _rxUnacked < ASYNCTCP_HOST_RCV_WND) events |= EPOLLIN;
+    modifyFd(_fd, _id, events);
+}
+
+bool AsyncClient::_flush() {
+    bool wasEmpty = _ackPending == 0;
+    while (!_tx.empty()) {
+        ssize_t n = ::send(_fd, _tx.data(), _tx.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) return false;
+        _tx.erase(0, (size_t)n);
+        _ackPending += (size_t)n;
+    }
+    if (wasEmpty && _ackPending) L().acks.push_back(_id);
+    _updateInterest();
+    return true;
+}
+
+void AsyncClient::_handleAck() {
+    if (_fd < 0 || _ackPending == 0) return;
+    size_t len = _ackPending;
+    _ackPending = 0;
+    if (_ackCb) {
+        AcAckHandler cb = _ackCb;
+        cb(_ackArg, this, len, millis() - _sentAt);
+    }
+}
+
+void AsyncClient::_handlePoll() {
+    if (_fd < 0 || _connecting) return;
+    if (_pollCb) {
+        AcConnectHandler cb = _pollCb;
+        cb(_pollArg, this);
+    }
+}
+
+void AsyncClient::_handleEvents(uint32_t events) {
+    uint64_t id = _id;
+
+    if (_connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR)) { _error(ERR_CONN); return; }
+        _connecting = false;
+        _updateInterest();
+        if (_connectCb) {
+            AcConnectHandler cb = _connectCb;
+            cb(_connectArg, this);
+        }
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (!_flush()) { _error(ERR_RST); return; }
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buf[ASYNCTCP_HOST_MSS];
+        // Bound the work per wakeup so one busy socket cannot starve the rest.
+        for (int i = 0; i < 16 && _rxUnacked < ASYNCTCP_HOST_RCV_WND; i++) {
+            size_t want = ASYNCTCP_HOST_RCV_WND - _rxUnacked;
+            if (want > sizeof(buf)) want = sizeof(buf);
+            ssize_t n = ::recv(_fd, buf, want, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            if (n < 0) { _error(ERR_RST); return; }
+            if (n == 0) { _close(); return; }
+            _ackNow = true;
+            if (_dataCb) {
+                AcDataHandler cb = _dataCb;
+                cb(_dataArg, this, buf, (size_t)n);
+                if (!alive(id) || _fd < 0) return;
+            }
+            if (!_ackNow) {
+                _rxUnacked += (size_t)n;
+                if (_rxUnacked >= ASYNCTCP_HOST_RCV_WND) _updateInterest();
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+// AsyncServer
+//---------------------------------------------------------------------
+
+AsyncServer::AsyncServer(uint16_t port) : _addr(AsyncTCPHost::getBindAddress()), _port(port) {}
+AsyncServer::AsyncServer(IPAddress addr, uint16_t port) : _addr(addr), _port(port) {}
+
+AsyncServer::~AsyncServer() {
+    end();
+}
+
+void AsyncServer::begin() {
+    if (_fd >= 0) return;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(_port);
+    addr.sin_addr.s_addr = (uint32_t)_addr;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        ::close(fd);
+        return;
+    }
+    _fd = fd;
+    Entry entry;
+    entry.server = this;
+    _id = registerFd(_fd, EPOLLIN, entry);
+}
+
+void AsyncServer::end() {
+    if (_fd < 0) return;
+    unregisterFd(_fd, _id);
+    ::close(_fd);
+    _fd = -1;
+}
+
+void AsyncServer::_handleEvents(uint32_t events) {
+    (void)events;
+    uint64_t id = _id;
+    for (;;) {
+        int cfd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (cfd < 0) return;
+        if (_noDelay) {
+            int one = 1;
+            setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        AsyncClient *client = new AsyncClient(cfd);
+        if (_connectCb) {
+            AcConnectHandler cb = _connectCb;
+            cb(_connectArg, client);
+        } else {
+            delete client;
+        }
+        // The handler may have ended or destroyed this server.
+        if (!alive(id) || _fd < 0) return;
+    }
+}
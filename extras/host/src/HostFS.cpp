@@ -0,0 +1,250 @@
+#include "HostFS.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+fs::HostFS LittleFS;
+fs::HostFS SD;
+
+namespace fs {
+
+class FileImpl {
+public:
+    ~FileImpl() { close(); }
+
+    void close() {
+        if (fd >= 0) { ::close(fd); fd = -1; }
+        if (dir) { closedir(dir); dir = nullptr; }
+    }
+
+    int fd = -1;
+    DIR *dir = nullptr;
+    const FS *owner = nullptr;
+    std::string path;     // path as seen by the library
+    std::string host;     // path on the host filesystem
+    std::string name;     // last path component
+};
+
+//---------------------------------------------------------------------
+// File
+//---------------------------------------------------------------------
+
+size_t File::write(const uint8_t *buf, size_t size) {
+    if (!_p || _p->fd < 0) return 0;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::write(_p->fd, buf + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+    if (!_p || _p->fd < 0) return 0;
+    ssize_t n;
+    do { n = ::read(_p->fd, buf, size); } while (n < 0 && errno == EINTR);
+    return n < 0 ? 0 : (size_t)n;
+}
+
+int File::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::available() {
+    if (!_p || _p->fd < 0) return 0;
+    return (int)(size() - position());
+}
+
+void File::flush() {
+    if (_p && _p->fd >= 0) fsync(_p->fd);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    if (!_p || _p->fd < 0) return false;
+    int whence = mode == SeekCur ? SEEK_CUR : (mode == SeekEnd ? SEEK_END : SEEK_SET);
+    return lseek(_p->fd, (off_t)pos, whence) >= 0;
+}
+
+size_t File::position() const {
+    if (!_p || _p->fd < 0) return 0;
+    off_t pos = lseek(_p->fd, 0, SEEK_CUR);
+    return pos < 0 ? 0 : (size_t)pos;
+}
+
+size_t File::size() const {
+    if (!_p || _p->fd < 0) return 0;
+    struct stat st;
+    return fstat(_p->fd, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+void File::close() {
+    if (_p) _p->close();
+    _p.reset();
+}
+
+File::operator bool() const {
+    return _p && (_p->fd >= 0 || _p->dir);
+}
+
+time_t File::getLastWrite() {
+    if (!_p) return 0;
+    struct stat st;
+    return stat(_p->host.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+
+const char *File::path() const { return _p ? _p->path.c_str() : nullptr; }
+const char *File::name() const { return _p ? _p->name.c_str() : nullptr; }
+
+bool File::isDirectory() {
+    return _p && _p->dir;
+}
+
+File File::openNextFile(const char *mode) {
+    if (!_p || !_p->dir) return File();
+    struct dirent *entry;
+    while ((entry = readdir(_p->dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        std::string child = _p->path;
+        if (child.empty() || child.back() != '/') child += '/';
+        child += entry->d_name;
+        File f = const_cast<FS *>(_p->owner)->open(child.c_str(), mode);
+        if (f) return f;
+    }
+    return File();
+}
+
+void File::rewindDirectory() {
+    if (_p && _p->dir) rewinddir(_p->dir);
+}
+
+//---------------------------------------------------------------------
+// FS
+//---------------------------------------------------------------------
+
+static int openFlags(const char *mode) {
+    bool plus = strchr(mode, '+') != nullptr;
+    switch (mode[0]) {
+        case 'w': return (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+        case 'a': return (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+        default:  return plus ? O_RDWR : O_RDONLY;
+    }
+}
+
+File FS::open(const char *path, const char *mode, const bool create) {
+    (void)create;
+    std::string host;
+    if (!path || !hostPath(path, host)) return File();
+
+    auto impl = std::make_shared<FileImpl>();
+    impl->owner = this;
+    impl->path = path;
+    impl->host = host;
+    size_t slash = impl->path.find_last_of('/');
+    impl->name = slash == std::string::npos ? impl->path : impl->path.substr(slash + 1);
+
+    struct stat st;
+    if (stat(host.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (mode[0] != 'r') return File();
+        impl->dir = opendir(host.c_str());
+        return impl->dir ? File(impl) : File();
+    }
+    impl->fd = ::open(host.c_str(), openFlags(mode) | O_CLOEXEC, 0644);
+    return impl->fd >= 0 ? File(impl) : File();
+}
+
+bool FS::exists(const char *path) {
+    std::string host;
+    struct stat st;
+    return hostPath(path, host) && stat(host.c_str(), &st) == 0;
+}
+
+bool FS::remove(const char *path) {
+    std::string host;
+    return hostPath(path, host) && unlink(host.c_str()) == 0;
+}
+
+bool FS::rename(const char *pathFrom, const char *pathTo) {
+    std::string from, to;
+    return hostPath(pathFrom, from) && hostPath(pathTo, to) && ::rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool FS::mkdir(const char *path) {
+    std::string host;
+    return hostPath(path, host) && (::mkdir(host.c_str(), 0755) == 0 || errno == EEXIST);
+}
+
+bool FS::rmdir(const char *path) {
+    std::string host;
+    return hostPath(path, host) && ::rmdir(host.c_str()) == 0;
+}
+
+//---------------------------------------------------------------------
+// HostFS
+//---------------------------------------------------------------------
+
+bool HostFS::begin(const char *rootDir) {
+    struct stat st;
+    if (!rootDir || stat(rootDir, &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    _root = rootDir;
+    while (_root.size() > 1 && _root.back() == '/') _root.pop_back();
+    return true;
+}
+
+uint64_t HostFS::totalBytes() {
+    struct statvfs st;
+    return statvfs(_root.c_str(), &st) == 0 ? (uint64_t)st.f_blocks * st.f_frsize : 0;
+}
+
+uint64_t HostFS::usedBytes() {
+    struct statvfs st;
+    return statvfs(_root.c_str(), &st) == 0 ? (uint64_t)(st.f_blocks - st.f_bavail) * st.f_frsize : 0;
+}
+
+bool HostFS::hostPath(const char *path, std::string &out) const {
+    if (_root.empty() || !path || path[0] != '/') return false;
+    // Refuse any ".." component so the library can never leave the root.
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        const char *end = p;
+        while (*end && *end != '/') end++;
+        if (end - p == 2 && p[0] == '.' && p[1] == '.') return false;
+        p = end;
+    }
+    out = _root;
+    if (strcmp(path, "/") != 0) out += path;
+    return true;
+}
+
+} // namespace fs
+
+//---------------------------------------------------------------------
+// Partitions
+//---------------------------------------------------------------------
+
+const uint8_t *asyncftpMapPartition(const char *name, size_t &size, uint32_t &handle) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);    // the mapping stays valid
+    if (data == MAP_FAILED) return nullptr;
+    size = (size_t)st.st_size;
+    handle = 0;
+    return (const uint8_t *)data;
+}
+
+void asyncftpUnmapPartition(const uint8_t *data, size_t size, uint32_t handle) {
+    (void)handle;
+    munmap((void *)data, size);
+}
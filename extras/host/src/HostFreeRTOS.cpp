@@ -0,0 +1,112 @@
+#include "HostFreeRTOS.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counting semaphore with an upper bound; mutexes and task notifications
+// are both built on it.
+struct HostSemaphore {
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t count;
+    uint32_t max;
+
+    HostSemaphore(uint32_t initial, uint32_t maximum) : count(initial), max(maximum) {}
+
+    bool take(TickType_t ticks, bool clearAll, uint32_t *taken) {
+        std::unique_lock<std::mutex> guard(lock);
+        auto ready = [this] { return count > 0; };
+        if (ticks == portMAX_DELAY) cv.wait(guard, ready);
+        else if (!cv.wait_for(guard, std::chrono::milliseconds(ticks), ready)) {
+            if (taken) *taken = 0;
+            return false;
+        }
+        if (taken) *taken = count;
+        count = clearAll ? 0 : count - 1;
+        return true;
+    }
+
+    bool give() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (count >= max) return false;
+        count++;
+        cv.notify_one();
+        return true;
+    }
+};
+
+struct HostTask {
+    HostSemaphore notification{0, UINT32_MAX};
+};
+
+static thread_local HostTask *currentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created,
+                                   BaseType_t core) {
+    (void)name; (void)stackDepth; (void)priority; (void)core;
+    // Handles stay valid for the life of the process, like a task that is
+    // never deleted; they are kept reachable so leak checkers stay quiet.
+    static std::mutex registryLock;
+    static std::vector<HostTask *> *registry = new std::vector<HostTask *>();
+    HostTask *task = new HostTask();
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        registry->push_back(task);
+    }
+    if (created) *created = task;
+    std::thread([task, function, parameters] {
+        currentTask = task;
+        function(parameters);
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created) {
+    return xTaskCreatePinnedToCore(function, name, stackDepth, parameters, priority, created,
+                                   tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    (void)task;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    task->notification.give();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+    if (!currentTask) return 0;
+    uint32_t taken = 0;
+    currentTask->notification.take(ticksToWait, clearCountOnExit, &taken);
+    return clearCountOnExit ? taken : (taken ? taken - 1 : 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return new HostSemaphore(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return new HostSemaphore(0, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+    return semaphore->take(ticksToWait, false, nullptr) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return semaphore->give() ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    delete semaphore;
+}
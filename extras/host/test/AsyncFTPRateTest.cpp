@@ -0,0 +1,200 @@
+// Rate limit tests: concurrent downloads from the server running on its own
+// thread, as in asyncftp_bench, must together stay within the server-wide
+// limit set by setRateLimit(), and each within the per-session one.
+//
+//   asyncftp_rate_test [-p port]
+//
+// Exits non-zero if a limit is exceeded or left far from used.
+
+#include "AsyncFTP.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint32_t FILE_SIZE = 300000;
+static const int FILES = 4;             // downloaded one after another per client
+
+static std::string root;
+
+static int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = { 30, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Just enough of a client to log in and RETR one file.
+class TestClient {
+public:
+    ~TestClient() {
+        if (_fd >= 0) close(_fd);
+    }
+
+    bool open(uint16_t port) {
+        _fd = connectTo(port);
+        return _fd >= 0 && reply() == 220 && command("USER test") == 331 && command("PASS test") == 230 &&
+               command("TYPE I") == 200;
+    }
+
+    int command(const std::string &line) {
+        std::string out = line + "\r\n";
+        if (::send(_fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) return -1;
+        return reply();
+    }
+
+    int reply() {
+        for (;;) {
+            size_t eol;
+            while ((eol = _in.find("\r\n")) == std::string::npos) {
+                char buf[512];
+                ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+                if (n <= 0) return -1;
+                _in.append(buf, n);
+            }
+            std::string line = _in.substr(0, eol);
+            _in.erase(0, eol + 2);
+            if (line.size() >= 4 && isdigit((unsigned char)line[0]) && line[3] == ' ') {
+                _last = line;
+                return atoi(line.c_str());
+            }
+        }
+    }
+
+    // Bytes received, or -1 on failure.
+    long long retrieve(const char *path) {
+        if (command("PASV") != 227) return -1;
+        unsigned h1, h2, h3, h4, p1, p2;
+        const char *open = strchr(_last.c_str(), '(');
+        if (!open || sscanf(open, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) return -1;
+        int data = connectTo((uint16_t)(p1 * 256 + p2));
+        if (data < 0) return -1;
+        if (command(std::string("RETR ") + path) != 150) { close(data); return -1; }
+        long long total = 0;
+        char buf[16384];
+        ssize_t n;
+        while ((n = recv(data, buf, sizeof(buf), 0)) > 0) total += n;
+        close(data);
+        return reply() == 226 ? total : -1;
+    }
+
+private:
+    int _fd = -1;
+    std::string _in;
+    std::string _last;
+};
+
+// Have `count` clients each download FILES files in a row, all at once;
+// the combined bytes per second, or -1. Starting one transfer after the
+// other must not give each a fresh burst.
+static double downloadRate(uint16_t port, int count) {
+    std::vector<TestClient> clients(count);
+    for (TestClient &client : clients)
+        if (!client.open(port)) return -1;
+    std::vector<long long> got(count);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < count; i++) {
+        threads.emplace_back([&, i] {
+            char path[32];
+            snprintf(path, sizeof(path), "/file%d.bin", i);
+            for (int n = 0; n < FILES; n++) {
+                long long len = clients[i].retrieve(path);
+                got[i] = len < 0 || got[i] < 0 ? -1 : got[i] + len;
+            }
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    long long total = 0;
+    for (long long n : got) {
+        if (n != (long long)FILE_SIZE * FILES) return -1;
+        total += n;
+    }
+    return total / seconds;
+}
+
+static int failures = 0;
+
+// The rate may exceed limit only by one burst, spread over the run.
+static void expectRate(const char *name, double rate, uint32_t limit, uint32_t bytes) {
+    double seconds = bytes / (double)limit;
+    double most = (bytes / (seconds - FTP_RATE_BURST / 1000.0)) * 1.05;
+    double least = limit * 0.7;
+    bool ok = rate >= least && rate <= most;
+    fprintf(stderr, "%s: %.0f bytes/s (limit %u, allowed %.0f-%.0f) %s\n", name, rate, limit, least, most,
+            ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return ::remove(path);
+}
+
+int main(int argc, char **argv) {
+    uint16_t port = 21220;
+    int c;
+    while ((c = getopt(argc, argv, "p:h")) != -1) {
+        switch (c) {
+            case 'p': port = (uint16_t)atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p port]\n", argv[0]);
+                return c == 'h' ? 0 : 2;
+        }
+    }
+
+    char scratch[] = "/tmp/asyncftp_rate.XXXXXX";
+    if (!mkdtemp(scratch) || !LittleFS.begin(scratch)) {
+        fprintf(stderr, "cannot create scratch directory\n");
+        return 1;
+    }
+    root = scratch;
+    std::vector<char> payload(FILE_SIZE, 'x');
+    for (int i = 0; i < 3; i++) {
+        FILE *f = fopen((root + "/file" + std::to_string(i) + ".bin").c_str(), "wb");
+        if (!f || fwrite(payload.data(), 1, payload.size(), f) != payload.size()) return 1;
+        fclose(f);
+    }
+
+    AsyncTCPHost::setBindAddress(IPAddress(127, 0, 0, 1));
+    AsyncFTP server(port, FTP_FS::LITTLEFS);
+    server.begin("test", "test", 3);
+    std::thread loop([] { AsyncTCPHost::run(); });
+
+    // The server logs every command; keep that out of the test output.
+    fflush(stdout);
+    if (!freopen("/dev/null", "w", stdout)) {}
+
+    // Two and three transfers sharing a server-wide limit.
+    server.setRateLimit(0, 1000000);
+    expectRate("total, 2 transfers", downloadRate(port, 2), 1000000, 2 * FILE_SIZE * FILES);
+    expectRate("total, 3 transfers", downloadRate(port, 3), 1000000, 3 * FILE_SIZE * FILES);
+
+    // A per-session limit on its own, and below the total share.
+    server.setRateLimit(500000, 0);
+    expectRate("per session, 2 transfers", downloadRate(port, 2), 1000000, 2 * FILE_SIZE * FILES);
+    server.setRateLimit(300000, 1000000);
+    expectRate("per session under total", downloadRate(port, 2), 600000, 2 * FILE_SIZE * FILES);
+
+    AsyncTCPHost::stop();
+    loop.join();
+    nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    if (failures) fprintf(stderr, "%d rate check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
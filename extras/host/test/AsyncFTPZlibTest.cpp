@@ -0,0 +1,291 @@
+// MODE Z codec tests: deflate/inflate round trips, and malformed or
+// truncated zlib streams that a client could upload.
+//
+//   asyncftp_zlib_test
+//
+// Exits non-zero if any check fails. Build with -DASYNCFTP_SANITIZE=ON to
+// also catch out-of-bounds access in the decoder.
+
+#include "AsyncFTPZlib.h"
+
+#include <random>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, current, #cond); failures++; } \
+} while (0)
+
+static const char *current = "";
+
+typedef std::vector<uint8_t> Bytes;
+
+enum Outcome { DONE, FAILED, INCOMPLETE, STUCK };
+
+// Feed stream to a decompressor piece bytes at a time, as the STOR path
+// does, collecting the output.
+static Outcome inflateStream(const Bytes &stream, Bytes *out, size_t piece = 1460,
+                             uint8_t maxBits = FTP_MODEZ_INFLATE_BITS) {
+    AsyncFTPInflate inflate;
+    inflate.begin(maxBits);
+    size_t pos = 0;
+    while (pos < stream.size() || !inflate.done()) {
+        size_t n;
+        const uint8_t *data = inflate.output(n);
+        if (n > 0) {
+            if (out) out->insert(out->end(), data, data + n);
+            inflate.consume(n);
+            continue;
+        }
+        if (inflate.failed()) return FAILED;
+        if (inflate.done()) break;
+        if (pos == stream.size()) return INCOMPLETE;
+        size_t len = stream.size() - pos < piece ? stream.size() - pos : piece;
+        size_t taken = inflate.write(stream.data() + pos, len);
+        // Taking nothing is only allowed while there is output to drain.
+        if (taken == 0 && !inflate.failed() && !inflate.done() && (inflate.output(n), n == 0))
+            return STUCK;
+        pos += taken;
+    }
+    return inflate.done() && pos == stream.size() ? DONE : FAILED;
+}
+
+static Bytes deflateData(const Bytes &data, uint8_t level) {
+    AsyncFTPDeflate deflate;
+    Bytes out;
+    if (!deflate.begin(level)) return out;
+    size_t pos = 0;
+    bool finished = false;
+    while (!deflate.done()) {
+        size_t n;
+        const uint8_t *chunk = deflate.output(n);
+        if (n > 0) {
+            out.insert(out.end(), chunk, chunk + n);
+            deflate.consume(n);
+            continue;
+        }
+        if (pos < data.size()) {
+            pos += deflate.write(data.data() + pos, data.size() - pos);
+        }
+        else if (!finished) {
+            deflate.finish();
+            finished = true;
+        }
+    }
+    return out;
+}
+
+// Writes deflate bits LSB first, Huffman codes MSB first.
+struct BitWriter {
+    Bytes bytes;
+    uint32_t buf = 0;
+    uint8_t count = 0;
+
+    void bits(uint32_t value, uint8_t n) {
+        buf |= value << count;
+        count += n;
+        while (count >= 8) {
+            bytes.push_back(buf & 0xFF);
+            buf >>= 8;
+            count -= 8;
+        }
+    }
+    void code(uint32_t value, uint8_t n) {
+        for (int i = n - 1; i >= 0; i--) bits((value >> i) & 1, 1);
+    }
+    // Fixed Huffman literal/length symbol.
+    void fixedSymbol(int sym) {
+        if (sym < 144)      code(0x30 + sym, 8);
+        else if (sym < 256) code(0x190 + sym - 144, 9);
+        else if (sym < 280) code(sym - 256, 7);
+        else                code(0xC0 + sym - 280, 8);
+    }
+    Bytes finish() {
+        if (count) bits(0, 8 - count);
+        return bytes;
+    }
+};
+
+// zlib header for a window of 2^bits, with a valid check value.
+static Bytes header(uint8_t bits, bool dictionary = false) {
+    uint8_t cmf = ((bits - 8) << 4) | 8;
+    uint8_t flg = dictionary ? 0x20 : 0;
+    flg += 31 - ((cmf << 8) | flg) % 31;
+    return Bytes{cmf, flg};
+}
+
+static Bytes concat(Bytes a, const Bytes &b) {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+static Bytes sampleText(size_t size) {
+    Bytes data;
+    std::mt19937 rng(1);
+    const char *words[] = {"sensor", "temperature", "22.5", "humidity", "48", "ok", "\n", ",", "2026-10-16"};
+    while (data.size() < size) {
+        const char *w = words[rng() % 9];
+        data.insert(data.end(), w, w + strlen(w));
+    }
+    data.resize(size);
+    return data;
+}
+
+static void testRoundTrip() {
+    current = "round trip";
+    std::mt19937 rng(2);
+    Bytes random(70000);
+    for (uint8_t &b : random) b = rng();
+    for (const Bytes &data : {Bytes(), sampleText(100), sampleText(200000), random}) {
+        for (uint8_t level : {0, 1, 6, 9}) {
+            Bytes stream = deflateData(data, level);
+            for (size_t piece : {1, 7, 1460}) {
+                Bytes out;
+                CHECK(inflateStream(stream, &out, piece) == DONE);
+                CHECK(out == data);
+            }
+        }
+    }
+}
+
+static void testHeader() {
+    current = "header";
+    Bytes empty = deflateData(Bytes(), 6);
+    CHECK(inflateStream(empty, nullptr) == DONE);
+
+    Bytes bad = empty;
+    bad[0] = (bad[0] & 0xF0) | 7;       // compression method 7
+    bad[1] += 31 - ((bad[0] << 8) | bad[1]) % 31;
+    CHECK(inflateStream(bad, nullptr) == FAILED);
+
+    bad = empty;
+    bad[1] ^= 1;                        // check value off
+    CHECK(inflateStream(bad, nullptr) == FAILED);
+
+    // A preset dictionary is never available.
+    CHECK(inflateStream(concat(header(15, true), Bytes(empty.begin() + 2, empty.end())), nullptr) == FAILED);
+
+    // A window larger than the decoder accepts.
+    CHECK(inflateStream(concat(header(15), Bytes(empty.begin() + 2, empty.end())), nullptr, 1460, 12) == FAILED);
+    CHECK(inflateStream(concat(header(12), Bytes(empty.begin() + 2, empty.end())), nullptr, 1460, 12) == DONE);
+}
+
+static void testBlocks() {
+    current = "blocks";
+    // Reserved block type 3.
+    BitWriter reserved;
+    reserved.bits(1, 1);
+    reserved.bits(3, 2);
+    CHECK(inflateStream(concat(header(15), reserved.finish()), nullptr) == FAILED);
+
+    // Stored block whose NLEN is not the complement of LEN.
+    CHECK(inflateStream(concat(header(15), Bytes{0x01, 0x05, 0x00, 0x00, 0x00, 'a'}), nullptr) == FAILED);
+
+    // A match reaching back before the start of the output.
+    BitWriter far;
+    far.bits(1, 1);
+    far.bits(1, 2);
+    far.fixedSymbol('a');
+    far.fixedSymbol(257);               // length 3
+    far.code(1, 5);                     // distance 2, one byte of history
+    far.fixedSymbol(256);
+    CHECK(inflateStream(concat(header(15), far.finish()), nullptr) == FAILED);
+
+    // Distance codes 30 and 31 do not exist.
+    BitWriter distance;
+    distance.bits(1, 1);
+    distance.bits(1, 2);
+    distance.fixedSymbol('a');
+    distance.fixedSymbol(257);
+    distance.code(30, 5);
+    CHECK(inflateStream(concat(header(15), distance.finish()), nullptr) == FAILED);
+
+    // Nor do length symbols 286 and 287.
+    BitWriter length;
+    length.bits(1, 1);
+    length.bits(1, 2);
+    length.fixedSymbol(286);
+    CHECK(inflateStream(concat(header(15), length.finish()), nullptr) == FAILED);
+}
+
+static void testTables() {
+    current = "tables";
+    // More than 286 literal/length codes.
+    BitWriter hlit;
+    hlit.bits(1, 1);
+    hlit.bits(2, 2);
+    hlit.bits(30, 5);
+    hlit.bits(0, 5);
+    hlit.bits(0, 4);
+    hlit.bits(0, 32);
+    CHECK(inflateStream(concat(header(15), hlit.finish()), nullptr) == FAILED);
+
+    // Every code length code of length 1: over-subscribed.
+    BitWriter over;
+    over.bits(1, 1);
+    over.bits(2, 2);
+    over.bits(0, 5);
+    over.bits(0, 5);
+    over.bits(15, 4);
+    for (int i = 0; i < 19; i++) over.bits(1, 3);
+    over.bits(0, 32);
+    CHECK(inflateStream(concat(header(15), over.finish()), nullptr) == FAILED);
+
+    // Repeat of the previous length with no previous length.
+    BitWriter repeat;
+    repeat.bits(1, 1);
+    repeat.bits(2, 2);
+    repeat.bits(0, 5);
+    repeat.bits(0, 5);
+    repeat.bits(0, 4);                  // code length codes 16, 17, 18 and 0
+    for (int i = 0; i < 4; i++) repeat.bits(2, 3);
+    repeat.code(1, 2);                  // 16: repeat the previous length
+    repeat.bits(0, 32);
+    CHECK(inflateStream(concat(header(15), repeat.finish()), nullptr) == FAILED);
+}
+
+static void testTrailer() {
+    current = "trailer";
+    Bytes data = sampleText(5000);
+    Bytes stream = deflateData(data, 6);
+    Bytes bad = stream;
+    bad.back() ^= 0x55;
+    CHECK(inflateStream(bad, nullptr) == FAILED);
+
+    // Cut anywhere, a stream is incomplete, never done.
+    for (size_t cut = 0; cut < stream.size(); cut += 1 + cut / 8)
+        CHECK(inflateStream(Bytes(stream.begin(), stream.begin() + cut), nullptr, 100) == INCOMPLETE);
+}
+
+static void testMutations() {
+    current = "mutations";
+    // Damaged streams must end in failure or incompletion without reading
+    // or writing out of bounds, and never produce more than they could.
+    std::mt19937 rng(3);
+    Bytes data = sampleText(20000);
+    Bytes stream = deflateData(data, 9);
+    Bytes fixed = deflateData(sampleText(300), 1);
+    for (int i = 0; i < 3000; i++) {
+        Bytes bad = (i & 1) ? stream : fixed;
+        int flips = 1 + rng() % 4;
+        for (int f = 0; f < flips; f++) bad[2 + rng() % (bad.size() - 2)] ^= 1 << (rng() % 8);
+        if (rng() % 4 == 0) bad.resize(2 + rng() % (bad.size() - 2));
+        Bytes out;
+        Outcome outcome = inflateStream(bad, &out, 1 + rng() % 2000);
+        CHECK(outcome != STUCK);
+        CHECK(out.size() <= 258 * 8 * bad.size() + 65536);
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testHeader();
+    testBlocks();
+    testTables();
+    testTrailer();
+    testMutations();
+    if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+    else          printf("all zlib tests passed\n");
+    return failures ? 1 : 0;
+}
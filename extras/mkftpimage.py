@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Build a read-only AsyncFTP image (FTP_FS::IMAGE) from a directory.
+
+    mkftpimage.py www/ www.img [--size 0x100000]
+
+Flash it into a data partition and serve it with ftpServer.mountImage():
+
+    parttool.py write_partition --partition-name=www --input www.img
+
+The format is described in src/AsyncFTPImage.h.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = b"FTPIMG01"
+HEADER = 16
+ENTRY = 16
+ALIGN = 4
+
+
+def collect(root):
+    files = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for name in filenames:
+            full = os.path.join(dirpath, name)
+            rel = os.path.relpath(full, root).replace(os.sep, "/")
+            files.append((rel.encode("utf-8"), full))
+    # The server finds files by binary search over the raw bytes (strcmp).
+    files.sort(key=lambda f: f[0])
+    return files
+
+
+def build(root):
+    files = collect(root)
+    names = b""
+    name_offsets = []
+    names_start = HEADER + ENTRY * len(files)
+    for rel, _ in files:
+        name_offsets.append(names_start + len(names))
+        names += rel + b"\0"
+    data = b""
+    data_start = names_start + len(names)
+    data_start += -data_start % ALIGN
+    entries = b""
+    for (rel, full), name_offset in zip(files, name_offsets):
+        with open(full, "rb") as f:
+            content = f.read()
+        entries += struct.pack("<IIII", name_offset, data_start + len(data), len(content),
+                               int(os.path.getmtime(full)) & 0xFFFFFFFF)
+        data += content + b"\0" * (-len(content) % ALIGN)
+    body = entries + names
+    body += b"\0" * (data_start - HEADER - len(body))
+    length = data_start + len(data)
+    return MAGIC + struct.pack("<II", len(files), length) + body + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("directory")
+    parser.add_argument("image")
+    parser.add_argument("--size", type=lambda s: int(s, 0),
+                        help="pad the image to this partition size, in bytes")
+    args = parser.parse_args()
+    if not os.path.isdir(args.directory):
+        sys.exit("%s is not a directory" % args.directory)
+    image = build(args.directory)
+    if args.size is not None:
+        if len(image) > args.size:
+            sys.exit("image is %d bytes, larger than %d" % (len(image), args.size))
+        image += b"\xff" * (args.size - len(image))
+    with open(args.image, "wb") as f:
+        f.write(image)
+    print("%s: %d bytes" % (args.image, len(image)))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,5 +1,6 @@
-#include <WiFi.h>
 #include "AsyncFTP.h"
+#include <new>
+#include <time.h>
 
 // === Global login credentials ===
 String ASYNCFTP_Username = "admin";
@@ -18,92 +19,299 @@ static FS* getFilesystem(FTP_FS ftpfs) {
     }
 }
 
-// Join two path components ensuring exactly one '/' separator.
-static String joinPath(const String &base, const String &sub) {
-    if (base.endsWith("/")) return base + sub;
-    else                    return base + "/" + sub;
+// Free bytes on the selected filesystem; false if it cannot tell.
+static bool freeSpace(FTP_FS ftpfs, uint64_t &bytes) {
+    uint64_t total = 0, used = 0;
+    switch (ftpfs) {
+        case FTP_FS::LITTLEFS: total = LittleFS.totalBytes(); used = LittleFS.usedBytes(); break;
+        case FTP_FS::SD_CARD:  total = SD.totalBytes();       used = SD.usedBytes();       break;
+        default:               break;
+    }
+    if (total == 0) return false;
+    bytes = used < total ? total - used : 0;
+    return true;
+}
+
+// Temporary name under which session uploads path: ".<name>.<session>.part"
+// in the same directory, so that renaming it over path stays within one
+// directory; with suffix "old", where the old file is kept while it is
+// replaced. False if it does not fit in FTPPATHMAX.
+static bool tempUploadPath(char *out, const char *path, uint8_t session, const char *suffix = "part") {
+    const char *name = strrchr(path, '/') + 1;
+    int n = snprintf(out, FTPPATHMAX, "%.*s.%s.%u.%s", (int)(name - path), path, name, (unsigned)session, suffix);
+    return n > 0 && n < FTPPATHMAX;
+}
+
+// Resolve a possibly relative path against cwd into out (size bytes), in
+// canonical form: no "." or ".." segments, no repeated or trailing slashes.
+// The directory cache relies on every spelling of a path mapping to one key.
+// Returns false if the result does not fit.
+static bool resolvePath(char *out, size_t size, const char *cwd, const char *param) {
+    int n;
+    if (param[0] == '/')          n = snprintf(out, size, "%s", param);
+    else if (strcmp(cwd, "/") == 0) n = snprintf(out, size, "/%s", param);
+    else                          n = snprintf(out, size, "%s/%s", cwd, param);
+    if (n < 0 || (size_t)n >= size) return false;
+
+    // Rewrite in place; the output never runs ahead of the input.
+    size_t len = 0;
+    const char *p = out;
+    while (*p) {
+        while (*p == '/') p++;
+        const char *segment = p;
+        while (*p && *p != '/') p++;
+        size_t segmentLength = p - segment;
+        if (segmentLength == 0 || (segmentLength == 1 && segment[0] == '.')) continue;
+        if (segmentLength == 2 && segment[0] == '.' && segment[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') len--;   // drop the last segment
+            if (len > 0) len--;
+            continue;
+        }
+        out[len] = '/';
+        memmove(out + len + 1, segment, segmentLength);
+        len += 1 + segmentLength;
+    }
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return true;
+}
+
+// Pack a command verb into a 32-bit key, first letter in the top byte.
+// Three-letter verbs ("CWD") leave the low byte zero.
+static constexpr uint32_t ftpVerb(const char *verb) {
+    return ((uint32_t)(uint8_t)verb[0] << 24) | ((uint32_t)(uint8_t)verb[1] << 16) |
+           ((uint32_t)(uint8_t)verb[2] << 8)  |  (uint32_t)(uint8_t)verb[3];
+}
+
+// Unpack a verb from ftpVerb() into a NUL-terminated string.
+static void unpackVerb(uint32_t verb, char *out) {
+    for (int i = 0; i < 4; i++) out[i] = (char)(verb >> (24 - 8 * i));
+    out[4] = '\0';
+}
+
+static bool isUpload(uint32_t verb) {
+    return verb == ftpVerb("STOR") || verb == ftpVerb("APPE");
+}
+
+// STOR buffer for a configured size (0: the backend's preferred one):
+// whole blocks only, and never more than the receive window can hold back.
+static size_t storBlockSize(size_t size, const FTPBackendTraits &backend) {
+    if (size == 0) size = backend.writeSize;
+    if (size > STOR_MAX_UNACKED) size = STOR_MAX_UNACKED - STOR_MAX_UNACKED % backend.writeAlign;
+    return size;
+}
+
+// FNV-1a of len bytes, continuing from hash (FNV_BASIS for a new one).
+static const uint32_t FNV_BASIS = 2166136261u;
+static uint32_t fnv1a(uint32_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    return hash;
+}
+
+// FTPListFormat::pathHash of an absolute directory path.
+static uint32_t directoryHash(const char *path) {
+    uint32_t hash = fnv1a(FNV_BASIS, path, strlen(path));
+    return strcmp(path, "/") == 0 ? hash : fnv1a(hash, "/", 1);
+}
+
+// MLSD fact names, in FTPListFormat bit order.
+static const char *const factNames[] = { "type", "size", "modify", "unique" };
+static const uint8_t FACT_COUNT = sizeof(factNames) / sizeof(factNames[0]);
+
+// Heap reserved for each open session: its control connection and, should
+// it pipeline commands, the queue.
+static const size_t SESSION_HEAP = FTP_HEAP_CONNECTION + FTP_PIPELINE_BUFFER;
+
+// Close a connection that nobody serves and delete it once closed.
+static void discardClient(AsyncClient *client) {
+    client->onDisconnect([](void *arg, AsyncClient *client) { delete client; }, nullptr);
+    client->close();
 }
 
 //---------------------------------------------------------------------
 // FTP File/Directory functions
 //---------------------------------------------------------------------
 
-String _FTPDirectoryList(String path, FTP_FS ftpfs) {
-    FS *filesystem = getFilesystem(ftpfs);
-    if (!filesystem) { return "550 Failed to open directory. No Filesystem Found\r\n"; }
-
+fs::File _FTPOpenDirectory(FS *filesystem, const char *path) {
+    if (!filesystem) return fs::File();
     File dir = filesystem->open(path);
-    if (!dir)        { return "550 Failed to open directory\r\n"; }
+    if (dir && !dir.isDirectory()) dir.close();
+    return dir;
+}
 
-    String listing = "";
-    File file = dir.openNextFile();
-    while (file) {
-        if (file.isDirectory()) listing += "drwxr-xr-x 1 user group ";
-        else                    listing += "-rw-r--r-- 1 owner group ";
-        listing += String(file.size()) + " Jan 1 00:00 " + String(file.name()) + "\r\n";
-        file = dir.openNextFile();
+static_assert(FILEBUFFERSIZE >= LISTLINEMAX, "FILEBUFFERSIZE must hold at least one LIST line");
+static_assert(FILEBUFFERSIZE >= AsyncFTPTarWriter::MIN_BUFFER, "FILEBUFFERSIZE must hold a tar header with its long name");
+
+size_t _FTPListLine(const FTPDirEntry &entry, const FTPListFormat &format, char *buffer, size_t size) {
+    time_t when = entry.lastWrite;
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    int n;
+    if (format.style == FTPListFormat::NAMES)
+        n = snprintf(buffer, size, "%.*s\r\n", (int)entry.nameLength, entry.name);
+    else if (format.style == FTPListFormat::FACTS) {
+        // RFC 3659 facts; times are UTC, and unknown ones are left out.
+        char facts[96];
+        size_t len = 0;
+        if (format.facts & FTPListFormat::TYPE)
+            len += snprintf(facts + len, sizeof(facts) - len, "type=%s;", entry.isDirectory ? "dir" : "file");
+        if ((format.facts & FTPListFormat::SIZE) && !entry.isDirectory)
+            len += snprintf(facts + len, sizeof(facts) - len, "size=%u;", (unsigned)entry.size);
+        if ((format.facts & FTPListFormat::MODIFY) && entry.lastWrite)
+            len += strftime(facts + len, sizeof(facts) - len, "modify=%Y%m%d%H%M%S;", &tm);
+        if (format.facts & FTPListFormat::UNIQUE)
+            len += snprintf(facts + len, sizeof(facts) - len, "unique=%08x;",
+                            (unsigned)fnv1a(format.pathHash, entry.name, entry.nameLength));
+        facts[len] = '\0';
+        n = snprintf(buffer, size, "%s %.*s\r\n", facts, (int)entry.nameLength, entry.name);
     }
-    dir.close();
-    return listing;
+    else {
+        // Like ls: the time of day for the last six months, the year otherwise.
+        char date[16];
+        time_t now = time(nullptr);
+        bool recent = when <= now && now - when < 183L * 24 * 3600;
+        strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        n = snprintf(buffer, size, "%s %u %s %.*s\r\n",
+                     entry.isDirectory ? "drwxr-xr-x 1 user group" : "-rw-r--r-- 1 owner group",
+                     (unsigned)entry.size, date, (int)entry.nameLength, entry.name);
+    }
+    return n > 0 ? (size_t)n : 0;
+}
+
+size_t _FTPDirectoryList(fs::File &dir, const FTPListFormat &format, FTPListFilter &filter,
+                         char *buffer, size_t size, AsyncFTPDirCache *cache, int8_t fill) {
+    // Stop while a worst-case line still fits, so no entry is ever split.
+    size_t len = 0;
+    while (size - len >= LISTLINEMAX && !filter.done()) {
+        File file = dir.openNextFile();
+        if (!file) break;
+        FTPDirEntry entry;
+        entry.name = file.name();
+        size_t nameLength = strlen(entry.name);
+        entry.nameLength = nameLength > 255 ? 255 : (uint8_t)nameLength;
+        entry.isDirectory = file.isDirectory();
+        entry.size = file.size();
+        entry.lastWrite = (uint32_t)file.getLastWrite();
+        if (filter.admit(entry)) len += _FTPListLine(entry, format, buffer + len, size - len);
+        if (cache) cache->addEntry(fill, entry);
+        file.close();
+    }
+    return len;
 }
 
-bool _FTPCreateDirectory(FTP_FS ftpfs, String path) {
-    FS *filesystem = getFilesystem(ftpfs);
+bool _FTPCreateDirectory(FS *filesystem, const char *path) {
     if (!filesystem) return false;
     return filesystem->mkdir(path);
 }
 
-bool _FTPDeleteDirectory(FTP_FS ftpfs, String path) {
-    FS *filesystem = getFilesystem(ftpfs);
+bool _FTPDeleteDirectory(FS *filesystem, const char *path) {
     if (!filesystem) return false;
     return filesystem->rmdir(path);
 }
 
-bool _FTPDeleteFile(FTP_FS ftpfs, String path) {
-    FS *filesystem = getFilesystem(ftpfs);
+bool _FTPDeleteFile(FS *filesystem, const char *path) {
     if (!filesystem) return false;
     return filesystem->remove(path);
 }
 
-fs::File _FTPCreateFile(FTP_FS ftpfs, String path) {
-    FS *filesystem = getFilesystem(ftpfs);
+fs::File _FTPCreateFile(FS *filesystem, const char *path) {
     if (!filesystem) return fs::File();
     return filesystem->open(path, "w");
 }
 
-fs::File _FTPOpenFile(FTP_FS ftpfs, String path) {
-    FS *filesystem = getFilesystem(ftpfs);
+fs::File _FTPResumeFile(FS *filesystem, const char *path, uint32_t offset) {
+    if (offset == 0) return _FTPCreateFile(filesystem, path);
+    if (!filesystem) return fs::File();
+    File file = filesystem->open(path, "r+");
+    if (file && (file.isDirectory() || offset > file.size() || !file.seek(offset)))
+        file.close();
+    return file;
+}
+
+fs::File _FTPAppendFile(FS *filesystem, const char *path) {
+    if (!filesystem) return fs::File();
+    return filesystem->open(path, "a");
+}
+
+fs::File _FTPOpenFile(FS *filesystem, const char *path) {
     if (!filesystem) return fs::File();
     return filesystem->open(path, "r");
 }
 
-bool _FTPMoveFile(FTP_FS ftpfs, String from, String to) {
-    FS *filesystem = getFilesystem(ftpfs);
+bool _FTPMoveFile(FS *filesystem, const char *from, const char *to) {
     if (!filesystem) return false;
     return filesystem->rename(from, to);
 }
 
-// A helper to resolve a path that might be absolute or relative:
-static String resolvePath(const String &cwd, const String &param) {
-  if (param.startsWith("/")) { return param; } 
-  else {
-    if (cwd == "/") { return "/" + param; } 
-    else            { return cwd + "/" + param; }
-  }
+bool _FTPReplaceFile(FS *filesystem, const char *from, const char *to, const char *backup) {
+    if (_FTPMoveFile(filesystem, from, to)) return true;
+    if (!filesystem) return false;
+    // Anything under the backup name is left over from an earlier failure
+    // and older than to.
+    filesystem->remove(backup);
+    if (!_FTPMoveFile(filesystem, to, backup)) return false;
+    if (_FTPMoveFile(filesystem, from, to)) {
+        if (!filesystem->remove(backup)) FTP_LOGW("could not remove %s", backup);
+        return true;
+    }
+    if (!_FTPMoveFile(filesystem, backup, to)) FTP_LOGE("could not restore %s; it is kept as %s", to, backup);
+    return false;
 }
 
-
 //---------------------------------------------------------------------
 // AsyncFTP methods
 //---------------------------------------------------------------------
 
-AsyncFTP::AsyncFTP(uint16_t port, FTP_FS ftpfs): _port(port), _FTPFS(ftpfs) {}
+AsyncFTP::AsyncFTP(uint16_t port, FTP_FS ftpfs)
+    : _port(port), _FTPFS(ftpfs), _backend(ftpBackendTraits(ftpfs)), _filesystem(getFilesystem(ftpfs)) {}
+
+AsyncFTP::~AsyncFTP() {
+    delete _asyncServer;
+    delete[] _sessions;
+    for (uint16_t i = 0; i < _passivePortCount; i++) delete _passivePorts[i].server;
+    delete[] _passivePorts;
+}
 
 // Updated begin method with optional username and password parameters.
-void AsyncFTP::begin(const String &username, const String &password) {
+void AsyncFTP::begin(const String &username, const String &password, uint8_t maxSessions) {
     if (username.length() > 0) { setUsername(username); }
     if (password.length() > 0) { setPassword(password); }
+    if (!_sessions) {
+        _sessions = new (std::nothrow) AsyncFTPClient[maxSessions];
+        _maxSessions = _sessions ? maxSessions : 0;
+    }
+    if (_dirCacheSize > 0) _dirCache.begin(_dirCacheSize, _dirCacheTTL, _backend.caseless);
+    if (_fileCacheSize > 0) _fileCache.begin(_fileCacheSize, _fileCacheMaxFile, _fileCacheTTL, _backend.caseless);
+    _hashCache.begin(_backend.caseless);
+    AsyncFTPLog::begin();
+    // Nothing to read ahead from a mapped image.
+    if (_backend.readSize > 0) _io.begin(_backend.readSize);
+    _startedAt = millis();
+    if (!_passivePorts) {
+        // Bind the whole passive range up front; PASV only hands out a port.
+        uint16_t count = _passivePortCount ? _passivePortCount : _maxSessions;
+        if (count > 65536 - _passivePortFirst) count = 65536 - _passivePortFirst;
+        _passivePorts = new (std::nothrow) PassivePort[count];
+        _passivePortCount = _passivePorts ? count : 0;
+        for (uint16_t i = 0; i < _passivePortCount; i++) {
+            PassivePort *port = &_passivePorts[i];
+            port->port = _passivePortFirst + i;
+            port->server = new AsyncServer(port->port);
+            port->server->onClient([this, port](void *arg, AsyncClient *client) {
+                _onPassiveClient(port, client);
+            }, this);
+            port->server->begin();
+            if (port->server->status() == 0) {
+                // Port already taken; leave it out of the pool.
+                delete port->server;
+                port->server = nullptr;
+            }
+        }
+    }
     _asyncServer = new AsyncServer(_port);
+    // Replies are short and sent back to back (150, then 226); without
+    // this, Nagle holds the second one until the client's delayed ACK.
+    _asyncServer->setNoDelay(true);
     _asyncServer->onClient([this](void *arg, AsyncClient *client) { _onClient(arg, client); }, this);
     _asyncServer->begin();
 }
@@ -116,26 +324,142 @@ void AsyncFTP::setPassword(String password) {
     ASYNCFTP_Password = password;
 }
 
+void AsyncFTP::setPassivePortRange(uint16_t first, uint16_t count) {
+    _passivePortFirst = first;
+    _passivePortCount = count;
+}
+
+void AsyncFTP::setDirectoryCache(size_t bytes, uint32_t ttl) {
+    _dirCacheSize = bytes;
+    _dirCacheTTL = ttl;
+}
+
+void AsyncFTP::setFileCache(size_t bytes, size_t maxFileSize, uint32_t ttl) {
+    _fileCacheSize = bytes;
+    _fileCacheMaxFile = maxFileSize;
+    _fileCacheTTL = ttl;
+}
+
+void AsyncFTP::invalidateCache(const char *path) {
+    _dirCache.invalidate(path);
+    _fileCache.invalidate(path);
+    _hashCache.invalidate(path);
+}
+
+void AsyncFTP::setRateLimit(uint32_t perSession, uint32_t total) {
+    _sessionRate = perSession;
+    _totalRate = total;
+}
+
+bool AsyncFTP::mountImage(const char *name) {
+    return _image.begin(name);
+}
+
+void AsyncFTP::setHeapBudget(size_t budget, size_t minFreeHeap) {
+    _heap.configure(budget, minFreeHeap);
+}
+
+void AsyncFTP::getStats(AsyncFTPStats &stats) {
+    stats = _stats;
+    stats.uptime = millis() - _startedAt;
+    stats.maxSessions = _maxSessions;
+    stats.sessions = 0;
+    for (uint8_t i = 0; i < _maxSessions; i++) {
+        AsyncFTPClient &session = _sessions[i];
+        if (!session._controlClient) continue;
+        stats.sessions++;
+        // Count the bytes of transfers still running.
+        if (isUpload(session._transferVerb))
+            stats.bytesIn += session._transferBytes;
+        else if (session._transferVerb)
+            stats.bytesOut += session._transferBytes;
+    }
+    stats.freeHeap = ESP.getFreeHeap();
+    stats.minFreeHeap = ESP.getMinFreeHeap();
+    stats.heapBudget = _heap.budget();
+    stats.heapReserved = _heap.reserved();
+    stats.heapReservedPeak = _heap.peak();
+
+    // One slot per entry of the command table, then one for unknown verbs.
+    const uint8_t known = AsyncFTPClient::_knownCommands;
+    for (uint8_t i = 0; i <= known; i++) {
+        char *verb = stats.commands[i].verb;
+        if (i == known) {
+            strcpy(verb, "?");
+            continue;
+        }
+        unpackVerb(AsyncFTPClient::_commands[i].verb, verb);
+    }
+    stats.commandCount = known + 1;
+}
+
+bool AsyncFTP::getSessionStats(uint8_t index, AsyncFTPSessionStats &stats) {
+    if (index >= _maxSessions || !_sessions[index]._controlClient) return false;
+    AsyncFTPClient &session = _sessions[index];
+    stats.remoteIP = session._controlClient->remoteIP();
+    stats.connected = millis() - session._connectedAt;
+    stats.bytesIn = session._bytesIn;
+    stats.bytesOut = session._bytesOut;
+    if (isUpload(session._transferVerb))
+        stats.bytesIn += session._transferBytes;
+    else if (session._transferVerb)
+        stats.bytesOut += session._transferBytes;
+    stats.commands = session._commandCount;
+    stats.transfers = session._transferCount;
+    return true;
+}
+
+void AsyncFTP::resetStats() {
+    _stats = AsyncFTPStats();
+}
+
+void AsyncFTP::onTransfer(AsyncFTPTransferHandler handler) {
+    _onTransfer = handler;
+}
+
+void AsyncFTP::setStorBufferSize(size_t size) {
+    size -= size % _backend.writeAlign;
+    _storBufferSize = size > 0 ? size : _backend.writeAlign;
+}
+
 void AsyncFTP::_onClient(void *arg, AsyncClient *client) {
-    // Allow a maximum of 2 simultaneous control connections.
-    if (_controlClients[0] == nullptr) {
-        _controlClients[0] = new AsyncFTPClient(client, _FTPFS);
-        client->onDisconnect([this](void *arg, AsyncClient *client) {
-            delete _controlClients[0];
-            _controlClients[0] = nullptr;
-        }, this);
-    }
-    else if (_controlClients[1] == nullptr) {
-        _controlClients[1] = new AsyncFTPClient(client, _FTPFS);
-        client->onDisconnect([this](void *arg, AsyncClient *client)
-        {
-            delete _controlClients[1];
-            _controlClients[1] = nullptr;
-        }, this);
+    for (uint8_t i = 0; i < _maxSessions; i++) {
+        if (_sessions[i]._controlClient == nullptr) {
+            if (!_heap.reserve(SESSION_HEAP)) {
+                _stats.lowMemoryConnections++;
+                client->write("421 Not enough memory, try again later\r\n");
+                discardClient(client);
+                return;
+            }
+            _stats.connections++;
+            _sessions[i]._open(this, client);
+            return;
+        }
+    }
+    _stats.rejectedConnections++;
+    client->write("421 Too many connections\r\n");
+    discardClient(client);
+}
+
+AsyncFTP::PassivePort *AsyncFTP::_leasePassivePort(AsyncFTPClient *session) {
+    for (uint16_t i = 0; i < _passivePortCount; i++) {
+        PassivePort *port = &_passivePorts[i];
+        if (port->server && !port->session) {
+            port->session = session;
+            return port;
+        }
     }
+    return nullptr;
+}
+
+void AsyncFTP::_onPassiveClient(PassivePort *port, AsyncClient *client) {
+    // One data connection per lease; anything else on the port is refused.
+    AsyncFTPClient *session = port->session;
+    if (session && !session->_passiveDataClient)
+        session->_onPassiveClient(nullptr, client);
     else {
-        client->write("421 Too many connections\r\n");
-        client->close();
+        _stats.rejectedDataConnections++;
+        discardClient(client);
     }
 }
 
@@ -143,359 +467,2090 @@ void AsyncFTP::_onClient(void *arg, AsyncClient *client) {
 // AsyncFTPClient methods
 //---------------------------------------------------------------------
 
-AsyncFTPClient::AsyncFTPClient(AsyncClient *client, FTP_FS ftpfs) : _controlClient(client), _FTPFS(ftpfs) {
+AsyncFTPClient::AsyncFTPClient() {
+    _hashLock = xSemaphoreCreateMutex();
+}
+
+AsyncFTPClient::~AsyncFTPClient() {
+    _release();
+    if (_hashLock) vSemaphoreDelete(_hashLock);
+}
+
+void AsyncFTPClient::_open(AsyncFTP *server, AsyncClient *client) {
+    _server = server;
+    _controlClient = client;
+    _FTPFS = server->_FTPFS;
+    _filesystem = server->_filesystem;
+
+    // Slots are reused, so everything a previous session may have left
+    // behind is reset here rather than by construction.
+    strcpy(_cwd, "/");
+    _renameFrom[0] = '\0';
+    _dataPath[0] = '\0';
+    _dataCommand = 0;
+    _restOffset = 0;
+    _rangeStart = 0;
+    _rangeEnd = UINT32_MAX;
+    _dataOffset = 0;
+    _allocSize = 0;
+    _storAtomic = false;
+    _mlstFacts = FTPListFormat::ALL_FACTS;
+    _listLimit = 0;
+    _listFrom = 0;
+    _listNext = 0;
+    _lineLength = 0;
+    _lineTooLong = false;
+    _closeRequested = false;
+    _queueLen = 0;
+    _queueUnacked = 0;
+    _sendLen = 0;
+    _sendPos = 0;
+    _transferComplete = false;
+    _transferFailed = false;
+    _modeZ = false;
+    _modeZLevel = FTP_MODEZ_LEVEL;
+    _storUnacked = 0;
+    _rateTokens = AsyncFTPTokenBucket();     // a new session starts with a full burst
+    _ackPending = 0;
+    _untarNext = false;
+    _hashAlgorithm = AsyncFTPHash::SHA256;
+    _activeMode = false;
+    _activeDataPort = 0;
+    _epsvAll = false;
+    _connectedAt = millis();
+    _bytesIn = 0;
+    _bytesOut = 0;
+    _commandCount = 0;
+    _transferCount = 0;
+    _transferVerb = 0;
+    _transferBytes = 0;
+    _transferHeap = 0;
+    _transferPending = 0;
+    _passiveWaiting = false;
+
     _controlClient->write("220 Welcome to ESP32 FTP Server\r\n");
     _controlClient->onData([this](void *arg, AsyncClient *client, void *data, size_t len) {
         _onData(arg, client, data, len);
     }, this);
+    _controlClient->onDisconnect([this](void *arg, AsyncClient *client) {
+        _release();
+    }, this);
+    // A checksum hashed by the I/O task replies from here: _pumpHash()
+    // pokes the connection the moment the hash is done.
+    _controlClient->onPoll([this](void *arg, AsyncClient *client) {
+        _checkHash();
+    }, this);
+    _controlClient->onAck([this](void *arg, AsyncClient *client, size_t len, uint32_t time) {
+        _sendReply();
+    }, this);
+    _controlPoke.bind(_controlClient);
 }
 
-AsyncFTPClient::~AsyncFTPClient() {
-    if (_controlClient) {
-        _controlClient->close();
-        delete _controlClient;
-    }
+void AsyncFTPClient::_release() {
+    if (!_controlClient) return;
+
+    // Nobody is left to read a reply: finish the transfer silently (a new
+    // upload is discarded, a resumed or appended one keeps what has
+    // arrived) and drop the data connections.
+    _transferFailed = true;
+    _closeDataTransfer();
+    _discardDataClient(_passiveDataClient);
+    _discardDataClient(_activeDataClient);
+    _releasePassivePort();
+    _endHash();
+    _controlPoke.unbind();
+    _dataCommand = 0;
+    // Of the session's reservation only the pipeline buffer is ever
+    // reported allocated; the connection's share stays pending.
+    size_t pending = _queue ? FTP_HEAP_CONNECTION : SESSION_HEAP;
+    free(_queue);
+    _queue = nullptr;
+    _queueLen = 0;
+    free(_reply);
+    _reply = nullptr;
+
+    // Usually called from the control client's own disconnect handler, in
+    // which case close() does nothing and the client is simply deleted.
+    AsyncClient *client = _controlClient;
+    _controlClient = nullptr;
+    client->onDisconnect(nullptr, nullptr);
+    client->close();
+    delete client;
+    _server->_heap.release(SESSION_HEAP, pending);
 }
 
-void AsyncFTPClient::_onData(void *arg, AsyncClient *client, void *data, size_t len) {
-    // Append incoming data to the command buffer.
-    _line += String((char*)data).substring(0, len);
-    
-    // Enforce a maximum command length.
-    if (_line.length() > MAX_COMMAND_LENGTH) {
-        _controlClient->write("500 Command too long\r\n");
-        _line = "";
-        return;
+uint8_t AsyncFTPClient::_index() const {
+    return (uint8_t)(this - _server->_sessions);
+}
+
+void AsyncFTPClient::_discardDataClient(AsyncClient *&client) {
+    if (!client) return;
+    AsyncClient *dataClient = client;
+    client = nullptr;
+    // Replace the session's handlers so nothing calls back into this slot.
+    dataClient->onData(nullptr, nullptr);
+    dataClient->onAck(nullptr, nullptr);
+    dataClient->onPoll(nullptr, nullptr);
+    dataClient->onConnect(nullptr, nullptr);
+    discardClient(dataClient);
+}
+
+// Upper-case and pack the verb of a received command line. Verbs that are not
+// 3 or 4 characters long cannot be in the command table and map to 0, except
+// XSHA256, which takes the key of XSHA. XSHA itself (SHA-1 on some servers)
+// is not accepted.
+static uint32_t packVerb(char *verb, size_t len) {
+    if (len == 7 && strncasecmp(verb, "XSHA256", 7) == 0) {
+        for (size_t i = 0; i < len; i++) verb[i] = toupper((unsigned char)verb[i]);
+        return ftpVerb("XSHA");
     }
-    
-    int index;
-    // Process complete command lines terminated with "\r\n".
-    while ((index = _line.indexOf("\r\n")) >= 0) {
-        String commandLine = _line.substring(0, index);
-        _line = _line.substring(index + 2);
-        commandLine.trim();
-        if (commandLine.length() == 0)
-            continue;
-        
-        int spaceIndex = commandLine.indexOf(' ');
-        if (spaceIndex > 0) {
-            _command = commandLine.substring(0, spaceIndex);
-            _parameter = commandLine.substring(spaceIndex + 1);
-        } else {
-            _command = commandLine;
-            _parameter = "";
-        }
-        
-        Serial.println("Received Command: " + commandLine);
-        _process();
+    if (len < 3 || len > 4) return 0;
+    uint32_t key = 0;
+    for (size_t i = 0; i < 4; i++) {
+        if (i < len) verb[i] = toupper((unsigned char)verb[i]);
+        key = (key << 8) | (i < len ? (uint8_t)verb[i] : 0);
     }
+    return key == ftpVerb("XSHA") ? 0 : key;
 }
 
-void AsyncFTPClient::_process() {
-    _command.toUpperCase();
-    
-#ifdef DEBUG
-    Serial.println("========PROCESSING COMMAND=========");
-    Serial.printf("Command: %s\n", _command.c_str());
-    Serial.printf("Parameter: %s\n", _parameter.c_str());
-    Serial.println("===================================");
-#endif
-
-    if (_command == "USER") {
-        if (_parameter == ASYNCFTP_Username)
-            _controlClient->write("331 OK. Password required\r\n");
-        else {
-            _controlClient->write("530 Invalid username\r\n");
-            _controlClient->close();
+// Command table, searched by packed verb.
+const AsyncFTPClient::Command AsyncFTPClient::_commands[] = {
+    { ftpVerb("USER"), &AsyncFTPClient::_cmdUSER, 0 },
+    { ftpVerb("PASS"), &AsyncFTPClient::_cmdPASS, 0 },
+    { ftpVerb("NOOP"), &AsyncFTPClient::_cmdNOOP, 0 },
+    { ftpVerb("PWD"),  &AsyncFTPClient::_cmdPWD,  0 },
+    { ftpVerb("LIST"), &AsyncFTPClient::_cmdLIST, 0 },
+    { ftpVerb("CWD"),  &AsyncFTPClient::_cmdCWD,  0 },
+    { ftpVerb("CDUP"), &AsyncFTPClient::_cmdCDUP, 0 },
+    { ftpVerb("TYPE"), &AsyncFTPClient::_cmdTYPE, 0 },
+    { ftpVerb("PASV"), &AsyncFTPClient::_cmdPASV, 0 },
+    { ftpVerb("EPSV"), &AsyncFTPClient::_cmdEPSV, 0 },
+    { ftpVerb("PORT"), &AsyncFTPClient::_cmdPORT, 0 },
+    { ftpVerb("RETR"), &AsyncFTPClient::_cmdRETR, 0 },
+    { ftpVerb("STOR"), &AsyncFTPClient::_cmdSTOR, NEEDS_WRITE },
+    { ftpVerb("APPE"), &AsyncFTPClient::_cmdAPPE, NEEDS_WRITE | NEEDS_APPEND },
+    { ftpVerb("REST"), &AsyncFTPClient::_cmdREST, NEEDS_SEEK },
+    { ftpVerb("SIZE"), &AsyncFTPClient::_cmdSIZE, 0 },
+    { ftpVerb("FEAT"), &AsyncFTPClient::_cmdFEAT, 0 },
+    { ftpVerb("SYST"), &AsyncFTPClient::_cmdSYST, 0 },
+    { ftpVerb("MKD"),  &AsyncFTPClient::_cmdMKD,  NEEDS_WRITE },
+    { ftpVerb("RMD"),  &AsyncFTPClient::_cmdRMD,  NEEDS_WRITE },
+    { ftpVerb("DELE"), &AsyncFTPClient::_cmdDELE, NEEDS_WRITE },
+    { ftpVerb("RNFR"), &AsyncFTPClient::_cmdRNFR, NEEDS_WRITE },
+    { ftpVerb("RNTO"), &AsyncFTPClient::_cmdRNTO, NEEDS_WRITE },
+    { ftpVerb("QUIT"), &AsyncFTPClient::_cmdQUIT, 0 },
+    { ftpVerb("SITE"), &AsyncFTPClient::_cmdSITE, 0 },
+    { ftpVerb("MODE"), &AsyncFTPClient::_cmdMODE, 0 },
+    { ftpVerb("OPTS"), &AsyncFTPClient::_cmdOPTS, 0 },
+    { ftpVerb("HASH"), &AsyncFTPClient::_cmdHASH, 0 },
+    { ftpVerb("RANG"), &AsyncFTPClient::_cmdRANG, 0 },
+    { ftpVerb("XCRC"), &AsyncFTPClient::_cmdXCRC, 0 },
+    { ftpVerb("XMD5"), &AsyncFTPClient::_cmdXMD5, 0 },
+    { ftpVerb("XSHA"), &AsyncFTPClient::_cmdXSHA, 0 },
+    { ftpVerb("MLSD"), &AsyncFTPClient::_cmdMLSD, 0 },
+    { ftpVerb("MLST"), &AsyncFTPClient::_cmdMLST, 0 },
+    { ftpVerb("MDTM"), &AsyncFTPClient::_cmdMDTM, 0 },
+    { ftpVerb("NLST"), &AsyncFTPClient::_cmdNLST, 0 },
+    { ftpVerb("ALLO"), &AsyncFTPClient::_cmdALLO, NEEDS_WRITE },
+};
+
+const uint8_t AsyncFTPClient::_knownCommands = sizeof(_commands) / sizeof(_commands[0]);
+
+void AsyncFTPClient::_onData(void *arg, AsyncClient *client, void *data, size_t len) {
+    // A finished checksum's queued commands go first; they may end the session.
+    _checkHash();
+    if (!_controlClient) return;
+
+    // Commands after a data command wait for its transfer to end, in order.
+    const char *src = (const char*)data;
+    size_t used = _queueLen == 0 ? _readCommands(src, len) : 0;
+    if (used < len && !_closeRequested) {
+        if (!_queue) {
+            _queue = (char*)malloc(FTP_PIPELINE_BUFFER);
+            if (_queue) _server->_heap.allocated(FTP_PIPELINE_BUFFER);
+        }
+        if (!_queue || len - used > FTP_PIPELINE_BUFFER - _queueLen) {
+            _controlClient->write("421 Too many pipelined commands\r\n");
+            _closeRequested = true;
         }
-    }
-    else if (_command == "PASS") {
-        if (_parameter == ASYNCFTP_Password)
-            _controlClient->write("230 OK. User logged in\r\n");
         else {
-            _controlClient->write("530 Invalid password\r\n");
-            _controlClient->close();
-        }
-    }
-    else if (_command == "SYST") {
-        _controlClient->write("215 UNIX Type: L8\r\n");
-    }
-    else if (_command == "CDUP") {
-          // If we're at root ("/"), can't go higher:
-          if (_CWD == "/") {
-            _controlClient->write("550 Can't go above root directory\r\n");
-          } 
-          else {
-            // Trim back _CWD by removing its trailing segment
-            int index = _CWD.lastIndexOf('/');
-            if (index <= 0) {
-              _CWD = "/";
-            } else {
-              _CWD = _CWD.substring(0, index);
-            }
-            _controlClient->write("250 Directory successfully changed\r\n");
-          }
+            memcpy(_queue + _queueLen, src + used, len - used);
+            _queueLen += len - used;
+            // The whole segment stays unacked; what was used is acked
+            // together with the queue.
+            client->ackLater();
+            _queueUnacked += used;
+        }
     }
-    else if (_command == "CWD") {
-          String newPath = resolvePath(_CWD, _parameter);
-        
-          // 1) Get the filesystem pointer
-          FS* filesystem = getFilesystem(_FTPFS);
-          if (!filesystem) {
-            _controlClient->write("550 No valid filesystem\r\n");
-            return;
-          }
-        
-          // 2) Try opening 'newPath' as a directory
-          File dir = filesystem->open(newPath);
-          if (!dir || !dir.isDirectory()) {
-            // Not a valid directory
-            _controlClient->write("550 Not a valid directory\r\n");
-            return;
-          }
-          dir.close();
-        
-          // 3) If valid, update current working directory
-          _CWD = newPath;
-          _controlClient->write("250 OK\r\n");
-    }
-    else if (_command == "PWD") {
-        String response = "257 \"" + _CWD + "\" is the current directory\r\n";
-        _controlClient->write(response.c_str());
-    }
-    else if (_command == "TYPE") {
-        String response = "200 Type set to " + _parameter + "\r\n";
-        _controlClient->write(response.c_str());
-    }
-    else if (_command == "PASV") {
-        // 1) Get the ESP32's local IP address
-        IPAddress ip = WiFi.localIP();
-      
-        // Choose an ephemeral data port
-        uint16_t port = random(1024, 65535);
-        byte portHigh = port >> 8;   // High-order byte
-        byte portLow  = port & 0xFF; // Low-order byte
-      
-        // 4) Build the '227 Entering Passive Mode' response with the **real** IP
-        //    e.g. "227 Entering Passive Mode (192,168,68,116,abcd,efgh)\r\n"
-        String response = "227 Entering Passive Mode (" +
-            String(ip[0]) + "," + 
-            String(ip[1]) + "," + 
-            String(ip[2]) + "," + 
-            String(ip[3]) + "," +
-            String(portHigh) + "," + 
-            String(portLow) + ")\r\n";
-      
-        _controlClient->write(response.c_str());
-      
-        // 5) Create the listening data server on the chosen random port
-        _createPassiveServer(port);
-    }
-    else if (_command == "PORT") {
-        // Active mode: parse the PORT command (format: h1,h2,h3,h4,p1,p2).
-        int parts[6];
-        int startIndex = 0;
-        int partIndex = 0;
-        while (partIndex < 6) {
-            int commaIndex = _parameter.indexOf(',', startIndex);
-            if (commaIndex < 0 && partIndex < 5)
-                break;
-            String part = (commaIndex < 0) ? _parameter.substring(startIndex)
-                                           : _parameter.substring(startIndex, commaIndex);
-            parts[partIndex] = part.toInt();
-            startIndex = commaIndex + 1;
-            partIndex++;
+
+    // Closing runs the disconnect handler, which deletes this session, so it
+    // has to be the last thing done here.
+    if (_closeRequested)
+        _controlClient->close();
+}
+
+size_t AsyncFTPClient::_readCommands(const char *src, size_t len) {
+    // Lines are assembled in the fixed _lineBuffer; nothing here allocates.
+    _readingCommands = true;
+    size_t used = 0;
+    while (used < len && !_closeRequested && !_busy()) {
+        const char *eol = (const char*)memchr(src + used, '\n', len - used);
+        size_t chunk = eol ? (size_t)(eol - (src + used)) : len - used;
+
+        // Enforce a maximum command length; the rest of the line is dropped.
+        size_t room = MAX_COMMAND_LENGTH - _lineLength;
+        if (chunk > room) _lineTooLong = true;
+        memcpy(_lineBuffer + _lineLength, src + used, chunk > room ? room : chunk);
+        _lineLength += chunk > room ? room : chunk;
+        if (!eol) {
+            used = len;
+            break;
         }
-        if (partIndex < 6) {
-            _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+        used += chunk + 1;
+
+        if (_lineTooLong) {
+            _controlClient->write("500 Command too long\r\n");
         } else {
-            _activeDataIP = IPAddress(parts[0], parts[1], parts[2], parts[3]);
-            _activeDataPort = (uint16_t)(parts[4] * 256 + parts[5]);
-            _activeMode = true;
-            _controlClient->write("200 PORT command successful\r\n");
-        }
-    }
-    else if (_command == "LIST") {
-        _dataCommand = _command;
-        if (_activeMode)
-            _createActiveDataConnection();
-        // Otherwise, in passive mode the client connects to our passive server.
-    }
-    else if (_command == "MKD") {
-        String MKDName = (_CWD == "/" ? _CWD : joinPath(_CWD, _parameter));
-        if (_FTPCreateDirectory(_FTPFS, MKDName))
-            _controlClient->write("257 Directory created\r\n");
-        else
-            _controlClient->write("550 Failed to create directory\r\n");
-            
-    }
-    else if (_command == "RMD") {
-          String fullPath = resolvePath(_CWD, _parameter);
-          if (_FTPDeleteDirectory(_FTPFS, fullPath))
-            _controlClient->write("250 Directory deleted\r\n");
-          else
-            _controlClient->write("550 Failed to delete directory\r\n");
-    }
-    else if (_command == "RETR") {
-        _dataCommand = _command;
-        _dataParameter = _parameter;
-        if (_activeMode)
-            _createActiveDataConnection();
-    }
-    else if (_command == "STOR") {
-        _dataCommand = _command;
-        _dataParameter = _parameter;
-        if (_activeMode)
-            _createActiveDataConnection();
-    }
-    else if (_command == "DELE") {
-          String fullPath = resolvePath(_CWD, _parameter);
-          if (_FTPDeleteFile(_FTPFS, fullPath))
-            _controlClient->write("250 File deleted\r\n");
-          else
-            _controlClient->write("550 Failed to delete file\r\n");
-    }
-    else if (_command == "RNFR") {
-        _RNFRParameter = _parameter; // store it for RNTO
-        _controlClient->write("350 Ready for RNTO\r\n");
-    }
-    else if (_command == "RNTO") {
-          // Convert both RNFR and RNTO parameters to absolute paths if needed
-          String fromPath = resolvePath(_CWD, _RNFRParameter);
-          String toPath   = resolvePath(_CWD, _parameter);
-        
-          if (_FTPMoveFile(_FTPFS, fromPath, toPath)) {
-            _controlClient->write("250 File renamed\r\n");
-          } else {
-            _controlClient->write("550 Failed to rename file\r\n");
-          }
+            if (_lineLength > 0 && _lineBuffer[_lineLength - 1] == '\r') _lineLength--;
+            _lineBuffer[_lineLength] = '\0';
+            _process(_lineBuffer);
+        }
+        _lineLength = 0;
+        _lineTooLong = false;
     }
-    else if (_command == "QUIT") {
-        _controlClient->write("221 Goodbye\r\n");
+    _readingCommands = false;
+    return used;
+}
+
+void AsyncFTPClient::_resumeCommands() {
+    // A transfer that ends while commands are being read (it failed at
+    // once) needs nothing: the reading loop carries on by itself.
+    if (!_controlClient || _readingCommands || _queueLen == 0) return;
+    size_t used = _readCommands(_queue, _queueLen);
+    _queueLen -= used;
+    memmove(_queue, _queue + used, _queueLen);
+    _controlClient->ack(_queueUnacked + used);
+    _queueUnacked = 0;
+    if (_closeRequested)
         _controlClient->close();
+}
+
+void AsyncFTPClient::_process(char *line) {
+    // Trim surrounding whitespace and split off the verb in place.
+    while (*line == ' ' || *line == '\t') line++;
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) line[--len] = '\0';
+    if (len == 0) return;
+
+    char *parameter = strchr(line, ' ');
+    size_t verbLength = parameter ? (size_t)(parameter - line) : len;
+    if (parameter) *parameter++ = '\0';
+    else           parameter = line + len;
+    uint32_t verb = packVerb(line, verbLength);
+    
+    // Logged after splitting so the password can be left out.
+    FTP_LOGI("session %u: %s%s%s", _index(), line,
+             *parameter ? " " : "", verb == ftpVerb("PASS") ? "****" : parameter);
+
+    // Commands are counted per entry of _commands; the extra slot after
+    // them takes unknown verbs.
+    static_assert(sizeof(_commands) / sizeof(_commands[0]) < FTP_STATS_COMMANDS,
+                  "FTP_STATS_COMMANDS needs a slot for every command and one for unknown verbs");
+    uint8_t index = 0;
+    while (index < _knownCommands && _commands[index].verb != verb) index++;
+    const Command *command = index < _knownCommands ? &_commands[index] : nullptr;
+    uint32_t start = micros();
+    const FTPBackendTraits &backend = _server->_backend;
+    if (command && (command->needs & NEEDS_WRITE) && !backend.write)
+        _controlClient->write("550 Read-only filesystem\r\n");
+    else if (command && (((command->needs & NEEDS_APPEND) && !backend.append) ||
+                         ((command->needs & NEEDS_SEEK) && !backend.seek)))
+        _controlClient->write("502 Not supported by this filesystem\r\n");
+    else if (command) {
+        (this->*command->handler)(parameter);
+        // REST and RANG only apply to the command right after them.
+        if (verb != ftpVerb("REST")) _restOffset = 0;
+        if (verb != ftpVerb("RANG")) {
+            _rangeStart = 0;
+            _rangeEnd = UINT32_MAX;
+        }
     }
-    else {
+    else
         _controlClient->write("502 Command not implemented\r\n");
+
+    uint32_t elapsed = (uint32_t)micros() - start;
+    AsyncFTPStats &stats = _server->_stats;
+    AsyncFTPStats::Command &slot = stats.commands[index];
+    slot.count++;
+    slot.totalTime += elapsed;
+    if (elapsed > slot.maxTime) slot.maxTime = elapsed;
+    stats.serviceTime.add(elapsed);
+    _commandCount++;
+}
+
+void AsyncFTPClient::_replyf(const char *format, ...) {
+    char reply[FTPPATHMAX + 64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(reply, sizeof(reply), format, args);
+    va_end(args);
+    _controlClient->write(reply);
+}
+
+void AsyncFTPClient::_sendReply() {
+    if (!_reply || !_controlClient) return;
+    while (_replyPos < _replyLen) {
+        size_t n = _controlClient->add(_reply + _replyPos, _replyLen - _replyPos);
+        if (n == 0) break;
+        _replyPos += n;
     }
-    
-    // Clear the command buffers for the next command.
-    _command = "";
-    _parameter = "";
+    _controlClient->send();
+    if (_replyPos < _replyLen) return;
+    free(_reply);
+    _reply = nullptr;
+    _resumeCommands();
 }
 
-void AsyncFTPClient::_createPassiveServer(uint16_t port) {
-    _passiveServer = new AsyncServer(port);
-    _passiveServer->onClient([this](void *arg, AsyncClient *client)
-    {
-        _onPassiveClient(arg, client);
-    }, this);
-    _passiveServer->begin();
+bool AsyncFTPClient::_resolve(const char *parameter, char *path) {
+    if (resolvePath(path, FTPPATHMAX, _cwd, parameter)) return true;
+    _controlClient->write("553 Path too long\r\n");
+    return false;
 }
 
-void AsyncFTPClient::_onPassiveClient(void *arg, AsyncClient *client) {
-    Serial.println("Passive client connected");
-    client->onData([this](void *arg, AsyncClient *client, void *data, size_t len) {
-        _onPassiveData(arg, client, data, len);
-    }, this);
-    client->onDisconnect([this](void *arg, AsyncClient *client) {
-        _onPassiveDisconnect(arg, client);
-    }, this);
-    
-    if      (_dataCommand == "LIST")  _processListCommand(client);
-    else if (_dataCommand == "RETR")  _processRetrCommand(client);
-    else if (_dataCommand == "STOR")  _processStorCommand(client);
-    _dataCommand = "";
+void AsyncFTPClient::_cmdUSER(char *parameter) {
+    if (ASYNCFTP_Username == parameter)
+        _controlClient->write("331 OK. Password required\r\n");
+    else {
+        _controlClient->write("530 Invalid username\r\n");
+        _closeRequested = true;
+    }
 }
 
-void AsyncFTPClient::_onPassiveData(void *arg, AsyncClient *client, void *data, size_t len) {
-    if (_STORFile)
-        _STORFile.write((uint8_t*)data, len);
+void AsyncFTPClient::_cmdPASS(char *parameter) {
+    if (ASYNCFTP_Password == parameter)
+        _controlClient->write("230 OK. User logged in\r\n");
+    else {
+        _controlClient->write("530 Invalid password\r\n");
+        _closeRequested = true;
+    }
 }
 
-void AsyncFTPClient::_processListCommand(AsyncClient *client) {
-    String listing = _FTPDirectoryList(_CWD, _FTPFS);
-    client->write(listing.c_str());
-    client->close();
+void AsyncFTPClient::_cmdSYST(char *parameter) {
+    _controlClient->write("215 UNIX Type: L8\r\n");
 }
 
-void AsyncFTPClient::_processStorCommand(AsyncClient *client) {
-    String path = (_CWD == "/" ? "" : _CWD);
-    path = joinPath(path, _dataParameter);
-    _STORFile = _FTPCreateFile(_FTPFS, path);
+void AsyncFTPClient::_cmdNOOP(char *parameter) {
+    _controlClient->write("200 NOOP ok\r\n");
 }
 
-void AsyncFTPClient::_processRetrCommand(AsyncClient *client) {
-    String path = (_CWD == "/" ? "" : _CWD);
-    path = joinPath(path, _dataParameter);
-    _RETRFile = _FTPOpenFile(_FTPFS, path);
-    if (_RETRFile) {
-        _controlClient->write("150 Sending file\r\n");
-        _sendFileChunk(client);
-        client->onPoll([this](void *arg, AsyncClient *client)
-        {
-            _sendFileChunk(client);
-        }, this);
+void AsyncFTPClient::_cmdCDUP(char *parameter) {
+    // If we're at root ("/"), can't go higher:
+    if (strcmp(_cwd, "/") == 0) {
+        _controlClient->write("550 Can't go above root directory\r\n");
+        return;
+    }
+    // Trim back _cwd by removing its trailing segment
+    char *slash = strrchr(_cwd, '/');
+    if (slash == _cwd) _cwd[1] = '\0';
+    else               *slash = '\0';
+    _controlClient->write("250 Directory successfully changed\r\n");
+}
+
+void AsyncFTPClient::_cmdCWD(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+
+    int known;
+    if (_FTPFS == FTP_FS::IMAGE)
+        known = _server->_image.isDirectory(path);
+    else if (!_filesystem) {
+        _controlClient->write("550 No valid filesystem\r\n");
+        return;
     }
     else
-        _controlClient->write("550 Failed to open file\r\n");
+        known = _server->_dirCache.isDirectory(path);
+    if (known < 0) {
+        File dir = _FTPOpenDirectory(_filesystem, path);
+        known = dir ? 1 : 0;
+        dir.close();
+    }
+    if (!known) {
+        _controlClient->write("550 Not a valid directory\r\n");
+        return;
+    }
+
+    strcpy(_cwd, path);
+    _controlClient->write("250 OK\r\n");
 }
 
-void AsyncFTPClient::_sendFileChunk(AsyncClient *client) {
-    if (_RETRFile) {
-        uint8_t fileBuffer[FILEBUFFERSIZE];
-        size_t bytesRead = _RETRFile.read(fileBuffer, FILEBUFFERSIZE);
-        if (bytesRead > 0) {
-            client->add((const char*)fileBuffer, bytesRead);
-            client->send();
+void AsyncFTPClient::_cmdPWD(char *parameter) {
+    _replyf("257 \"%s\" is the current directory\r\n", _cwd);
+}
+
+void AsyncFTPClient::_cmdTYPE(char *parameter) {
+    _replyf("200 Type set to %s\r\n", parameter);
+}
+
+void AsyncFTPClient::_cmdPASV(char *parameter) {
+    if (_epsvAll) {
+        _controlClient->write("503 Only EPSV is allowed after EPSV ALL\r\n");
+        return;
+    }
+    uint16_t port = _openPassivePort();
+    if (!port) return;
+
+    // Advertise the address the client reached us on (STA or AP interface).
+    IPAddress ip = _controlClient->localIP();
+    _replyf("227 Entering Passive Mode (%u,%u,%u,%u,%u,%u)\r\n",
+            ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xFF);
+}
+
+void AsyncFTPClient::_cmdEPSV(char *parameter) {
+    // RFC 2428: the client reuses the control connection's address.
+    if (strcasecmp(parameter, "ALL") == 0) {
+        _epsvAll = true;
+        _controlClient->write("200 EPSV ALL ok\r\n");
+        return;
+    }
+    if (*parameter && strcmp(parameter, "1") != 0) {
+        _controlClient->write("522 Network protocol not supported, use (1)\r\n");
+        return;
+    }
+    uint16_t port = _openPassivePort();
+    if (port) _replyf("229 Entering Extended Passive Mode (|||%u|)\r\n", port);
+}
+
+void AsyncFTPClient::_cmdPORT(char *parameter) {
+    if (_epsvAll) {
+        _controlClient->write("503 Only EPSV is allowed after EPSV ALL\r\n");
+        return;
+    }
+    // Active mode: parse the PORT command (format: h1,h2,h3,h4,p1,p2).
+    unsigned parts[6];
+    if (sscanf(parameter, "%u,%u,%u,%u,%u,%u",
+               &parts[0], &parts[1], &parts[2], &parts[3], &parts[4], &parts[5]) != 6) {
+        _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+        return;
+    }
+    for (unsigned part : parts) {
+        if (part > 255) {
+            _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+            return;
         }
-        else {
-            _RETRFile.close();
-            client->close();
-            _controlClient->write("226 Transfer complete\r\n");
+    }
+    _activeDataIP = IPAddress(parts[0], parts[1], parts[2], parts[3]);
+    _activeDataPort = (uint16_t)(parts[4] * 256 + parts[5]);
+    _activeMode = true;
+    _releasePassivePort();
+    _controlClient->write("200 PORT command successful\r\n");
+}
+
+bool AsyncFTPClient::_listArgument(char *parameter, bool patterns) {
+    _listFilter = FTPListFilter();
+    _listFilter.limit = _listLimit;
+    _listFilter.skip = _listFrom;
+    _listFrom = 0;
+    if (!patterns) return _resolve(parameter, _dataPath);
+
+    // Clients send ls options such as "-la"; the format is always the same.
+    while (*parameter == '-') {
+        while (*parameter && *parameter != ' ') parameter++;
+        while (*parameter == ' ') parameter++;
+    }
+    bool caseless = _server->_backend.caseless;
+    char *slash = strrchr(parameter, '/');
+    char *name = slash ? slash + 1 : parameter;
+    if (strpbrk(name, "*?[")) {
+        // Wildcards: list the directory they are in, filtered by them.
+        if (!_listFilter.glob.compile(name, false, caseless)) {
+            _controlClient->write("501 Pattern too long or complex\r\n");
+            return false;
         }
+        if (slash == parameter) slash[1] = '\0';
+        else                    *name = '\0';
+        return _resolve(parameter, _dataPath);
     }
+    if (!_resolve(parameter, _dataPath)) return false;
+    // Anything but a file is listed as a directory, or fails to open as one.
+    FTPDirEntry entry;
+    if (!*parameter || !_stat(_dataPath, entry) || entry.isDirectory) return true;
+    // A file lists as itself: its directory, filtered down to its name.
+    slash = strrchr(_dataPath, '/');
+    _listFilter.glob.compile(slash + 1, true, caseless);
+    if (slash == _dataPath) slash[1] = '\0';
+    else                    *slash = '\0';
+    return true;
 }
 
-void AsyncFTPClient::_onPassiveDisconnect(void *arg, AsyncClient *client) {
-    _controlClient->write("226 Closing data connection\r\n");
-    Serial.println("Passive client disconnected");
-    if (_STORFile)
-        _STORFile.close();
-    delete client;
-    delete _passiveServer;
+void AsyncFTPClient::_cmdLIST(char *parameter) {
+    if (!_listArgument(parameter, true)) return;
+    _dataCommand = ftpVerb("LIST");
+    _requestDataConnection();
 }
 
-// --------------------------------------------------------------------
-// *** Active Mode Functions ***
-// In active mode the client sends a PORT command.
-// When a data command (LIST, RETR, STOR) is received and _activeMode is true,
-// the server immediately creates an AsyncClient and connects to the client's IP/port.
-// --------------------------------------------------------------------
+void AsyncFTPClient::_cmdNLST(char *parameter) {
+    if (!_listArgument(parameter, true)) return;
+    _dataCommand = ftpVerb("NLST");
+    _requestDataConnection();
+}
 
-void AsyncFTPClient::_createActiveDataConnection() {
-    _activeDataClient = new AsyncClient();
-    _activeDataClient->onConnect([this](void *arg, AsyncClient *client) {
-        _onActiveConnect(arg, client);
-    }, this);
-    _activeDataClient->onData([this](void *arg, AsyncClient *client, void *data, size_t len) {
-        _onPassiveData(arg, client, data, len); // reuse the same callback for data.
-    }, this);
-    _activeDataClient->onDisconnect([this](void *arg, AsyncClient *client) {
-          // Send a “closing data connection” message.
-          _controlClient->write("226 Closing data connection\r\n");
-          Serial.println("Active data connection disconnected");
-      
-          // If a file was open for STOR, close it:
-          if (_STORFile) {
-              _STORFile.close();
-          }
+void AsyncFTPClient::_cmdMLSD(char *parameter) {
+    if (!_listArgument(parameter, false)) return;
+    _dataCommand = ftpVerb("MLSD");
+    _requestDataConnection();
+}
+
+void AsyncFTPClient::_cmdRETR(char *parameter) {
+    if (!_resolve(parameter, _dataPath)) return;
+    _dataCommand = ftpVerb("RETR");
+    _dataOffset = _restOffset;
+    _requestDataConnection();
+}
+
+void AsyncFTPClient::_cmdSTOR(char *parameter) {
+    if (!_resolve(parameter, _dataPath)) return;
+    _dataCommand = ftpVerb("STOR");
+    _dataOffset = _restOffset;
+    _requestDataConnection();
+}
+
+void AsyncFTPClient::_cmdAPPE(char *parameter) {
+    if (!_resolve(parameter, _dataPath)) return;
+    _dataCommand = ftpVerb("APPE");
+    _dataOffset = 0;
+    _requestDataConnection();
+}
+
+void AsyncFTPClient::_cmdALLO(char *parameter) {
+    // "ALLO size [R record]"; records mean nothing in stream mode. The
+    // size is checked against the free space now and again by the STOR.
+    char *end;
+    unsigned long size = strtoul(parameter, &end, 10);
+    if (!isdigit((unsigned char)*parameter) || (*end && *end != ' ') || size > UINT32_MAX) {
+        _controlClient->write("501 Invalid size\r\n");
+        return;
+    }
+    if (!_checkSpace((uint32_t)size)) return;
+    _allocSize = (uint32_t)size;
+    _replyf("200 Room for %u bytes\r\n", (unsigned)_allocSize);
+}
+
+bool AsyncFTPClient::_checkSpace(uint32_t bytes) {
+    uint64_t available;
+    if (!freeSpace(_FTPFS, available) || available >= bytes) return true;
+    _controlClient->write("552 Not enough free space\r\n");
+    return false;
+}
+
+void AsyncFTPClient::_cmdREST(char *parameter) {
+    char *end;
+    unsigned long offset = strtoul(parameter, &end, 10);
+    if (!isdigit((unsigned char)*parameter) || *end != '\0' || offset > UINT32_MAX) {
+        _controlClient->write("501 Invalid restart offset\r\n");
+        return;
+    }
+    _restOffset = (uint32_t)offset;
+    _replyf("350 Restarting at %u. Send STOR or RETR\r\n", (unsigned)_restOffset);
+}
+
+bool AsyncFTPClient::_stat(const char *path, FTPDirEntry &entry) {
+    entry.name = strcmp(path, "/") == 0 ? path : strrchr(path, '/') + 1;
+    entry.nameLength = (uint8_t)strlen(entry.name);
+    entry.isDirectory = true;
+    entry.size = 0;
+    entry.lastWrite = 0;
+    // The cache knows the root only as a listing, not as an entry.
+    if (strcmp(path, "/") == 0) return _FTPFS == FTP_FS::IMAGE || _filesystem;
+    if (_FTPFS == FTP_FS::IMAGE) {
+        AsyncFTPImage::File file;
+        if (!_server->_image.find(path, file)) return _server->_image.isDirectory(path);
+        entry.isDirectory = false;
+        entry.size = file.size;
+        entry.lastWrite = file.lastWrite;
+        return true;
+    }
+    int known = _server->_dirCache.lookup(path, entry);
+    if (known >= 0) return known;
+    File file = _FTPOpenFile(_filesystem, path);
+    if (!file) return false;
+    entry.isDirectory = file.isDirectory();
+    entry.size = entry.isDirectory ? 0 : file.size();
+    entry.lastWrite = (uint32_t)file.getLastWrite();
+    return true;
+}
+
+void AsyncFTPClient::_cmdSIZE(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    FTPDirEntry entry;
+    if (!_stat(path, entry) || entry.isDirectory) {
+        _controlClient->write("550 Could not get file size\r\n");
+        return;
+    }
+    _replyf("213 %u\r\n", (unsigned)entry.size);
+}
+
+void AsyncFTPClient::_cmdMDTM(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    FTPDirEntry entry;
+    if (!_stat(path, entry) || entry.isDirectory || !entry.lastWrite) {
+        _controlClient->write("550 Could not get modification time\r\n");
+        return;
+    }
+    time_t when = entry.lastWrite;
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    char reply[24];
+    strftime(reply, sizeof(reply), "213 %Y%m%d%H%M%S\r\n", &tm);
+    _controlClient->write(reply);
+}
+
+void AsyncFTPClient::_cmdMLST(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    FTPDirEntry entry;
+    if (!_stat(path, entry)) {
+        _controlClient->write("550 No such file or directory\r\n");
+        return;
+    }
+    // The facts line names the whole path, so its unique-id hashes from scratch.
+    FTPListFormat format;
+    format.style = FTPListFormat::FACTS;
+    format.facts = _mlstFacts;
+    format.pathHash = FNV_BASIS;
+    entry.name = path;
+    entry.nameLength = (uint8_t)strlen(path);
+    char line[LISTLINEMAX + 1] = " ";
+    _FTPListLine(entry, format, line + 1, sizeof(line) - 1);
+    _replyf("250-Listing %s\r\n", path);
+    _controlClient->write(line);
+    _controlClient->write("250 End\r\n");
+}
+
+void AsyncFTPClient::_cmdFEAT(char *parameter) {
+    // HASH lists every algorithm, the selected one marked with '*'.
+    char algorithms[32] = "";
+    for (uint8_t i = 0; i < AsyncFTPHash::ALGORITHMS; i++) {
+        snprintf(algorithms + strlen(algorithms), sizeof(algorithms) - strlen(algorithms), "%s%s%s",
+                 i ? ";" : "", AsyncFTPHash::name((AsyncFTPHash::Algorithm)i), i == _hashAlgorithm ? "*" : "");
+    }
+    // MLST lists every fact, the ones OPTS MLST selected marked with '*'.
+    char facts[48] = "";
+    for (uint8_t i = 0; i < FACT_COUNT; i++) {
+        snprintf(facts + strlen(facts), sizeof(facts) - strlen(facts), "%s%s;",
+                 factNames[i], (_mlstFacts & (1 << i)) ? "*" : "");
+    }
+    _replyf("211-Features:\r\n"
+            " EPSV\r\n"
+            " HASH %s\r\n"
+            " MDTM\r\n"
+            " MLST %s\r\n"
+            " MODE Z\r\n"
+            " REST STREAM\r\n"
+            " SIZE\r\n"
+            " XCRC\r\n"
+            " XMD5\r\n"
+            " XSHA256\r\n"
+            "211 End\r\n", algorithms, facts);
+}
+
+void AsyncFTPClient::_cmdMKD(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    if (_FTPCreateDirectory(_filesystem, path)) {
+        _server->_dirCache.invalidateParent(path);
+        _controlClient->write("257 Directory created\r\n");
+    }
+    else
+        _controlClient->write("550 Failed to create directory\r\n");
+}
+
+void AsyncFTPClient::_cmdRMD(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    if (_FTPDeleteDirectory(_filesystem, path)) {
+        _server->_dirCache.invalidate(path);
+        _server->_fileCache.invalidate(path);
+        _server->_hashCache.invalidate(path);
+        _server->_dirCache.invalidateParent(path);
+        _controlClient->write("250 Directory deleted\r\n");
+    }
+    else
+        _controlClient->write("550 Failed to delete directory\r\n");
+}
+
+void AsyncFTPClient::_cmdDELE(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    if (_FTPDeleteFile(_filesystem, path)) {
+        _server->_dirCache.invalidateParent(path);
+        _server->_fileCache.invalidate(path);
+        _server->_hashCache.invalidate(path);
+        _controlClient->write("250 File deleted\r\n");
+    }
+    else
+        _controlClient->write("550 Failed to delete file\r\n");
+}
+
+void AsyncFTPClient::_cmdRNFR(char *parameter) {
+    if (!_resolve(parameter, _renameFrom)) return; // store it for RNTO
+    _controlClient->write("350 Ready for RNTO\r\n");
+}
+
+void AsyncFTPClient::_cmdRNTO(char *parameter) {
+    char path[FTPPATHMAX];
+    if (!_resolve(parameter, path)) return;
+    if (_renameFrom[0] && _FTPMoveFile(_filesystem, _renameFrom, path)) {
+        // A renamed directory takes its cached subdirectories with it.
+        _server->_dirCache.invalidate(_renameFrom);
+        _server->_dirCache.invalidateParent(_renameFrom);
+        _server->_dirCache.invalidate(path);
+        _server->_dirCache.invalidateParent(path);
+        _server->_fileCache.invalidate(_renameFrom);
+        _server->_fileCache.invalidate(path);
+        _server->_hashCache.invalidate(_renameFrom);
+        _server->_hashCache.invalidate(path);
+        _controlClient->write("250 File renamed\r\n");
+    }
+    else
+        _controlClient->write("550 Failed to rename file\r\n");
+    _renameFrom[0] = '\0';
+}
+
+void AsyncFTPClient::_cmdQUIT(char *parameter) {
+    _controlClient->write("221 Goodbye\r\n");
+    _closeRequested = true;
+}
+
+void AsyncFTPClient::_cmdSITE(char *parameter) {
+    if (strcasecmp(parameter, "UNTAR") == 0) {
+        if (!_server->_backend.write) {
+            _controlClient->write("550 Read-only filesystem\r\n");
+            return;
+        }
+        _untarNext = true;
+        _controlClient->write("200 Next STOR unpacks a tar archive into the directory it names\r\n");
+        return;
+    }
+    // "SITE LISTLIMIT n" pages listings: each sends at most n entries (0:
+    // all), and a paused one names the "SITE LISTFROM k" that continues it.
+    bool limit = strncasecmp(parameter, "LISTLIMIT ", 10) == 0;
+    if (limit || strncasecmp(parameter, "LISTFROM ", 9) == 0) {
+        const char *value = parameter + (limit ? 10 : 9);
+        char *end;
+        unsigned long count = strtoul(value, &end, 10);
+        if (!isdigit((unsigned char)*value) || *end != '\0' || count > UINT32_MAX) {
+            _controlClient->write("501 Invalid count\r\n");
+            return;
+        }
+        if (limit) {
+            _listLimit = (uint32_t)count;
+            if (_listLimit) _replyf("200 Listings send at most %u entries\r\n", (unsigned)_listLimit);
+            else            _controlClient->write("200 Listings send every entry\r\n");
+        }
+        else {
+            _listFrom = (uint32_t)count;
+            _replyf("200 Next listing starts after %u entries\r\n", (unsigned)_listFrom);
+        }
+        return;
+    }
+    if (strcasecmp(parameter, "STATS") != 0) {
+        _controlClient->write("504 Unknown SITE command\r\n");
+        return;
+    }
+    AsyncFTPStats *stats = new (std::nothrow) AsyncFTPStats;
+    if (!stats) {
+        _controlClient->write("451 Not enough memory\r\n");
+        return;
+    }
+    _server->getStats(*stats);
+    AsyncFTPSessionStats session;
+    _server->getSessionStats(_index(), session);
+
+    // About 60 lines at most, more than the send buffer may hold: the reply
+    // is measured, then written into one allocation that _sendReply() sends
+    // as the client acks.
+    char *out = nullptr;
+    size_t size = 0, len = 0;
+    auto add = [&](const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(out ? out + len : nullptr, out ? size - len : 0, format, args);
+        va_end(args);
+        if (n > 0) len += n;
+    };
+    auto histogram = [&](const char *name, const FTPHistogram &h) {
+        add(" %s: %u samples, mean %u, p50 %u, p99 %u, max %u\r\n", name, (unsigned)h.count,
+            (unsigned)h.mean(), (unsigned)h.percentile(50), (unsigned)h.percentile(99), (unsigned)h.max);
+    };
+    auto report = [&]() {
+        add("211-Server statistics\r\n");
+        add(" Uptime: %u s\r\n", (unsigned)(stats->uptime / 1000));
+        add(" Sessions: %u of %u open, %u accepted, %u rejected\r\n", stats->sessions, stats->maxSessions,
+            (unsigned)stats->connections, (unsigned)stats->rejectedConnections);
+        add(" Data: %llu bytes in, %llu bytes out, %u connections rejected\r\n",
+            (unsigned long long)stats->bytesIn, (unsigned long long)stats->bytesOut,
+            (unsigned)stats->rejectedDataConnections);
+        add(" Transfers: %u completed, %u failed\r\n", (unsigned)stats->transfers, (unsigned)stats->failedTransfers);
+        histogram("Transfer time (ms)", stats->transferTime);
+        histogram("Throughput (KB/s)", stats->throughput);
+        histogram("Passive wait (us)", stats->passiveWait);
+        histogram("Command time (us)", stats->serviceTime);
+        add(" Heap: %u free, %u minimum\r\n", (unsigned)stats->freeHeap, (unsigned)stats->minFreeHeap);
+        add(" Reserved: %u bytes, peak %u, budget %u; refused %u sessions, %u transfers\r\n",
+            (unsigned)stats->heapReserved, (unsigned)stats->heapReservedPeak, (unsigned)stats->heapBudget,
+            (unsigned)stats->lowMemoryConnections, (unsigned)stats->lowMemoryTransfers);
+        add(" This session: %llu bytes in, %llu bytes out, %u commands, %u transfers\r\n",
+            (unsigned long long)session.bytesIn, (unsigned long long)session.bytesOut,
+            (unsigned)session.commands, (unsigned)session.transfers);
+        for (uint8_t i = 0; i < stats->commandCount; i++) {
+            const AsyncFTPStats::Command &command = stats->commands[i];
+            if (command.count == 0) continue;
+            add(" %s: %u, mean %u us, max %u us\r\n", command.verb, (unsigned)command.count,
+                (unsigned)(command.totalTime / command.count), (unsigned)command.maxTime);
+        }
+        add("211 End\r\n");
+    };
+    report();
+    size = len + 1;
+    out = (char*)malloc(size);
+    if (out) {
+        len = 0;
+        report();
+    }
+    delete stats;
+    if (!out) {
+        _controlClient->write("451 Not enough memory\r\n");
+        return;
+    }
+    _reply = out;
+    _replyLen = len;
+    _replyPos = 0;
+    _sendReply();
+}
+
+void AsyncFTPClient::_cmdMODE(char *parameter) {
+    if (strcasecmp(parameter, "S") == 0)      _modeZ = false;
+    else if (strcasecmp(parameter, "Z") == 0) _modeZ = true;
+    else {
+        _controlClient->write("504 Mode not supported\r\n");
+        return;
+    }
+    _replyf("200 Mode set to %c\r\n", _modeZ ? 'Z' : 'S');
+}
+
+void AsyncFTPClient::_cmdOPTS(char *parameter) {
+    // "OPTS HASH [algorithm]" shows or selects the algorithm HASH uses.
+    if (strncasecmp(parameter, "HASH", 4) == 0 && (parameter[4] == '\0' || parameter[4] == ' ')) {
+        const char *name = parameter + 4;
+        while (*name == ' ') name++;
+        if (*name) {
+            AsyncFTPHash::Algorithm algorithm = AsyncFTPHash::find(name);
+            if (algorithm == AsyncFTPHash::ALGORITHMS) {
+                _controlClient->write("504 Unknown hash algorithm\r\n");
+                return;
+            }
+            _hashAlgorithm = algorithm;
+        }
+        _replyf("200 %s\r\n", AsyncFTPHash::name(_hashAlgorithm));
+        return;
+    }
+    // "OPTS MLST fact;fact;..." selects the facts MLSD and MLST list;
+    // unknown ones are ignored.
+    if (strncasecmp(parameter, "MLST", 4) == 0 && (parameter[4] == '\0' || parameter[4] == ' ')) {
+        uint8_t facts = 0;
+        char *save = nullptr;
+        for (char *fact = strtok_r(parameter + 4, " ;", &save); fact; fact = strtok_r(nullptr, " ;", &save)) {
+            for (uint8_t i = 0; i < FACT_COUNT; i++) {
+                if (strcasecmp(fact, factNames[i]) == 0) facts |= 1 << i;
+            }
+        }
+        _mlstFacts = facts;
+        char reply[48] = "200 MLST OPTS ";
+        for (uint8_t i = 0; i < FACT_COUNT; i++) {
+            if (facts & (1 << i))
+                snprintf(reply + strlen(reply), sizeof(reply) - strlen(reply), "%s;", factNames[i]);
+        }
+        strncat(reply, "\r\n", sizeof(reply) - strlen(reply) - 1);
+        _controlClient->write(reply);
+        return;
+    }
+    // Otherwise only "OPTS MODE Z LEVEL n": higher levels trade CPU for bandwidth.
+    static const char prefix[] = "MODE Z LEVEL ";
+    unsigned long level = 0;
+    bool valid = strncasecmp(parameter, prefix, sizeof(prefix) - 1) == 0;
+    if (valid) {
+        const char *value = parameter + sizeof(prefix) - 1;
+        char *end;
+        level = strtoul(value, &end, 10);
+        valid = isdigit((unsigned char)*value) && *end == '\0' && level <= 9;
+    }
+    if (!valid) {
+        _controlClient->write("501 Option not understood\r\n");
+        return;
+    }
+    _modeZLevel = (uint8_t)level;
+    _replyf("200 MODE Z LEVEL set to %u\r\n", (unsigned)_modeZLevel);
+}
+
+void AsyncFTPClient::_cmdHASH(char *parameter) {
+    _beginHash(ftpVerb("HASH"), _hashAlgorithm, parameter, _rangeStart, _rangeEnd);
+}
+
+void AsyncFTPClient::_cmdRANG(char *parameter) {
+    // "RANG start end", both inclusive; "RANG 1 0" goes back to the whole file.
+    unsigned long start = 0, end = 0;
+    char *next = parameter, *last = parameter;
+    bool valid = isdigit((unsigned char)*next);
+    if (valid) {
+        start = strtoul(next, &next, 10);
+        while (*next == ' ') next++;
+        valid = isdigit((unsigned char)*next);
+    }
+    if (valid) {
+        end = strtoul(next, &last, 10);
+        valid = *last == '\0' && start < UINT32_MAX && end < UINT32_MAX;
+    }
+    if (!valid || (start > end && !(start == 1 && end == 0))) {
+        _controlClient->write("501 Invalid range\r\n");
+        return;
+    }
+    if (start > end) {
+        _rangeStart = 0;
+        _rangeEnd = UINT32_MAX;
+        _controlClient->write("350 Range reset\r\n");
+        return;
+    }
+    _rangeStart = (uint32_t)start;
+    _rangeEnd = (uint32_t)end + 1;
+    _replyf("350 Range set to %u-%u. Send HASH\r\n", (unsigned)start, (unsigned)end);
+}
+
+void AsyncFTPClient::_cmdXCRC(char *parameter) {
+    _beginXHash(ftpVerb("XCRC"), AsyncFTPHash::CRC32, parameter);
+}
+
+void AsyncFTPClient::_cmdXMD5(char *parameter) {
+    _beginXHash(ftpVerb("XMD5"), AsyncFTPHash::MD5, parameter);
+}
+
+void AsyncFTPClient::_cmdXSHA(char *parameter) {
+    _beginXHash(ftpVerb("XSHA"), AsyncFTPHash::SHA256, parameter);
+}
+
+void AsyncFTPClient::_beginXHash(uint32_t verb, AsyncFTPHash::Algorithm algorithm, char *parameter) {
+    // "XCRC path" hashes the whole file; '"path" start [end]' a part of it,
+    // end exclusive. An unquoted path may contain spaces, so takes no range.
+    uint32_t start = 0, end = UINT32_MAX;
+    if (*parameter == '"') {
+        char *close = strchr(parameter + 1, '"');
+        if (!close) {
+            _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+            return;
+        }
+        *close = '\0';
+        char *next = close + 1;
+        parameter++;
+        unsigned long values[2] = {0, UINT32_MAX};
+        for (int i = 0; i < 2; i++) {
+            while (*next == ' ') next++;
+            if (!*next) break;
+            char *last;
+            values[i] = strtoul(next, &last, 10);
+            if (!isdigit((unsigned char)*next) || (*last != '\0' && *last != ' ') || values[i] > UINT32_MAX) {
+                _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+                return;
+            }
+            next = last;
+        }
+        while (*next == ' ') next++;
+        if (*next) {
+            _controlClient->write("501 Syntax error in parameters or arguments\r\n");
+            return;
+        }
+        start = (uint32_t)values[0];
+        end = (uint32_t)values[1];
+    }
+    _beginHash(verb, algorithm, parameter, start, end);
+}
+
+void AsyncFTPClient::_beginHash(uint32_t verb, AsyncFTPHash::Algorithm algorithm, char *parameter,
+                                uint32_t start, uint32_t end) {
+    if (!_resolve(parameter, _dataPath)) return;
+    AsyncFTPImage::File image;
+    File file;
+    if (_FTPFS == FTP_FS::IMAGE) _server->_image.find(_dataPath, image);
+    else                         file = _FTPOpenFile(_filesystem, _dataPath);
+    if (!image.data && (!file || file.isDirectory())) {
+        _controlClient->write("550 File not found\r\n");
+        return;
+    }
+    uint32_t size = image.data ? image.size : file.size();
+    if (end > size) end = size;
+    if (start > end) {
+        _controlClient->write("554 Invalid range\r\n");
+        return;
+    }
+    _hashVerb = verb;
+    _hashRunning = algorithm;
+    _hashStart = start;
+    _hashEnd = end;
+    _hashSize = size;
+    _hashLastWrite = image.data ? image.lastWrite : (uint32_t)file.getLastWrite();
+
+    // Asking again for an unchanged file costs no reading at all.
+    char hex[AsyncFTPHash::HEX_MAX];
+    AsyncFTPHashCache::Key key = {_dataPath, algorithm, start, end, size, _hashLastWrite};
+    if (_server->_hashCache.find(key, hex)) {
+        _replyHash(hex);
+        return;
+    }
+    _hash = new (std::nothrow) AsyncFTPHash;
+    if (!_hash) {
+        _controlClient->write("451 Not enough memory\r\n");
+        return;
+    }
+    _hash->begin(algorithm);
+    if (image.data) {
+        // Mapped flash is hashed in place; there is no reading to wait for.
+        _hash->update(image.data + start, end - start);
+        _hashRemaining = 0;
+        _finishHash(true);
+        return;
+    }
+    if (start > 0 && !file.seek(start)) {
+        _finishHash(false);
+        return;
+    }
+    _hashRemaining = end - start;
+
+    // Like RETR, anything bigger than one buffer is read by the I/O task if
+    // it has a job free, and the session stays busy until the reply is out.
+    if (_hashRemaining > FILEBUFFERSIZE && _hashLock) {
+        AsyncFTPReadAhead *job = _server->_io.startRead(file, _hashRemaining, _wakeHash, this);
+        if (job) {
+            xSemaphoreTake(_hashLock, portMAX_DELAY);
+            _hashJob = job;
+            xSemaphoreGive(_hashLock);
+            _pumpHash();
+            _checkHash();
+            return;
+        }
+    }
+    while (_hashRemaining > 0) {
+        size_t n = file.read(_sendBuffer, _hashRemaining < FILEBUFFERSIZE ? _hashRemaining : FILEBUFFERSIZE);
+        if (n == 0) break;
+        _hash->update(_sendBuffer, n);
+        _hashRemaining -= n;
+    }
+    _finishHash(_hashRemaining == 0);
+}
+
+void AsyncFTPClient::_pumpHash() {
+    xSemaphoreTake(_hashLock, portMAX_DELAY);
+    AsyncFTPReadAhead *job = _hashJob;
+    bool done = false;
+    if (job && !_hashDone) {
+        for (;;) {
+            size_t len;
+            const uint8_t *data = job->peek(len);
+            if (data) {
+                _hash->update(data, len);
+                job->consume(len);
+                _hashRemaining -= len < _hashRemaining ? len : _hashRemaining;
+                continue;
+            }
+            if (job->done()) {
+                // From here on the hash belongs to the network task.
+                _hashDone = done = true;
+                break;
+            }
+            if (job->wait()) break;
+        }
+    }
+    xSemaphoreGive(_hashLock);
+    if (done) _controlPoke.fire();
+}
+
+void AsyncFTPClient::_wakeHash(void *arg) {
+    ((AsyncFTPClient*)arg)->_pumpHash();
+}
+
+void AsyncFTPClient::_finishHash(bool complete) {
+    if (complete) {
+        char hex[AsyncFTPHash::HEX_MAX];
+        _hash->finish(hex);
+        AsyncFTPHashCache::Key key = {_dataPath, _hashRunning, _hashStart, _hashEnd, _hashSize, _hashLastWrite};
+        _server->_hashCache.add(key, hex);
+        _replyHash(hex);
+    }
+    else
+        _controlClient->write("451 Read failed\r\n");
+    // A job's hash is freed by _endHash() along with the job.
+    if (_hashJob) return;
+    delete _hash;
+    _hash = nullptr;
+}
+
+void AsyncFTPClient::_replyHash(const char *hex) {
+    if (_hashVerb != ftpVerb("HASH")) {
+        _replyf("250 %s\r\n", hex);
+        return;
+    }
+    // draft-bryan-ftpext-hash: algorithm, inclusive range, digest, file.
+    char reply[FTPPATHMAX + AsyncFTPHash::HEX_MAX + 48];
+    snprintf(reply, sizeof(reply), "213 %s %u-%u %s %s\r\n", AsyncFTPHash::name(_hashRunning),
+             (unsigned)_hashStart, (unsigned)(_hashEnd > _hashStart ? _hashEnd - 1 : _hashStart), hex, _dataPath);
+    _controlClient->write(reply);
+}
+
+void AsyncFTPClient::_checkHash() {
+    if (!_hashDone) return;
+    _finishHash(_hashRemaining == 0);
+    _endHash();
+    _resumeCommands();
+}
+
+void AsyncFTPClient::_endHash() {
+    if (!_hashLock) return;
+    xSemaphoreTake(_hashLock, portMAX_DELAY);
+    if (_hashJob) _server->_io.finishRead(_hashJob);
+    _hashJob = nullptr;
+    _hashDone = false;
+    xSemaphoreGive(_hashLock);
+    delete _hash;
+    _hash = nullptr;
+}
+
+void AsyncFTPClient::_requestDataConnection() {
+    // Checked again, and reserved, once the transfer starts; refusing now
+    // saves opening a data connection for nothing.
+    if ((_activeMode || _passiveDataClient || _passivePort) &&
+        !_server->_heap.admits(_transferCost(_dataCommand))) {
+        _replyLowMemory(_dataCommand);
+        _dataCommand = 0;
+        return;
+    }
+    if (_activeMode)
+        _createActiveDataConnection();
+    else if (_passiveDataClient)
+        _startDataCommand(_passiveDataClient);
+    else if (!_passivePort) {
+        // Nothing to wait for; later commands would queue behind it forever.
+        _dataCommand = 0;
+        _controlClient->write("425 Use PORT or PASV first\r\n");
+    }
+    // Otherwise, in passive mode the client connects to our passive server.
+}
+
+size_t AsyncFTPClient::_transferCost(uint32_t command) const {
+    size_t bytes = FTP_HEAP_CONNECTION;
+    if (isUpload(command)) {
+        bytes += storBlockSize(_server->_storBufferSize, _server->_backend);
+        if (_modeZ) bytes += AsyncFTPInflate::memory();
+        if (_untarNext && command == ftpVerb("STOR")) bytes += sizeof(AsyncFTPTarReader);
+        return bytes;
+    }
+    if (_modeZ) bytes += AsyncFTPDeflate::memory();
+    // Any RETR might turn out to be an archive.
+    if (command == ftpVerb("RETR")) bytes += sizeof(AsyncFTPTarWriter);
+    return bytes;
+}
+
+void AsyncFTPClient::_transferAllocated(size_t bytes) {
+    if (bytes > _transferPending) bytes = _transferPending;
+    _transferPending -= bytes;
+    _server->_heap.allocated(bytes);
+}
+
+void AsyncFTPClient::_replyLowMemory(uint32_t command) {
+    _server->_stats.lowMemoryTransfers++;
+    _controlClient->write(isUpload(command) ? "452 Not enough memory for the transfer\r\n"
+                                            : "425 Not enough memory for the transfer\r\n");
+}
+
+uint16_t AsyncFTPClient::_openPassivePort() {
+    if (_passiveDataClient) {
+        if (_RETRFile || _retrJob || _retrCached.slot >= 0 || _retrImage.data || _tar || _listing ||
+            _STORFile || _untar) {
+            _controlClient->write("425 Data connection busy\r\n");
+            return 0;
+        }
+        // Connected for an earlier PASV but never used.
+        _discardDataClient(_passiveDataClient);
+    }
+    // The port is already listening, so the client can connect as soon as
+    // it reads the reply. A session keeps its lease until the data
+    // connection closes.
+    if (!_passivePort) _passivePort = _server->_leasePassivePort(this);
+    if (!_passivePort) {
+        _controlClient->write("425 No passive port available\r\n");
+        return 0;
+    }
+    _activeMode = false;
+    _passiveSince = micros();
+    _passiveWaiting = true;
+    return _passivePort->port;
+}
+
+void AsyncFTPClient::_releasePassivePort() {
+    if (!_passivePort) return;
+    _passivePort->session = nullptr;
+    _passivePort = nullptr;
+}
+
+void AsyncFTPClient::_onPassiveClient(void *arg, AsyncClient *client) {
+    FTP_LOGD("session %u: passive data connection opened", _index());
+    client->onData([this](void *arg, AsyncClient *client, void *data, size_t len) {
+        _onPassiveData(arg, client, data, len);
+    }, this);
+    client->onDisconnect([this](void *arg, AsyncClient *client) {
+        _onPassiveDisconnect(arg, client);
+    }, this);
+    
+    // Most clients connect right after PASV and only then send the data
+    // command; keep the connection until that command arrives.
+    _passiveDataClient = client;
+    if (_passiveWaiting) {
+        _passiveWaiting = false;
+        _server->_stats.passiveWait.add((uint32_t)micros() - _passiveSince);
+    }
+    if (_dataCommand)
+        _startDataCommand(client);
+}
+
+void AsyncFTPClient::_startDataCommand(AsyncClient *client) {
+    uint32_t command = _dataCommand;
+    _dataCommand = 0;
+    _transferVerb = command;
+    _transferStart = millis();
+    _transferBytes = 0;
+    _server->_activeTransfers++;
+    size_t cost = _transferCost(command);
+    if (!_server->_heap.reserve(cost)) {
+        _transferFailed = true;
+        _replyLowMemory(command);
+        client->close();
+        return;
+    }
+    _transferHeap = cost;
+    _transferPending = cost;
+    if (_modeZ && !_beginModeZ(isUpload(command))) {
+        _transferFailed = true;
+        _controlClient->write("451 Not enough memory for MODE Z\r\n");
+        client->close();
+        return;
+    }
+    switch (command) {
+        case ftpVerb("LIST"):
+        case ftpVerb("NLST"):
+        case ftpVerb("MLSD"): _processListCommand(client); break;
+        case ftpVerb("RETR"): _processRetrCommand(client); break;
+        case ftpVerb("STOR"): _processStorCommand(client, false); break;
+        case ftpVerb("APPE"): _processStorCommand(client, true); break;
+    }
+}
+
+bool AsyncFTPClient::_beginModeZ(bool upload) {
+    if (upload) {
+        _inflate = new (std::nothrow) AsyncFTPInflate;
+        if (_inflate) _inflate->begin();
+        return _inflate;
+    }
+    // The compressor's window and tables are allocated up front; the
+    // decompressor's window only once the stream header gives its size.
+    _deflate = new (std::nothrow) AsyncFTPDeflate;
+    if (_deflate && _deflate->begin(_modeZLevel)) {
+        _transferAllocated(AsyncFTPDeflate::memory());
+        return true;
+    }
+    _endModeZ();
+    return false;
+}
+
+void AsyncFTPClient::_endModeZ() {
+    delete _deflate;
+    delete _inflate;
+    _deflate = nullptr;
+    _inflate = nullptr;
+}
+
+void AsyncFTPClient::_onPassiveData(void *arg, AsyncClient *client, void *data, size_t len) {
+    if (!_storBuffer || (!_STORFile && !_untar)) return;
+
+    // Withhold the window update until the bytes have reached the filesystem;
+    // _flushStorBuffer() acks them once a whole block has been written.
+    client->ackLater();
+    _transferBytes += len;
+    if (!_inflate && !_untar) {
+        if (!_writeStorData(client, (const uint8_t*)data, len)) client->close();
+        return;
+    }
+    // Compressed data and archives: what is written is not what arrived,
+    // so the input is counted and acked separately.
+    _storUnacked += len;
+    bool ok = _inflate ? _inflateStorData(client, (const uint8_t*)data, len)
+                       : _unpackStorData(client, (const uint8_t*)data, len);
+    // Well-compressed data fills the buffer long before the window runs
+    // out; data that does not compress, or archive headers, must not be
+    // held back beyond it.
+    if (ok && _storUnacked >= _storBlockSize && !_flushStorBuffer(client)) {
+        _failStorWrite();
+        ok = false;
+    }
+    if (!ok) client->close();
+}
+
+bool AsyncFTPClient::_writeStorData(AsyncClient *client, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = _storBlockSize - _storLen;
+        if (n > len) n = len;
+        memcpy(_storBuffer + _storLen, data, n);
+        _storLen += n;
+        data += n;
+        len -= n;
+        if (_storLen == _storBlockSize && !_flushStorBuffer(client)) {
+            _failStorWrite();
+            return false;
+        }
+    }
+    return true;
+}
+
+void AsyncFTPClient::_failStorWrite() {
+    _STORFile.close();
+    _transferFailed = true;
+    _controlClient->write("452 Write failed; transfer aborted\r\n");
+}
+
+bool AsyncFTPClient::_flushStorBuffer(AsyncClient *client) {
+    size_t len = _storLen;
+    _storLen = 0;
+    if (len > 0 && _STORFile.write(_storBuffer, len) != len) return false;
+    // A compressed upload or an archive acks what arrived, not what was written.
+    size_t acked = _inflate || _untar ? _storUnacked : len;
+    _storUnacked = 0;
+    if (client && acked > 0) _ackStorData(client, acked);
+    return true;
+}
+
+void AsyncFTPClient::_ackStorData(AsyncClient *client, size_t len) {
+    _ackPending += len;
+    size_t n = _rateBudget(_ackPending);
+    if (n == 0) return;
+    _spendBudget(n);
+    _ackPending -= n;
+    client->ack(n);
+}
+
+bool AsyncFTPClient::_inflateStorData(AsyncClient *client, const uint8_t *data, size_t len) {
+    for (;;) {
+        size_t n;
+        const uint8_t *out = _inflate->output(n);
+        if (n == 0) {
+            if (len == 0 || _inflate->done() || _inflate->failed()) break;
+            size_t taken = _inflate->write(data, len);
+            data += taken;
+            len -= taken;
+            continue;
+        }
+        bool ok = _untar ? _unpackStorData(client, out, n) : _writeStorData(client, out, n);
+        if (!ok) return false;
+        _inflate->consume(n);
+    }
+    if (_inflate->failed() || len > 0) {
+        _STORFile.close();
+        _transferFailed = true;
+        _controlClient->write("451 Invalid compressed data; transfer aborted\r\n");
+        return false;
+    }
+    return true;
+}
+
+bool AsyncFTPClient::_beginUnpack() {
+    // The target directory may be new.
+    _FTPCreateDirectory(_filesystem, _dataPath);
+    File dir = _FTPOpenDirectory(_filesystem, _dataPath);
+    bool exists = dir;
+    dir.close();
+    if (!exists) {
+        _controlClient->write("550 Failed to create directory\r\n");
+        return false;
+    }
+    _untar = new (std::nothrow) AsyncFTPTarReader;
+    if (!_untar) {
+        _controlClient->write("451 Not enough memory\r\n");
+        return false;
+    }
+    _transferAllocated(sizeof(AsyncFTPTarReader));
+    _untar->begin();
+    _server->invalidateCache(_dataPath);
+    _server->_dirCache.invalidateParent(_dataPath);
+    return true;
+}
+
+bool AsyncFTPClient::_unpackStorData(AsyncClient *client, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t used;
+        AsyncFTPTarReader::Result result = _untar->parse(data, len, used);
+        if (result == AsyncFTPTarReader::DATA && !_writeStorData(client, data, used)) return false;
+        data += used;
+        len -= used;
+        if (result == AsyncFTPTarReader::ENTRY && !_unpackEntry(client)) return false;
+        if (result == AsyncFTPTarReader::INVALID) {
+            _STORFile.close();
+            _transferFailed = true;
+            _controlClient->write("451 Invalid tar archive; transfer aborted\r\n");
+            return false;
+        }
+        if (result == AsyncFTPTarReader::END) break;
+    }
+    return true;
+}
+
+bool AsyncFTPClient::_unpackEntry(AsyncClient *client) {
+    // The previous file's last bytes are still in the buffer.
+    if (!_flushStorBuffer(client)) {
+        _failStorWrite();
+        return false;
+    }
+    _STORFile.close();
+    char path[FTPPATHMAX];
+    if (!resolvePath(path, sizeof(path), _dataPath, _untar->path())) {
+        _transferFailed = true;
+        _controlClient->write("553 Path in archive too long; transfer aborted\r\n");
+        return false;
+    }
+    if (_untar->isDirectory()) {
+        // Fails harmlessly if it exists.
+        _FTPCreateDirectory(_filesystem, path);
+        return true;
+    }
+    _STORFile = _FTPCreateFile(_filesystem, path);
+    if (!_STORFile) {
+        // Archives usually list a directory before its files, but need not:
+        // create the missing parents and try again.
+        for (char *slash = strchr(path + strlen(_dataPath) + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            _FTPCreateDirectory(_filesystem, path);
+            *slash = '/';
+        }
+        _STORFile = _FTPCreateFile(_filesystem, path);
+    }
+    if (!_STORFile) {
+        _transferFailed = true;
+        _replyf("553 Failed to create %s; transfer aborted\r\n", path);
+        return false;
+    }
+    return true;
+}
+
+void AsyncFTPClient::_processListCommand(AsyncClient *client) {
+    // The directory stays open for the whole transfer and is formatted a
+    // buffer at a time as the send window opens, so memory use does not
+    // depend on the number of entries. A cached listing is replayed the
+    // same way without touching the filesystem.
+    // LIST, NLST and MLSD share the walk and the cache; only the format differs.
+    _listFormat.style = _transferVerb == ftpVerb("MLSD") ? FTPListFormat::FACTS
+                      : _transferVerb == ftpVerb("NLST") ? FTPListFormat::NAMES
+                      :                                    FTPListFormat::LONG;
+    _listFormat.facts = _mlstFacts;
+    _listFormat.pathHash = directoryHash(_dataPath);
+    AsyncFTPDirCache &cache = _server->_dirCache;
+    if (_FTPFS == FTP_FS::IMAGE) {
+        _listImage = _server->_image.isDirectory(_dataPath);
+        _listCursor = 0;
+    }
+    else if (!cache.openListing(_dataPath, _listCached)) {
+        _listDir = _FTPOpenDirectory(_filesystem, _dataPath);
+        if (_listDir) _listFill = cache.beginFill(_dataPath);
+    }
+    _listing = _listCached.slot >= 0 || _listDir || _listImage;
+    if (_listing) {
+        _controlClient->write("150 Here comes the directory listing\r\n");
+        _beginSend(client);
+    }
+    else {
+        _transferFailed = true;
+        _controlClient->write("550 Failed to open directory\r\n");
+        client->close();
+    }
+}
+
+void AsyncFTPClient::_processStorCommand(AsyncClient *client, bool append) {
+    bool unpack = _untarNext && !append;
+    _untarNext = false;
+    if (unpack) {
+        if (_dataOffset > 0) {
+            _transferFailed = true;
+            _controlClient->write("554 Archives cannot be resumed\r\n");
+            client->close();
+            return;
+        }
+        if (!_beginUnpack()) {
+            _transferFailed = true;
+            client->close();
+            return;
+        }
+    }
+    else {
+        uint32_t allocSize = _allocSize;
+        _allocSize = 0;
+        if (allocSize && !_checkSpace(allocSize)) {
+            _transferFailed = true;
+            client->close();
+            return;
+        }
+        // A new upload goes to a temporary file, renamed over the target
+        // once complete, so readers never see a half-written file and a
+        // failed upload leaves the old one alone. Should the temporary
+        // name not work (too long for the filesystem), it is written in
+        // place as before. After REST or APPE the file is kept up to the
+        // offset and written in place from there.
+        FTPDirEntry entry;
+        char temp[FTPPATHMAX];
+        if (!append && _dataOffset == 0 && !(_stat(_dataPath, entry) && entry.isDirectory) &&
+            tempUploadPath(temp, _dataPath, _index())) {
+            _STORFile = _FTPCreateFile(_filesystem, temp);
+            _storAtomic = _STORFile;
+        }
+        if (!_STORFile)
+            _STORFile = append ? _FTPAppendFile(_filesystem, _dataPath) : _FTPResumeFile(_filesystem, _dataPath, _dataOffset);
+        if (!_STORFile) {
+            _transferFailed = true;
+            if (!append && _dataOffset > 0)
+                _controlClient->write("554 Invalid restart offset\r\n");
+            else
+                _controlClient->write("550 Failed to create file\r\n");
+            client->close();
+            return;
+        }
+        // The file now exists (or was truncated); its size changes again as
+        // data arrives, so the listing is dropped once more when it is closed.
+        _server->_dirCache.invalidateParent(_dataPath);
+        _server->_fileCache.invalidate(_dataPath);
+        _server->_hashCache.invalidate(_dataPath);
+    }
+
+    _storBlockSize = storBlockSize(_server->_storBufferSize, _server->_backend);
+    _storLen = 0;
+    _ackPending = 0;
+    _storBuffer = (uint8_t*)malloc(_storBlockSize);
+    if (!_storBuffer) {
+        _STORFile.close();
+        _transferFailed = true;
+        _controlClient->write("451 Not enough memory\r\n");
+        client->close();
+        return;
+    }
+    _transferAllocated(_storBlockSize);
+    // Under a rate limit, acks held back for want of tokens are sent from here.
+    client->onPoll([this](void *arg, AsyncClient *client)
+    {
+        _ackStorData(client, 0);
+    }, this);
+    _controlClient->write(unpack ? "150 Ok to send archive\r\n" : "150 Ok to send data\r\n");
+}
+
+void AsyncFTPClient::_processRetrCommand(AsyncClient *client) {
+    if (_FTPFS == FTP_FS::IMAGE) {
+        // Already in memory: no file, cache or read-ahead involved.
+        if (!_server->_image.find(_dataPath, _retrImage)) {
+            _transferFailed = true;
+            _controlClient->write("550 Failed to open file\r\n");
+            client->close();
+            return;
+        }
+        if (_dataOffset > _retrImage.size) {
+            _retrImage = AsyncFTPImage::File();
+            _transferFailed = true;
+            _controlClient->write("554 Invalid restart offset\r\n");
+            client->close();
+            return;
+        }
+        _retrImagePos = _dataOffset;
+        _controlClient->write("150 Sending file\r\n");
+        _beginSend(client);
+        return;
+    }
+    // Small files are sent from the file cache, which reads them whole the
+    // first time they are requested.
+    AsyncFTPFileCache &files = _server->_fileCache;
+    if (!files.open(_dataPath, _retrCached)) {
+        _RETRFile = _FTPOpenFile(_filesystem, _dataPath);
+        if (_RETRFile && !_RETRFile.isDirectory()) {
+            if (files.fill(_dataPath, _RETRFile, _retrCached)) _RETRFile.close();
+            else _RETRFile.seek(0);
+        }
+    }
+    if (_RETRFile && _RETRFile.isDirectory()) _RETRFile.close();
+    if (!_RETRFile && _retrCached.slot < 0 && _openArchive()) {
+        // The archive is generated as it goes, so there is nothing to resume.
+        if (_dataOffset > 0) {
+            _closeArchive();
+            _transferFailed = true;
+            _controlClient->write("554 Archives cannot be resumed\r\n");
+            client->close();
+            return;
+        }
+        _controlClient->write("150 Sending archive\r\n");
+        _beginSend(client);
+        return;
+    }
+    if (_retrCached.slot >= 0) {
+        if (_dataOffset > _retrCached.size) {
+            files.close(_retrCached);
+            _transferFailed = true;
+            _controlClient->write("554 Invalid restart offset\r\n");
+            client->close();
+            return;
+        }
+        _retrCached.pos = _dataOffset;
+        _controlClient->write("150 Sending file\r\n");
+        _beginSend(client);
+        return;
+    }
+    if (_RETRFile && _dataOffset > 0 && (_dataOffset > _RETRFile.size() || !_RETRFile.seek(_dataOffset))) {
+        _RETRFile.close();
+        _transferFailed = true;
+        _controlClient->write("554 Invalid restart offset\r\n");
+        client->close();
+        return;
+    }
+    if (_RETRFile) {
+        // Anything bigger than one buffer is read ahead by the I/O task, if
+        // it has a job free; the job then owns the file.
+        uint32_t remaining = _RETRFile.size() - _RETRFile.position();
+        if (remaining > FILEBUFFERSIZE) {
+            _retrJob = _server->_io.startRead(_RETRFile, remaining, _wakeReadAhead, this);
+            if (_retrJob) {
+                _sendClient = client;
+                _sendPoke.bind(client);
+                _RETRFile = fs::File();
+            }
+        }
+        _controlClient->write("150 Sending file\r\n");
+        _beginSend(client);
+    }
+    else {
+        _transferFailed = true;
+        _controlClient->write("550 Failed to open file\r\n");
+        client->close();
+    }
+}
+
+bool AsyncFTPClient::_openArchive() {
+    size_t length = strlen(_dataPath);
+    if (length < 4 || strcasecmp(_dataPath + length - 4, ".tar") != 0) return false;
+    // "/logs.tar" archives /logs as logs/...; "/.tar" the whole filesystem.
+    char dirPath[FTPPATHMAX];
+    memcpy(dirPath, _dataPath, length - 4);
+    dirPath[length - 4] = '\0';
+    if (length == 5) strcpy(dirPath, "/");
+    File dir = _FTPOpenDirectory(_filesystem, dirPath);
+    if (!dir) return false;
+    _tar = new (std::nothrow) AsyncFTPTarWriter;
+    if (_tar && _tar->begin(dir, strrchr(dirPath, '/') + 1)) {
+        _transferAllocated(sizeof(AsyncFTPTarWriter));
+        return true;
+    }
+    _closeArchive();
+    return false;
+}
+
+void AsyncFTPClient::_closeArchive() {
+    if (!_tar) return;
+    _tar->end();
+    delete _tar;
+    _tar = nullptr;
+}
+
+void AsyncFTPClient::_beginSend(AsyncClient *client) {
+    _sendData = _sendBuffer;
+    _sendLen = 0;
+    _sendPos = 0;
+    _transferComplete = false;
+    // The transfer is driven by acks: every time the peer frees window space
+    // we top it up again. Poll only acts as a safety net.
+    client->onAck([this](void *arg, AsyncClient *client, size_t len, uint32_t time)
+    {
+        _sendFileChunk(client);
+    }, this);
+    client->onPoll([this](void *arg, AsyncClient *client)
+    {
+        _sendFileChunk(client);
+    }, this);
+    _sendFileChunk(client);
+}
+
+size_t AsyncFTPClient::_fillSendBuffer() {
+    _sendData = _sendBuffer;
+    if (_retrCached.slot >= 0) {
+        size_t len;
+        _sendData = _server->_fileCache.read(_retrCached, len);
+        return len;
+    }
+    if (_retrImage.data) {
+        // All that is left, in place; the send loop takes what fits.
+        _sendData = _retrImage.data + _retrImagePos;
+        size_t len = _retrImage.size - _retrImagePos;
+        _retrImagePos = _retrImage.size;
+        return len;
+    }
+    if (_RETRFile) return _RETRFile.read(_sendBuffer, FILEBUFFERSIZE);
+    if (_tar)      return _tar->read(_sendBuffer, FILEBUFFERSIZE);
+    if (_listDir)  return _FTPDirectoryList(_listDir, _listFormat, _listFilter, (char*)_sendBuffer,
+                                            FILEBUFFERSIZE, &_server->_dirCache, _listFill);
+    size_t len = 0;
+    FTPDirEntry entry;
+    while (FILEBUFFERSIZE - len >= LISTLINEMAX && !_listFilter.done() &&
+           (_listImage ? _server->_image.nextEntry(_dataPath, _listCursor, entry)
+                       : _server->_dirCache.nextEntry(_listCached, entry))) {
+        if (_listFilter.admit(entry))
+            len += _FTPListLine(entry, _listFormat, (char*)_sendBuffer + len, FILEBUFFERSIZE - len);
+    }
+    return len;
+}
+
+void AsyncFTPClient::_sendFileChunk(AsyncClient *client) {
+    if (_retrJob) {
+        if (_pumpReadAhead()) {
+            _endReadAhead();
+            _transferComplete = true;
+            client->close();
+        }
+        return;
+    }
+    if (!_RETRFile && _retrCached.slot < 0 && !_retrImage.data && !_tar && !_listing) return;
+
+    // Queue as much as the send window and the budget accept, then push it
+    // out with a single send(). Bytes that add() refuses stay in _sendData
+    // for the next round.
+    size_t budget = _sendBudget(client->space());
+    size_t sent = 0;
+    bool finished = false;
+    while (sent < budget) {
+        if (_deflate) {
+            // MODE Z: send compressed output, refilling the compressor from
+            // _sendData whenever it runs dry.
+            size_t len;
+            const uint8_t *out = _deflate->output(len);
+            if (len == 0) {
+                if (_deflate->done()) { finished = true; break; }
+                if (_sendPos == _sendLen) {
+                    _sendPos = 0;
+                    _sendLen = _fillSendBuffer();
+                    if (_sendLen == 0) _deflate->finish();
+                }
+                _sendPos += _deflate->write(_sendData + _sendPos, _sendLen - _sendPos);
+                continue;
+            }
+            if (len > budget - sent) len = budget - sent;
+            size_t added = client->add((const char*)out, len);
+            if (added == 0) break;
+            _deflate->consume(added);
+            sent += added;
+            continue;
+        }
+        if (_sendPos == _sendLen) {
+            _sendPos = 0;
+            _sendLen = _fillSendBuffer();
+            if (_sendLen == 0) { finished = true; break; }
+        }
+        size_t len = _sendLen - _sendPos;
+        if (len > budget - sent) len = budget - sent;
+        // Mapped flash outlives the transfer, so lwIP may send from it
+        // directly; anything else is copied, as _sendData is reused.
+        size_t added = client->add((const char*)_sendData + _sendPos, len,
+                                   _retrImage.data ? 0 : ASYNC_WRITE_FLAG_COPY);
+        if (added == 0) break;
+        _sendPos += added;
+        sent += added;
+    }
+    if (sent > 0) {
+        client->send();
+        _spendBudget(sent);
+        _transferBytes += sent;
+    }
+
+    if (finished) {
+        // Nothing left to send; closing the data connection lets the
+        // disconnect handler send the final reply.
+        if (_RETRFile) _RETRFile.close();
+        _server->_fileCache.close(_retrCached);
+        _retrImage = AsyncFTPImage::File();
+        _closeArchive();
+        if (_listing)  _closeListing(true);
+        _transferComplete = true;
+        client->close();
+    }
+}
+
+bool AsyncFTPClient::_pumpReadAhead() {
+    AsyncFTPReadAhead *job = _retrJob;
+    AsyncClient *client = _sendClient;
+    bool done = false;
+    if (job && client) {
+        // Running out of budget leaves the job as it is: the next ack or
+        // poll carries on.
+        size_t budget = _sendBudget(client->space());
+        size_t sent = 0;
+        while (sent < budget) {
+            size_t len;
+            const uint8_t *data = _deflate ? _deflate->output(len) : job->peek(len);
+            if (_deflate && len == 0) {
+                if (_deflate->done()) break;
+                data = job->peek(len);
+                if (data) job->consume(_deflate->write(data, len));
+                else if (job->done()) _deflate->finish();
+                else if (job->wait()) break;
+                continue;
+            }
+            if (!data) {
+                // Caught up with the I/O task: have it wake us, unless a
+                // block arrived in the meantime.
+                if (job->done() || job->wait()) break;
+                continue;
+            }
+            if (len > budget - sent) len = budget - sent;
+            size_t added = client->add((const char*)data, len);
+            if (added == 0) break;
+            if (_deflate) _deflate->consume(added);
+            else          job->consume(added);
+            sent += added;
+        }
+        if (sent > 0) {
+            client->send();
+            _spendBudget(sent);
+            _transferBytes += sent;
+        }
+        done = _deflate ? _deflate->done() : job->done();
+    }
+    return done;
+}
+
+size_t AsyncFTPClient::_sendBudget(size_t want) {
+    // Each ack or poll of a data connection is one turn: with a quantum per
+    // turn, transfers take turns on the network task and in the shared
+    // send buffers instead of one filling them while the others wait.
+    if (want > FTP_SEND_QUANTUM && _server->_activeTransfers > 1) want = FTP_SEND_QUANTUM;
+    return _rateBudget(want);
+}
+
+size_t AsyncFTPClient::_rateBudget(size_t want) {
+    size_t n = _rateTokens.available(_server->_sessionRate, want);
+    return _server->_totalTokens.available(_server->_totalRate, n);
+}
+
+void AsyncFTPClient::_spendBudget(size_t len) {
+    _rateTokens.take(len);
+    _server->_totalTokens.take(len);
+}
+
+void AsyncFTPClient::_wakeReadAhead(void *arg) {
+    ((AsyncFTPClient*)arg)->_sendPoke.fire();
+}
+
+void AsyncFTPClient::_endReadAhead() {
+    if (_retrJob) _server->_io.finishRead(_retrJob);
+    _retrJob = nullptr;
+    _sendClient = nullptr;
+    _sendPoke.unbind();
+}
+
+void AsyncFTPClient::_onPassiveDisconnect(void *arg, AsyncClient *client) {
+    FTP_LOGD("session %u: passive data connection closed", _index());
+    _closeDataTransfer();
+    _passiveDataClient = nullptr;
+    delete client;
+    _releasePassivePort();
+    _resumeCommands();
+}
+
+void AsyncFTPClient::_closeDataTransfer() {
+    if (_STORFile || _untar) {
+        // Write out the partial block left at the end of the upload.
+        if (!_flushStorBuffer(nullptr) && !_transferFailed) {
+            _transferFailed = true;
+            _controlClient->write("452 Write failed; transfer aborted\r\n");
+        }
+        else if (_inflate && !_inflate->done() && !_transferFailed) {
+            // The connection closed before the end of the zlib stream.
+            _transferFailed = true;
+            _controlClient->write("451 Compressed data incomplete; transfer aborted\r\n");
+        }
+        else if (_untar && !_untar->finished() && !_transferFailed) {
+            _transferFailed = true;
+            _controlClient->write("451 Archive incomplete; transfer aborted\r\n");
+        }
+        _STORFile.close();
+    }
+    if (_storAtomic) {
+        // Closing synced the temporary file. Only a complete upload
+        // replaces the target; after an error it stays as it was.
+        _storAtomic = false;
+        char temp[FTPPATHMAX], backup[FTPPATHMAX];
+        tempUploadPath(temp, _dataPath, _index());
+        if (_transferFailed) {
+            _FTPDeleteFile(_filesystem, temp);
+        }
+        else if (!tempUploadPath(backup, _dataPath, _index(), "old") ||
+                 !_FTPReplaceFile(_filesystem, temp, _dataPath, backup)) {
+            _transferFailed = true;
+            // Should the target be gone, the upload is all that is left of
+            // it, so it is kept under its temporary name.
+            if (_filesystem->exists(_dataPath)) {
+                _FTPDeleteFile(_filesystem, temp);
+                _controlClient->write("451 Could not replace the file; upload discarded\r\n");
+            }
+            else {
+                FTP_LOGE("session %u: could not store %s; upload kept as %s", _index(), _dataPath, temp);
+                _replyf("451 Could not replace the file; upload kept as %s\r\n", temp);
+            }
+        }
+    }
+    if (_storBuffer) {
+        _server->_dirCache.invalidateParent(_dataPath);
+        // An archive may have written anywhere below its directory.
+        if (_untar) _server->invalidateCache(_dataPath);
+        _server->_fileCache.invalidate(_dataPath);
+        _server->_hashCache.invalidate(_dataPath);
+    }
+    delete _untar;
+    _untar = nullptr;
+    free(_storBuffer);
+    _storBuffer = nullptr;
+    _storLen = 0;
+
+    bool ok = false;
+    if (_transferFailed) {
+        // The error reply has already been sent.
+        _transferFailed = false;
+        if (_RETRFile) _RETRFile.close();
+        _server->_fileCache.close(_retrCached);
+        _retrImage = AsyncFTPImage::File();
+        _closeArchive();
+        if (_retrJob)  _endReadAhead();
+        if (_listing)  _closeListing(false);
+    }
+    else if (_RETRFile || _retrJob || _retrCached.slot >= 0 || _retrImage.data || _tar || _listing) {
+        // The peer went away before everything was sent.
+        if (_RETRFile) _RETRFile.close();
+        _server->_fileCache.close(_retrCached);
+        _retrImage = AsyncFTPImage::File();
+        _closeArchive();
+        if (_retrJob)  _endReadAhead();
+        if (_listing)  _closeListing(false);
+        _controlClient->write("426 Connection closed; transfer aborted\r\n");
+    }
+    else if (_transferComplete) {
+        _transferComplete = false;
+        ok = true;
+        if (_listNext) _replyf("226 Listing paused; SITE LISTFROM %u continues it\r\n", (unsigned)_listNext);
+        else           _controlClient->write("226 Transfer complete\r\n");
+        _listNext = 0;
+    }
+    else {
+        ok = true;
+        _controlClient->write("226 Closing data connection\r\n");
+    }
+    // Only now: a read-ahead job may use the compressor until it has ended.
+    _endModeZ();
+    _recordTransfer(ok);
+}
+
+void AsyncFTPClient::_recordTransfer(bool ok) {
+    if (!_transferVerb) return;     // no data command ran on this connection
+    uint32_t verb = _transferVerb;
+    uint32_t duration = millis() - _transferStart;
+    _transferVerb = 0;
+    _server->_activeTransfers--;
+    _server->_heap.release(_transferHeap, _transferPending);
+    _transferHeap = 0;
+    _transferPending = 0;
+
+    AsyncFTPStats &stats = _server->_stats;
+    if (isUpload(verb)) { _bytesIn += _transferBytes;  stats.bytesIn += _transferBytes; }
+    else        { _bytesOut += _transferBytes; stats.bytesOut += _transferBytes; }
+    _transferCount++;
+    if (ok) {
+        stats.transfers++;
+        stats.transferTime.add(duration);
+        // Bytes per ms is (almost) KB/s; count sub-millisecond transfers as 1 ms.
+        stats.throughput.add((uint32_t)((uint64_t)_transferBytes * 1000 / 1024 / (duration ? duration : 1)));
+    }
+    else
+        stats.failedTransfers++;
+
+    if (_server->_onTransfer) {
+        char command[5];
+        unpackVerb(verb, command);
+        AsyncFTPTransfer transfer;
+        transfer.command = command;
+        transfer.path = _dataPath;
+        transfer.session = _index();
+        transfer.ok = ok;
+        transfer.bytes = _transferBytes;
+        transfer.duration = duration;
+        _server->_onTransfer(transfer);
+    }
+    _transferBytes = 0;
+}
+
+void AsyncFTPClient::_closeListing(bool complete) {
+    // A listing that stopped at the end of a page has not read the whole
+    // directory, so it cannot be cached.
+    bool paused = _listFilter.done();
+    _listNext = complete && paused ? _listFilter.skip + _listFilter.limit : 0;
+    _listing = false;
+    _listImage = false;
+    _listDir.close();
+    _server->_dirCache.endFill(_listFill, complete && !paused);
+    _listFill = -1;
+    _server->_dirCache.closeListing(_listCached);
+}
+
+// --------------------------------------------------------------------
+// *** Active Mode Functions ***
+// In active mode the client sends a PORT command.
+// When a data command (LIST, RETR, STOR) is received and _activeMode is true,
+// the server immediately creates an AsyncClient and connects to the client's IP/port.
+// --------------------------------------------------------------------
+
+void AsyncFTPClient::_createActiveDataConnection() {
+    _activeDataClient = new (std::nothrow) AsyncClient();
+    if (!_activeDataClient) {
+        _replyLowMemory(_dataCommand);
+        _dataCommand = 0;
+        return;
+    }
+    _activeDataClient->onConnect([this](void *arg, AsyncClient *client) {
+        _onActiveConnect(arg, client);
+    }, this);
+    _activeDataClient->onData([this](void *arg, AsyncClient *client, void *data, size_t len) {
+        _onPassiveData(arg, client, data, len); // reuse the same callback for data.
+    }, this);
+    _activeDataClient->onDisconnect([this](void *arg, AsyncClient *client) {
+          FTP_LOGD("session %u: active data connection closed", _index());
+      
+          // Close any open file and send the final reply; a connection that
+          // never came up has no transfer to close.
+          if (_dataCommand) {
+              _dataCommand = 0;
+              _controlClient->write("425 Can't open data connection\r\n");
+          }
+          else
+              _closeDataTransfer();
       
           delete _activeDataClient;
           _activeDataClient = nullptr;
           _activeMode = false;
+          _resumeCommands();
     }, this);
     // Initiate connection to the client's provided IP and port.
     if (!_activeDataClient->connect(_activeDataIP, _activeDataPort)) {
+        _dataCommand = 0;
         _controlClient->write("425 Can't open data connection\r\n");
         delete _activeDataClient;
         _activeDataClient = nullptr;
@@ -504,9 +2559,6 @@ void AsyncFTPClient::_createActiveDataConnection() {
 }
 
 void AsyncFTPClient::_onActiveConnect(void *arg, AsyncClient *client) {
-    Serial.println("Active data connection established");
-    if      (_dataCommand == "LIST") _processListCommand(client);
-    else if (_dataCommand == "RETR") _processRetrCommand(client);
-    else if (_dataCommand == "STOR") _processStorCommand(client);
-    _dataCommand = "";
+    FTP_LOGD("session %u: active data connection opened", _index());
+    _startDataCommand(client);
 }
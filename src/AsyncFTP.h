@@ -1,21 +1,54 @@
 #ifndef ASYNCFTP_H
 #define ASYNCFTP_H
 
-#include <Arduino.h>
-#include <FS.h>
-#include <LittleFS.h>
-#include <SD.h>
-#include <AsyncTCP.h>
+#include "AsyncFTPPort.h"
+#include "AsyncFTPBackend.h"
+#include "AsyncFTPDirCache.h"
+#include "AsyncFTPFileCache.h"
+#include "AsyncFTPGlob.h"
+#include "AsyncFTPHash.h"
+#include "AsyncFTPHeap.h"
+#include "AsyncFTPImage.h"
+#include "AsyncFTPIO.h"
+#include "AsyncFTPLog.h"
+#include "AsyncFTPRate.h"
+#include "AsyncFTPStats.h"
+#include "AsyncFTPTar.h"
+#include "AsyncFTPZlib.h"
 
-#define FILEBUFFERSIZE 512    // Buffer size for file transfers
+#ifndef FILEBUFFERSIZE
+#define FILEBUFFERSIZE 2048   // Buffer size for file transfers
+#endif
 #define DEFAULT_FTP_PORT 21   // Default FTP control port
+#ifndef FTP_MAX_SESSIONS
+#define FTP_MAX_SESSIONS 2    // Default number of simultaneous control connections
+#endif
+#ifndef FTP_PASV_PORT_MIN
+#define FTP_PASV_PORT_MIN 50000 // First port of the default passive port range
+#endif
 
-// Filesystem selection for FTP file operations.
-enum class FTP_FS {
-    NONE,
-    LITTLEFS,
-    SD_CARD
-};
+#define LISTLINEMAX 340       // Longest LIST or MLSD line (255-character name plus attributes)
+#define FTPPATHMAX 256        // Longest absolute path a session works with
+
+// Control input that arrives while a data transfer is pending is queued
+// and left unacked until the transfer ends, so the receive window bounds
+// it: the queue holds a whole window. Allocated when first needed.
+#ifndef FTP_PIPELINE_BUFFER
+#if defined(CONFIG_LWIP_TCP_WND_DEFAULT)
+#define FTP_PIPELINE_BUFFER CONFIG_LWIP_TCP_WND_DEFAULT
+#else
+#define FTP_PIPELINE_BUFFER 5744
+#endif
+#endif
+
+// Upper bound on upload bytes held back from the receive window while they
+// wait in the STOR buffer. The peer must still be able to send at least one
+// more segment, or the upload stalls before the buffer fills.
+#if defined(CONFIG_LWIP_TCP_WND_DEFAULT) && defined(CONFIG_LWIP_TCP_MSS)
+#define STOR_MAX_UNACKED (CONFIG_LWIP_TCP_WND_DEFAULT - CONFIG_LWIP_TCP_MSS)
+#else
+#define STOR_MAX_UNACKED 4096
+#endif
 
 // Global credentials (these can be overridden via begin())
 extern String ASYNCFTP_Username;
@@ -23,48 +56,356 @@ extern String ASYNCFTP_Password;
 
 class AsyncFTPClient; // Forward declaration
 
+// How a listing is formatted: "ls -l" lines for LIST, RFC 3659 facts for
+// MLSD and MLST, or bare names for NLST.
+struct FTPListFormat {
+    enum : uint8_t { TYPE = 1, SIZE = 2, MODIFY = 4, UNIQUE = 8, ALL_FACTS = 15 };
+    enum Style : uint8_t { LONG, FACTS, NAMES };
+    Style    style = LONG;
+    uint8_t  facts = ALL_FACTS;     // the facts listed, as chosen by OPTS MLST
+    // unique-id of the entries: FNV-1a of their absolute path, continued
+    // from this hash of the directory's path with its trailing '/'.
+    uint32_t pathHash = 0;
+};
+
+// Which entries a listing sends: those whose names match glob, from the
+// match after the first skip on, and at most limit of them (0: no limit).
+// Counted as the listing goes; it is done once a match beyond the page
+// has been seen, which tells a paused listing from a finished one.
+struct FTPListFilter {
+    AsyncFTPGlob glob;
+    uint32_t skip = 0;
+    uint32_t limit = 0;
+    uint32_t matched = 0;
+
+    // True if entry is to be listed.
+    bool admit(const FTPDirEntry& entry) {
+        if (done() || !glob.matches(entry.name, entry.nameLength)) return false;
+        matched++;
+        return matched > skip && !done();
+    }
+    bool done() const { return limit && matched > skip + limit; }
+};
+
 class AsyncFTP {
 public:
     AsyncFTP(uint16_t port = DEFAULT_FTP_PORT, FTP_FS ftpfs = FTP_FS::NONE);
+    // Stops listening and ends every open session.
+    ~AsyncFTP();
 
     // Updated begin method with optional username and password parameters.
     // If nonempty values are provided, they will be used to set the FTP credentials.
-    void begin(const String &username = "", const String &password = "");
+    // maxSessions control connections are served at once; their state is
+    // allocated here, once, and reused for every new connection.
+    void begin(const String &username = "", const String &password = "",
+               uint8_t maxSessions = FTP_MAX_SESSIONS);
 
     void setUsername(String username);
     void setPassword(String password);
+    // Passive data ports: count ports starting at first, all bound in begin()
+    // and lent to one session at a time. Call before begin(). By default
+    // there is one port per session from FTP_PASV_PORT_MIN. Every port is a
+    // listening socket, and lwIP allows only CONFIG_LWIP_MAX_LISTENING_TCP
+    // (16 by default) of those.
+    void setPassivePortRange(uint16_t first, uint16_t count);
+    // Size of the STOR write-behind buffer, instead of the backend's
+    // writeSize (AsyncFTPBackend.h). Uploads are written in whole buffers,
+    // so use a multiple of the filesystem's block size. Rounded down to a
+    // multiple of the backend's writeAlign.
+    void setStorBufferSize(size_t size);
+    // RAM for cached directory listings (0 disables the cache) and how long
+    // a listing is trusted, in milliseconds. Call before begin().
+    void setDirectoryCache(size_t bytes, uint32_t ttl = FTP_DIRCACHE_TTL);
+    // RAM for cached small files (0 disables the cache; PSRAM is used if
+    // present), the largest file cached, and how long a copy is trusted in
+    // milliseconds. Call before begin().
+    void setFileCache(size_t bytes, size_t maxFileSize = FTP_FILECACHE_MAXFILE,
+                      uint32_t ttl = FTP_FILECACHE_TTL);
+    // Drop cached listings, files and digests for path and everything below
+    // it, e.g. after the sketch has written files itself. The default clears
+    // every cache.
+    void invalidateCache(const char* path = "/");
+    // Limit each session's transfers to perSession bytes per second, and
+    // all of them together to total, which the transfers running share by
+    // taking turns. 0 means no limit. Takes effect at once, also for
+    // running transfers.
+    void setRateLimit(uint32_t perSession, uint32_t total = 0);
+    // Heap that open sessions and transfers may hold on top of what begin()
+    // allocates (0: no limit), and the free heap they must leave. A
+    // connection or transfer that does not fit is refused with 421, 425 or
+    // 452 instead of running the device out of memory. May be called at
+    // any time.
+    void setHeapBudget(size_t budget, size_t minFreeHeap = FTP_HEAP_MIN_FREE);
+    // With FTP_FS::IMAGE: map the read-only image (AsyncFTPImage.h) in the
+    // data partition labelled name, or on the host the image file name.
+    // False if there is none or it is invalid. Call before begin().
+    bool mountImage(const char* name);
+
+    // Copy the server-wide counters and histograms into stats.
+    void getStats(AsyncFTPStats& stats);
+    // Counters of session index (0 to maxSessions - 1); false if that slot
+    // has no open session.
+    bool getSessionStats(uint8_t index, AsyncFTPSessionStats& stats);
+    void resetStats();
+    // Called on the network task after every data transfer, successful or not.
+    void onTransfer(AsyncFTPTransferHandler handler);
     
 private:
     void _onClient(void* arg, AsyncClient* client);
+
+    // A pre-bound passive listener, leased to at most one session at a time.
+    struct PassivePort {
+        AsyncServer*    server = nullptr;
+        uint16_t        port = 0;
+        AsyncFTPClient* session = nullptr;  // leaseholder, or null when free
+    };
+    // Hand a connection on a passive port to the session holding its lease.
+    void _onPassiveClient(PassivePort* port, AsyncClient* client);
+    PassivePort* _leasePassivePort(AsyncFTPClient* session);
     uint16_t _port;
     FTP_FS _FTPFS;
+    // The backend's traits and filesystem, resolved once for the transfer
+    // paths; the sessions copy _filesystem.
+    const FTPBackendTraits _backend;
+    FS* const _filesystem;
     AsyncServer* _asyncServer = nullptr;
-    // Allow up to 2 simultaneous control connections.
-    AsyncFTPClient* _controlClients[2] = { nullptr, nullptr };
+    // Session pool; a slot is free while its control client is null.
+    AsyncFTPClient* _sessions = nullptr;
+    uint8_t _maxSessions = 0;
+    PassivePort* _passivePorts = nullptr;
+    uint16_t _passivePortFirst = FTP_PASV_PORT_MIN;
+    uint16_t _passivePortCount = 0;     // 0: one port per session
+    size_t _storBufferSize = 0;         // 0: the backend's writeSize
+    AsyncFTPDirCache _dirCache;
+    size_t   _dirCacheSize = FTP_DIRCACHE_SIZE;
+    uint32_t _dirCacheTTL = FTP_DIRCACHE_TTL;
+    AsyncFTPFileCache _fileCache;
+    size_t   _fileCacheSize = FTP_FILECACHE_SIZE;
+    size_t   _fileCacheMaxFile = FTP_FILECACHE_MAXFILE;
+    uint32_t _fileCacheTTL = FTP_FILECACHE_TTL;
+    AsyncFTPHashCache _hashCache;
+    // Admission control for sessions and transfers.
+    AsyncFTPHeapBudget _heap;
+    AsyncFTPImage _image;
+    // Rate limits in bytes per second; 0 for none. Every transfer draws
+    // from _totalTokens too, so together they cannot exceed the total
+    // however many start and stop.
+    uint32_t _sessionRate = 0;
+    uint32_t _totalRate = 0;
+    AsyncFTPTokenBucket _totalTokens;
+    // Data transfers running in all sessions.
+    uint8_t  _activeTransfers = 0;
+    // RETR read-ahead task; stopped only after ~AsyncFTP has deleted the
+    // sessions, which hand their jobs back.
+    AsyncFTPIO _io;
+    // Totals of finished transfers; getStats() adds those in progress.
+    AsyncFTPStats _stats;
+    uint32_t _startedAt = 0;
+    AsyncFTPTransferHandler _onTransfer;
     
     friend class AsyncFTPClient;
 };
 
 class AsyncFTPClient {
 public:
-    AsyncFTPClient(AsyncClient* client, FTP_FS ftpfs);
+    AsyncFTPClient();
     ~AsyncFTPClient();
     
 private:
+    // Take over a new control connection with a clean session state.
+    void _open(AsyncFTP* server, AsyncClient* client);
+    // End the session: abort any transfer, free its data connections and
+    // buffers, and return the slot to the pool.
+    void _release();
+    // Close a data connection whose transfer is being dropped.
+    void _discardDataClient(AsyncClient*& client);
+    // Position in the server's session pool.
+    uint8_t _index() const;
+
     // Called when data arrives on the control connection.
     void _onData(void* arg, AsyncClient* client, void* data, size_t len);
-    // Process a complete FTP command.
-    void _process();
+    // Assemble and run command lines until a data command is pending;
+    // returns the number of bytes used.
+    size_t _readCommands(const char* src, size_t len);
+    // Run the commands queued behind a data transfer that has just ended.
+    void _resumeCommands();
+    // A data command is waiting for its connection or transferring, or a
+    // file is being hashed; later commands wait.
+    bool _busy() const { return _dataCommand || _transferVerb || _hashJob || _reply; }
+    // Process a complete FTP command line (modified in place).
+    void _process(char* line);
+    // Send a formatted reply on the control connection.
+    void _replyf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    // Send what fits of _reply; the rest goes out as the control connection
+    // acks. Once it is all out, run the commands queued behind it.
+    void _sendReply();
+    // Resolve a command parameter against the CWD into path (FTPPATHMAX bytes);
+    // replies 553 and returns false if it does not fit.
+    bool _resolve(const char* parameter, char* path);
+
+    // Command handlers, looked up in _commands by packed verb. Commands
+    // that need a backend capability are refused where it lacks it.
+    enum : uint8_t { NEEDS_WRITE = 1, NEEDS_APPEND = 2, NEEDS_SEEK = 4 };
+    struct Command {
+        uint32_t verb;
+        void (AsyncFTPClient::*handler)(char* parameter);
+        uint8_t  needs;
+    };
+    static const Command _commands[];
+    static const uint8_t _knownCommands;    // entries in _commands
+    void _cmdUSER(char* parameter);
+    void _cmdPASS(char* parameter);
+    void _cmdSYST(char* parameter);
+    void _cmdNOOP(char* parameter);
+    void _cmdCDUP(char* parameter);
+    void _cmdCWD(char* parameter);
+    void _cmdPWD(char* parameter);
+    void _cmdTYPE(char* parameter);
+    void _cmdPASV(char* parameter);
+    void _cmdEPSV(char* parameter);
+    void _cmdPORT(char* parameter);
+    void _cmdLIST(char* parameter);
+    void _cmdRETR(char* parameter);
+    void _cmdSTOR(char* parameter);
+    void _cmdAPPE(char* parameter);
+    void _cmdREST(char* parameter);
+    void _cmdSIZE(char* parameter);
+    void _cmdFEAT(char* parameter);
+    void _cmdMKD(char* parameter);
+    void _cmdRMD(char* parameter);
+    void _cmdDELE(char* parameter);
+    void _cmdRNFR(char* parameter);
+    void _cmdRNTO(char* parameter);
+    void _cmdQUIT(char* parameter);
+    void _cmdSITE(char* parameter);
+    void _cmdMODE(char* parameter);
+    void _cmdOPTS(char* parameter);
+    void _cmdHASH(char* parameter);
+    void _cmdRANG(char* parameter);
+    void _cmdXCRC(char* parameter);
+    void _cmdXMD5(char* parameter);
+    void _cmdXSHA(char* parameter);
+    void _cmdMLSD(char* parameter);
+    void _cmdMLST(char* parameter);
+    void _cmdMDTM(char* parameter);
+    void _cmdNLST(char* parameter);
+    void _cmdALLO(char* parameter);
+    // False, after replying 552, if the filesystem reports less free space
+    // than bytes; true if it has room or cannot tell.
+    bool _checkSpace(uint32_t bytes);
+
+    // Set up _dataPath and _listFilter for a listing. LIST and NLST take
+    // ls options (ignored), a directory, a file, or wildcards in the last
+    // segment (patterns); MLSD only a directory. Replies and returns false
+    // on a bad argument.
+    bool _listArgument(char* parameter, bool patterns);
+
+    // Look up path (absolute) in the image, the directory cache or the
+    // filesystem, in that order; false if there is no such file or directory.
+    // entry.name is the last segment of path.
+    bool _stat(const char* path, FTPDirEntry& entry);
+
+    // Start the pending data command now, or once the data connection exists.
+    void _requestDataConnection();
+    // Heap a transfer of command will take at most, data connection included.
+    size_t _transferCost(uint32_t command) const;
+    // Refuse a transfer for lack of heap: 452 for uploads, 425 otherwise.
+    void _replyLowMemory(uint32_t command);
+    // bytes of the running transfer's reservation are now allocated.
+    void _transferAllocated(size_t bytes);
+    // Allocate the compressor (or, for an upload, the decompressor) of a
+    // MODE Z transfer; false if there is no memory for it.
+    bool _beginModeZ(bool upload);
+    void _endModeZ();
+
+    // Checksums. Hash bytes [start, end) of the file named by parameter and
+    // reply in the format of verb, from the digest cache if it has them.
+    // Large files are read and hashed by the I/O task; the command then
+    // stays busy until _checkHash() sees the hash done.
+    void _beginHash(uint32_t verb, AsyncFTPHash::Algorithm algorithm, char* parameter,
+                    uint32_t start, uint32_t end);
+    // XCRC/XMD5/XSHA256 take an optional range after a quoted path.
+    void _beginXHash(uint32_t verb, AsyncFTPHash::Algorithm algorithm, char* parameter);
+    // Feed ready blocks into the hash; runs on the I/O task from its wake
+    // call, so it never touches the connection. Once the job is done it
+    // pokes the control connection, whose poll handler replies.
+    void _pumpHash();
+    static void _wakeHash(void* arg);
+    // Finish the digest, cache it and reply; complete is false if the file
+    // came up short, which replies an error instead.
+    void _finishHash(bool complete);
+    void _replyHash(const char* hex);
+    // Network side: once the I/O task has hashed the whole range, reply,
+    // end the hash and run the commands queued behind it.
+    void _checkHash();
+    // Give the hash job back and free the hash.
+    void _endHash();
 
     // Passive mode functions.
-    void _createPassiveServer(uint16_t port);
+    // Lease a passive port (or keep the one already held) for the next data
+    // connection, dropping any unused one. Replies 425 and returns 0 if none is free.
+    uint16_t _openPassivePort();
+    // Give the passive port back to the pool.
+    void _releasePassivePort();
     void _onPassiveClient(void* arg, AsyncClient* client);
+    // Run the pending data command (LIST, MLSD, RETR, STOR) on an open data connection.
+    void _startDataCommand(AsyncClient* client);
     void _onPassiveData(void* arg, AsyncClient* client, void* data, size_t len);
     void _processListCommand(AsyncClient* client);
-    void _processStorCommand(AsyncClient* client);
+    void _processStorCommand(AsyncClient* client, bool append);
     void _processRetrCommand(AsyncClient* client);
+    // Start streaming the open RETR file or LIST directory on a data connection.
+    void _beginSend(AsyncClient* client);
+    // RETR of "<dir>.tar" with no such file: open the directory as an
+    // archive in _tar; false if it is not one.
+    bool _openArchive();
+    void _closeArchive();
+    // Produce the next buffer of outgoing data in _sendData; returns 0 at the end.
+    size_t _fillSendBuffer();
+    // Fill the data connection's send window with RETR/LIST data (called on ack/poll).
     void _sendFileChunk(AsyncClient* client);
+    // Hand ready read-ahead blocks to the data connection; returns true once
+    // the whole file has been queued.
+    bool _pumpReadAhead();
+    // I/O task: data is ready; poke the data connection so that its poll
+    // handler sends it.
+    static void _wakeReadAhead(void* arg);
+    // Give the read-ahead job back to the I/O task.
+    void _endReadAhead();
+    // Write the buffered STOR data to the file and reopen the receive window.
+    bool _flushStorBuffer(AsyncClient* client);
+    // Add upload data to the STOR buffer, writing it out as blocks fill up;
+    // false if a write failed, after replying.
+    bool _writeStorData(AsyncClient* client, const uint8_t* data, size_t len);
+    // Close the STOR file after a failed write and report it.
+    void _failStorWrite();
+    // Decompress a MODE Z upload segment into the STOR buffer; false if the
+    // stream is invalid or a write failed, after replying.
+    bool _inflateStorData(AsyncClient* client, const uint8_t* data, size_t len);
+    // SITE UNTAR: unpack an uploaded tar stream into the directory _dataPath.
+    bool _beginUnpack();
+    // Feed archive bytes to _untar, creating its files and directories;
+    // false if the archive is invalid or a file could not be written, after replying.
+    bool _unpackStorData(AsyncClient* client, const uint8_t* data, size_t len);
+    bool _unpackEntry(AsyncClient* client);
+    // Bytes the running transfer may send now, at most want: no more than
+    // FTP_SEND_QUANTUM while other transfers run, and what its rate limit
+    // allows. Call _spendBudget() with what was sent.
+    size_t _sendBudget(size_t want);
+    // Bytes the session's and the server's rate limits allow now, at most want.
+    size_t _rateBudget(size_t want);
+    // Charge len bytes sent or acked to both limits.
+    void _spendBudget(size_t len);
+    // Reopen the receive window by len more upload bytes, as far as the
+    // rate limit allows; the rest is acked from the data client's poll.
+    void _ackStorData(AsyncClient* client, size_t len);
     void _onPassiveDisconnect(void* arg, AsyncClient* client);
+    // Close any open transfer file and send the final reply for the data connection.
+    void _closeDataTransfer();
+    // Stop producing LIST output; complete: every entry was sent.
+    void _closeListing(bool complete);
+    // Account for the data transfer that just ended.
+    void _recordTransfer(bool ok);
     
     // *** Active mode support functions ***
     // Initiate an active data connection (the server connects to the client).
@@ -73,20 +414,152 @@ private:
     void _onActiveConnect(void* arg, AsyncClient* client);
     
     // Private members:
-    AsyncClient* _controlClient;
-    FTP_FS _FTPFS;
-    String _CWD = "/";
-    String _line = "";
-    String _command = "";
-    String _parameter = "";
-    String _dataCommand = "";
-    String _dataParameter = "";
-    String _RNFRParameter = "";
+    AsyncFTP*    _server = nullptr;
+    AsyncClient* _controlClient = nullptr;
+    FTP_FS _FTPFS = FTP_FS::NONE;
+    FS*    _filesystem = nullptr;
+    char   _cwd[FTPPATHMAX] = "/";
+    char   _renameFrom[FTPPATHMAX] = "";    // resolved RNFR path, for RNTO
+    uint32_t _dataCommand = 0;              // packed verb of the pending data command
+    char   _dataPath[FTPPATHMAX] = "";      // resolved path for RETR/STOR
+    uint32_t _restOffset = 0;               // REST offset, for the next command only
+    uint32_t _rangeStart = 0;               // RANG range, [start, end), for the next command only
+    uint32_t _rangeEnd = UINT32_MAX;
+    uint32_t _dataOffset = 0;               // starting offset of the pending RETR/STOR
+    uint32_t _allocSize = 0;                // ALLO: size of the next upload, 0 if not given
+
+    // Maximum allowed command length to prevent runaway buffering.
+    static const size_t MAX_COMMAND_LENGTH = 256;
+
+    // Control connection line buffer; commands are parsed in place.
+    char   _lineBuffer[MAX_COMMAND_LENGTH + 1];
+    size_t _lineLength = 0;
+    bool   _lineTooLong = false;
+    // Close the control connection once the current input has been handled.
+    bool   _closeRequested = false;
+    // Pipelined input held back while a data transfer is pending, and the
+    // bytes already run but still unacked (from the segment that started it).
+    char*  _queue = nullptr;
+    size_t _queueLen = 0;
+    size_t _queueUnacked = 0;
+    // A multi-line reply too long for the send buffer (SITE STATS) and how
+    // much of it has been sent.
+    char*  _reply = nullptr;
+    size_t _replyLen = 0;
+    size_t _replyPos = 0;
+    bool   _readingCommands = false;
     
     // For passive mode:
-    AsyncServer* _passiveServer = nullptr;
+    AsyncFTP::PassivePort* _passivePort = nullptr;
+    bool         _epsvAll = false;          // EPSV ALL: only EPSV may set up data connections
+    AsyncClient* _passiveDataClient = nullptr;
     fs::File _STORFile;
+    // A STOR from the start is written to a temporary file next to the
+    // target (tempUploadPath()) and renamed over it once complete.
+    bool     _storAtomic = false;
     fs::File _RETRFile;
+    // Large RETR files are read by the I/O task instead of through _RETRFile;
+    // the network task hands its blocks to _sendClient, whose poll handler
+    // the I/O task raises through _sendPoke when it catches up.
+    AsyncFTPReadAhead* _retrJob = nullptr;
+    AsyncClient*       _sendClient = nullptr;
+    AsyncFTPPoke       _sendPoke;
+    // Small RETR files are sent straight from the file cache instead.
+    AsyncFTPFileCache::Handle _retrCached;
+    // RETR of a directory as a tar archive.
+    AsyncFTPTarWriter* _tar = nullptr;
+    // RETR from an FTP_FS::IMAGE mount: sent straight from the mapping.
+    AsyncFTPImage::File _retrImage;
+    uint32_t _retrImagePos = 0;
+    fs::File _listDir;
+    // LIST is replayed from the directory cache when it holds the directory,
+    // otherwise read from _listDir and recorded into _listFill.
+    bool     _listing = false;
+    AsyncFTPDirCache::Listing _listCached;
+    int8_t   _listFill = -1;
+    // An image is listed straight from its index instead.
+    bool     _listImage = false;
+    uint32_t _listCursor = 0;
+    // LIST lines, MLSD facts or NLST names; _dataPath is the directory
+    // listed, _listFilter picks the entries sent.
+    FTPListFormat _listFormat;
+    FTPListFilter _listFilter;
+    uint8_t  _mlstFacts = FTPListFormat::ALL_FACTS;     // OPTS MLST
+    uint32_t _listLimit = 0;                // SITE LISTLIMIT: entries per listing, 0 for all
+    uint32_t _listFrom = 0;                 // SITE LISTFROM: matches the next listing skips
+    uint32_t _listNext = 0;                 // a listing paused here; told in its 226 reply
+
+    // Outgoing data: bytes [_sendPos, _sendLen) of _sendData have been read
+    // from the file (or formatted from the directory) but not yet accepted
+    // by the TCP stack. _sendData is _sendBuffer, or a cached file's bytes.
+    uint8_t _sendBuffer[FILEBUFFERSIZE];
+    const uint8_t* _sendData = _sendBuffer;
+    size_t  _sendLen = 0;
+    size_t  _sendPos = 0;
+    bool    _transferComplete = false;
+
+    // STOR write-behind buffer: incoming segments are collected here and
+    // written in whole blocks of _storBlockSize bytes.
+    uint8_t* _storBuffer = nullptr;
+    size_t   _storBlockSize = 0;
+    size_t   _storLen = 0;
+
+    // SITE UNTAR: the next STOR names a directory and carries a tar archive,
+    // unpacked through _untar into files written via the STOR buffer.
+    bool     _untarNext = false;
+    AsyncFTPTarReader* _untar = nullptr;
+
+    // MODE Z: data connections carry a zlib stream. The (de)compressor
+    // exists only while a transfer runs.
+    bool     _modeZ = false;
+    uint8_t  _modeZLevel = FTP_MODEZ_LEVEL;
+    AsyncFTPDeflate* _deflate = nullptr;
+    AsyncFTPInflate* _inflate = nullptr;
+    // Compressed upload bytes received but not yet acked; acked when the
+    // STOR buffer is written, like plain uploads.
+    size_t   _storUnacked = 0;
+
+    // Rate limit of the session's transfers, in either direction. It is
+    // not refilled per transfer, so starting many small ones gains nothing.
+    // Upload bytes that were written but not yet acked because of a limit
+    // are in _ackPending.
+    AsyncFTPTokenBucket _rateTokens;
+    size_t   _ackPending = 0;
+
+    // Checksum in progress. _hash and _hashJob belong to the network task
+    // until the job starts, then are used under _hashLock; once the I/O
+    // task sets _hashDone they are the network task's again.
+    AsyncFTPHash::Algorithm _hashAlgorithm = AsyncFTPHash::SHA256;   // OPTS HASH
+    AsyncFTPHash*      _hash = nullptr;
+    AsyncFTPReadAhead* _hashJob = nullptr;
+    uint32_t _hashVerb = 0;
+    AsyncFTPHash::Algorithm _hashRunning = AsyncFTPHash::SHA256;
+    uint32_t _hashStart = 0;
+    uint32_t _hashEnd = 0;
+    uint32_t _hashSize = 0;
+    uint32_t _hashLastWrite = 0;
+    uint32_t _hashRemaining = 0;
+    std::atomic<bool> _hashDone{false};
+    SemaphoreHandle_t _hashLock = nullptr;
+    AsyncFTPPoke      _controlPoke;
+
+    // Set when a transfer error has already been reported on the control
+    // connection, so closing the data connection sends no further reply.
+    bool     _transferFailed = false;
+
+    // Statistics.
+    uint32_t _connectedAt = 0;
+    uint64_t _bytesIn = 0;
+    uint64_t _bytesOut = 0;
+    uint32_t _commandCount = 0;
+    uint32_t _transferCount = 0;
+    uint32_t _transferVerb = 0;             // packed verb of the running transfer, or 0
+    uint32_t _transferStart = 0;            // millis()
+    uint32_t _transferBytes = 0;
+    size_t   _transferHeap = 0;             // reserved for the running transfer
+    size_t   _transferPending = 0;          // of which not yet allocated
+    uint32_t _passiveSince = 0;             // micros() of the PASV/EPSV reply
+    bool     _passiveWaiting = false;       // _passiveSince is set and not yet recorded
     
     // *** Active mode member variables ***
     // When a PORT command is received these are set.
@@ -95,20 +568,38 @@ private:
     uint16_t     _activeDataPort   = 0;
     AsyncClient* _activeDataClient = nullptr;
     
-    // Maximum allowed command length to prevent runaway buffering.
-    static const size_t MAX_COMMAND_LENGTH = 256;
-    
     friend class AsyncFTP;
 };
 
 // --- FTP File/Directory helper function declarations ---
-// These functions implement simple file/directory operations on the underlying filesystem.
-String _FTPDirectoryList(String path, FTP_FS ftpfs = FTP_FS::NONE);
-bool _FTPCreateDirectory(FTP_FS ftpfs, String path);
-bool _FTPDeleteDirectory(FTP_FS ftpfs, String path);
-bool _FTPDeleteFile(FTP_FS ftpfs, String path);
-fs::File _FTPCreateFile(FTP_FS ftpfs, String path);
-fs::File _FTPOpenFile(FTP_FS ftpfs, String path);
-bool _FTPMoveFile(FTP_FS ftpfs, String from, String to);
+// These functions implement simple file/directory operations on the underlying
+// filesystem, as resolved once by the server; they fail when it is null.
+fs::File _FTPOpenDirectory(FS *filesystem, const char *path);
+// Format one entry as a LIST line or MLSD facts; returns its length (at
+// most LISTLINEMAX).
+size_t _FTPListLine(const FTPDirEntry &entry, const FTPListFormat &format, char *buffer, size_t size);
+// Format the entries of an open directory that filter admits into buffer,
+// until the next entry might not fit or filter is done. Every entry read
+// is recorded in the cache fill if one is given, listed or not. Each
+// entry is read from the filesystem once; its type, size and time serve
+// every format. Returns the number of bytes written, 0 once exhausted.
+size_t _FTPDirectoryList(fs::File &dir, const FTPListFormat &format, FTPListFilter &filter,
+                         char *buffer, size_t size,
+                         AsyncFTPDirCache *cache = nullptr, int8_t fill = -1);
+bool _FTPCreateDirectory(FS *filesystem, const char *path);
+bool _FTPDeleteDirectory(FS *filesystem, const char *path);
+bool _FTPDeleteFile(FS *filesystem, const char *path);
+fs::File _FTPCreateFile(FS *filesystem, const char *path);
+// Open a file for writing at offset, keeping what comes before it. An offset
+// of 0 truncates; an offset past the end of the file fails.
+fs::File _FTPResumeFile(FS *filesystem, const char *path, uint32_t offset);
+fs::File _FTPAppendFile(FS *filesystem, const char *path);
+fs::File _FTPOpenFile(FS *filesystem, const char *path);
+bool _FTPMoveFile(FS *filesystem, const char *from, const char *to);
+// Rename the file from over the file to, which may exist. Where the
+// filesystem will not rename onto an existing name (FAT), to is first
+// renamed to backup and, should from still not move, renamed back; it is
+// only removed once from has taken its place.
+bool _FTPReplaceFile(FS *filesystem, const char *from, const char *to, const char *backup);
 
 #endif // ASYNCFTP_H
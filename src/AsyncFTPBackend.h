@@ -0,0 +1,92 @@
+#ifndef ASYNCFTPBACKEND_H
+#define ASYNCFTPBACKEND_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_LITTLEFS_READ_SIZE
+#define FTP_LITTLEFS_READ_SIZE 4096     // LittleFS: bytes per read-ahead read (one flash block)
+#endif
+#ifndef FTP_LITTLEFS_WRITE_SIZE
+#define FTP_LITTLEFS_WRITE_SIZE 4096    // LittleFS: bytes per STOR write (one flash block)
+#endif
+#ifndef FTP_SD_READ_SIZE
+#define FTP_SD_READ_SIZE 8192           // SD: bytes per read-ahead read (16 sectors)
+#endif
+#ifndef FTP_SD_WRITE_SIZE
+#define FTP_SD_WRITE_SIZE 16384         // SD: bytes per STOR write (32 sectors)
+#endif
+
+// Filesystem selection for FTP file operations.
+enum class FTP_FS {
+    NONE,
+    LITTLEFS,
+    SD_CARD,
+    IMAGE       // read-only image in a flash partition, see mountImage()
+};
+
+// What the server needs to know about a storage medium, fixed at compile
+// time per FTP_FS value by a specialisation of FTPBackend:
+//   readSize   bytes the I/O task reads at once (0: files are never read)
+//   writeSize  preferred STOR write, a multiple of writeAlign
+//   writeAlign STOR writes are whole multiples of this
+//   write      files and directories can be created, changed and removed
+//   append     APPE can add to an existing file
+//   seek       REST can start a transfer part-way into a file
+//   caseless   names ignore ASCII case, and so do listing patterns
+struct FTPBackendTraits {
+    size_t readSize;
+    size_t writeSize;
+    size_t writeAlign;
+    bool   write;
+    bool   append;
+    bool   seek;
+    bool   caseless;
+};
+
+template <FTP_FS> struct FTPBackend;
+
+// No filesystem: nothing is refused up front, every operation just fails.
+template <> struct FTPBackend<FTP_FS::NONE> {
+    static constexpr FTPBackendTraits traits = {0, 4096, 512, true, true, true, false};
+};
+
+// Flash erases and programs 4 KB blocks; LittleFS caches one of them, so
+// reading or writing more at once gains nothing.
+template <> struct FTPBackend<FTP_FS::LITTLEFS> {
+    static constexpr FTPBackendTraits traits = {
+        FTP_LITTLEFS_READ_SIZE, FTP_LITTLEFS_WRITE_SIZE, 512, true, true, true, false};
+};
+
+// An SD card moves many sectors per command far faster than one at a
+// time, so it gets longer reads and writes; both stay sector-aligned.
+// FAT looks names up without regard to case.
+template <> struct FTPBackend<FTP_FS::SD_CARD> {
+    static constexpr FTPBackendTraits traits = {
+        FTP_SD_READ_SIZE, FTP_SD_WRITE_SIZE, 512, true, true, true, true};
+};
+
+// A mapped image is sent from memory and never read through a buffer.
+template <> struct FTPBackend<FTP_FS::IMAGE> {
+    static constexpr FTPBackendTraits traits = {0, 0, 1, false, false, true, false};
+};
+
+// Traits of a backend chosen at run time, e.g. the AsyncFTP constructor's
+// argument; folds to a constant when fs is one.
+constexpr FTPBackendTraits ftpBackendTraits(FTP_FS fs) {
+    return fs == FTP_FS::LITTLEFS ? FTPBackend<FTP_FS::LITTLEFS>::traits
+         : fs == FTP_FS::SD_CARD  ? FTPBackend<FTP_FS::SD_CARD>::traits
+         : fs == FTP_FS::IMAGE    ? FTPBackend<FTP_FS::IMAGE>::traits
+         :                          FTPBackend<FTP_FS::NONE>::traits;
+}
+
+// Compare length bytes of two names or paths the way the backend does:
+// exactly, or ignoring ASCII case when it is caseless.
+inline bool ftpSameName(const char* a, const char* b, size_t length, bool caseless) {
+    if (!caseless) return memcmp(a, b, length) == 0;
+    for (size_t i = 0; i < length; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+#endif // ASYNCFTPBACKEND_H
@@ -0,0 +1,210 @@
+#include "AsyncFTPDirCache.h"
+
+// Entries are packed back to back after the slot's path:
+// flags (1), name length (1), size (4), last write (4), name.
+static const size_t ENTRY_HEADER = 10;
+static const uint8_t ENTRY_DIRECTORY = 0x01;
+
+// Length of the parent directory of an absolute path ("/a/b" -> "/a", "/a" -> "/").
+static size_t parentLength(const char *path, size_t length) {
+    while (length > 1 && path[length - 1] == '/') length--;
+    while (length > 1 && path[length - 1] != '/') length--;
+    return length > 1 ? length - 1 : 1;
+}
+
+AsyncFTPDirCache::~AsyncFTPDirCache() {
+    free(_arena);
+}
+
+bool AsyncFTPDirCache::begin(size_t bytes, uint32_t ttl, bool caseless) {
+    _ttl = ttl;
+    _caseless = caseless;
+    if (_arena || bytes < FTP_DIRCACHE_DIRS * 64) return _arena != nullptr;
+    _arena = (char*)malloc(bytes);
+    if (!_arena) return false;
+    _slotSize = bytes / FTP_DIRCACHE_DIRS;
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) _slots[i].data = _arena + i * _slotSize;
+    return true;
+}
+
+bool AsyncFTPDirCache::_usable(Slot &slot) {
+    if ((slot.state != VALID && slot.state != TOO_BIG) || slot.stale) return false;
+    if (_ttl && millis() - slot.filledAt >= _ttl) {
+        if (slot.pins) slot.stale = true;
+        else           slot.state = FREE;
+        return false;
+    }
+    return true;
+}
+
+void AsyncFTPDirCache::_release(Slot &slot) {
+    if (slot.pins || slot.state == FILLING) slot.stale = true;
+    else                                    slot.state = FREE;
+}
+
+int8_t AsyncFTPDirCache::_find(const char *path, size_t length) {
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        Slot &slot = _slots[i];
+        if (slot.pathLength == length && _usable(slot) && ftpSameName(slot.data, path, length, _caseless)) {
+            slot.lastUse = ++_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool AsyncFTPDirCache::openListing(const char *path, Listing &listing) {
+    int8_t i = _find(path, strlen(path));
+    if (i < 0 || _slots[i].state != VALID) return false;
+    _slots[i].pins++;
+    listing.slot = i;
+    listing.pos = _slots[i].pathLength;
+    return true;
+}
+
+bool AsyncFTPDirCache::nextEntry(Listing &listing, FTPDirEntry &entry) {
+    if (listing.slot < 0) return false;
+    Slot &slot = _slots[listing.slot];
+    if (listing.pos >= slot.used) return false;
+    const char *p = slot.data + listing.pos;
+    entry.isDirectory = p[0] & ENTRY_DIRECTORY;
+    entry.nameLength = (uint8_t)p[1];
+    memcpy(&entry.size, p + 2, 4);
+    memcpy(&entry.lastWrite, p + 6, 4);
+    entry.name = p + ENTRY_HEADER;
+    listing.pos += ENTRY_HEADER + entry.nameLength;
+    return true;
+}
+
+void AsyncFTPDirCache::closeListing(Listing &listing) {
+    if (listing.slot < 0) return;
+    Slot &slot = _slots[listing.slot];
+    listing.slot = -1;
+    if (--slot.pins == 0 && slot.stale) slot.state = FREE;
+}
+
+int8_t AsyncFTPDirCache::beginFill(const char *path) {
+    if (!_arena) return -1;
+    size_t length = strlen(path);
+    if (length >= _slotSize) return -1;
+    // Already cached (or known to be too big), or being recorded by another session.
+    if (_find(path, length) >= 0) return -1;
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        Slot &slot = _slots[i];
+        if (slot.state == FILLING && !slot.stale && slot.pathLength == length &&
+            ftpSameName(slot.data, path, length, _caseless))
+            return -1;
+    }
+
+    // Take a free slot, or evict the least recently used idle one.
+    int8_t victim = -1;
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        Slot &slot = _slots[i];
+        if (slot.state == FREE || (slot.state != FILLING && !slot.pins && !_usable(slot))) {
+            if (slot.state != FREE) slot.state = FREE;
+            victim = i;
+            break;
+        }
+        if (slot.state == FILLING || slot.pins) continue;
+        if (victim < 0 || slot.lastUse < _slots[victim].lastUse) victim = i;
+    }
+    if (victim < 0) return -1;
+
+    Slot &slot = _slots[victim];
+    slot.state = FILLING;
+    slot.stale = false;
+    slot.overflow = false;
+    slot.pathLength = length;
+    slot.used = length;
+    slot.lastUse = ++_clock;
+    memcpy(slot.data, path, length);
+    return victim;
+}
+
+void AsyncFTPDirCache::addEntry(int8_t fill, const FTPDirEntry &entry) {
+    if (fill < 0) return;
+    Slot &slot = _slots[fill];
+    if (slot.overflow || slot.stale) return;
+    if (slot.used + ENTRY_HEADER + entry.nameLength > _slotSize) {
+        slot.overflow = true;
+        return;
+    }
+    char *p = slot.data + slot.used;
+    p[0] = entry.isDirectory ? ENTRY_DIRECTORY : 0;
+    p[1] = (char)entry.nameLength;
+    memcpy(p + 2, &entry.size, 4);
+    memcpy(p + 6, &entry.lastWrite, 4);
+    memcpy(p + ENTRY_HEADER, entry.name, entry.nameLength);
+    slot.used += ENTRY_HEADER + entry.nameLength;
+}
+
+void AsyncFTPDirCache::endFill(int8_t fill, bool complete) {
+    if (fill < 0) return;
+    Slot &slot = _slots[fill];
+    slot.filledAt = millis();
+    if (slot.stale || (!complete && !slot.overflow)) {
+        slot.state = FREE;
+    }
+    else if (slot.overflow) {
+        // Keep just the path: LIST skips the cache for it, CWD still knows it.
+        slot.state = TOO_BIG;
+        slot.used = slot.pathLength;
+    }
+    else
+        slot.state = VALID;
+}
+
+int AsyncFTPDirCache::lookup(const char *path, FTPDirEntry &entry) {
+    if (!_arena) return -1;
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') length--;
+    size_t parent = parentLength(path, length);
+    int8_t i = _find(path, parent);
+    if (i < 0 || _slots[i].state != VALID) return -1;
+
+    const char *name = path + parent + (parent > 1 ? 1 : 0);
+    size_t nameLength = path + length - name;
+    Listing listing;
+    listing.slot = i;
+    listing.pos = _slots[i].pathLength;
+    while (nextEntry(listing, entry)) {
+        if (entry.nameLength == nameLength && ftpSameName(entry.name, name, nameLength, _caseless)) return 1;
+    }
+    return 0;
+}
+
+int AsyncFTPDirCache::isDirectory(const char *path) {
+    if (!_arena) return -1;
+    if (strcmp(path, "/") == 0 || _find(path, strlen(path)) >= 0) return 1;
+    FTPDirEntry entry;
+    int found = lookup(path, entry);
+    return found > 0 ? entry.isDirectory : found;
+}
+
+void AsyncFTPDirCache::invalidate(const char *path) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') length--;
+    bool root = length == 1 && path[0] == '/';
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        Slot &slot = _slots[i];
+        if (slot.state == FREE) continue;
+        if (root || (slot.pathLength >= length && ftpSameName(slot.data, path, length, _caseless) &&
+                     (slot.pathLength == length || slot.data[length] == '/')))
+            _release(slot);
+    }
+}
+
+void AsyncFTPDirCache::invalidateParent(const char *path) {
+    size_t parent = parentLength(path, strlen(path));
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        Slot &slot = _slots[i];
+        if (slot.state != FREE && slot.pathLength == parent && ftpSameName(slot.data, path, parent, _caseless))
+            _release(slot);
+    }
+}
+
+void AsyncFTPDirCache::clear() {
+    for (size_t i = 0; i < FTP_DIRCACHE_DIRS; i++) {
+        if (_slots[i].state != FREE) _release(_slots[i]);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef ASYNCFTPDIRCACHE_H
+#define ASYNCFTPDIRCACHE_H
+
+#include "AsyncFTPPort.h"
+#include "AsyncFTPBackend.h"
+
+#ifndef FTP_DIRCACHE_SIZE
+#define FTP_DIRCACHE_SIZE 16384 // Bytes of RAM for cached directory listings (0 disables)
+#endif
+#ifndef FTP_DIRCACHE_DIRS
+#define FTP_DIRCACHE_DIRS 4     // Directories cached at once; each gets an equal share
+#endif
+#ifndef FTP_DIRCACHE_TTL
+#define FTP_DIRCACHE_TTL 10000  // Milliseconds a listing is trusted (0: until invalidated)
+#endif
+
+// One directory entry, as listed by LIST and MLSD and looked up by CWD,
+// SIZE, MDTM and MLST.
+struct FTPDirEntry {
+    const char* name;           // not NUL-terminated
+    uint8_t     nameLength;
+    bool        isDirectory;
+    uint32_t    size;
+    uint32_t    lastWrite;      // seconds since the epoch, 0 if unknown
+};
+
+// LRU cache of directory listings keyed by absolute path.
+//
+// Listings are recorded while a LIST streams from the filesystem and replayed
+// by later LISTs; CWD, SIZE, MDTM and MLST answer from the parent
+// directory's listing.
+// The memory is allocated once in begin() and split into FTP_DIRCACHE_DIRS
+// fixed slots, so filling and evicting never touch the heap. A directory
+// that does not fit its slot is remembered as too big and always listed
+// from the filesystem.
+//
+// Mutations made through FTP invalidate the affected directories; changes
+// made behind the server's back are picked up after the TTL, or at once
+// through AsyncFTP::invalidateCache(). On a caseless backend paths and
+// names match regardless of ASCII case, as the filesystem would match
+// them. Only used from the network task.
+class AsyncFTPDirCache {
+public:
+    ~AsyncFTPDirCache();
+    bool begin(size_t bytes, uint32_t ttl, bool caseless);
+
+    // Replay a cached listing. A listing stays readable until closed, even
+    // if it is invalidated in the meantime.
+    struct Listing {
+        int8_t slot = -1;
+        size_t pos = 0;
+    };
+    bool openListing(const char* path, Listing& listing);
+    bool nextEntry(Listing& listing, FTPDirEntry& entry);
+    void closeListing(Listing& listing);
+
+    // Record a listing as it is read from the filesystem. beginFill()
+    // returns -1 if the directory should not (or cannot) be recorded.
+    int8_t beginFill(const char* path);
+    void   addEntry(int8_t fill, const FTPDirEntry& entry);
+    // complete: the whole directory was read.
+    void   endFill(int8_t fill, bool complete);
+
+    // 1 if yes, 0 if no, -1 if the cache does not know.
+    int isDirectory(const char* path);
+    // Look up path in the cached listing of its parent directory. Returns
+    // 1 and fills entry if found, 0 if not there, -1 if unknown.
+    int lookup(const char* path, FTPDirEntry& entry);
+
+    // Forget path and everything below it.
+    void invalidate(const char* path);
+    // Forget the directory that contains path.
+    void invalidateParent(const char* path);
+    void clear();
+
+private:
+    enum SlotState : uint8_t { FREE, FILLING, VALID, TOO_BIG };
+    struct Slot {
+        SlotState state = FREE;
+        bool      stale = false;    // invalidated while filling or pinned
+        bool      overflow = false; // the fill ran out of room
+        uint8_t   pins = 0;         // open listings
+        uint16_t  pathLength = 0;   // the path is stored at the start of data
+        size_t    used = 0;         // path and entries, in bytes
+        uint32_t  lastUse = 0;
+        uint32_t  filledAt = 0;
+        char*     data = nullptr;
+    };
+
+    // Slot holding a usable listing (or too-big marker) for path, or -1.
+    int8_t _find(const char* path, size_t length);
+    bool   _usable(Slot& slot);
+    void   _release(Slot& slot);
+
+    char*    _arena = nullptr;
+    size_t   _slotSize = 0;
+    uint32_t _ttl = 0;
+    uint32_t _clock = 0;
+    bool     _caseless = false;
+    Slot     _slots[FTP_DIRCACHE_DIRS];
+};
+
+#endif // ASYNCFTPDIRCACHE_H
@@ -0,0 +1,137 @@
+#include "AsyncFTPFileCache.h"
+
+AsyncFTPFileCache::~AsyncFTPFileCache() {
+    free(_arena);
+}
+
+bool AsyncFTPFileCache::begin(size_t bytes, size_t maxFileSize, uint32_t ttl, bool caseless) {
+    _ttl = ttl;
+    _caseless = caseless;
+    _maxFileSize = maxFileSize;
+    if (_arena || bytes < FTP_FILECACHE_FILES * 64) return _arena != nullptr;
+    // Cached files are read far less often than they would be from flash,
+    // so the slower PSRAM is the better home for them.
+    if (psramFound()) _arena = (uint8_t*)ps_malloc(bytes);
+    if (!_arena) _arena = (uint8_t*)malloc(bytes);
+    if (!_arena) return false;
+    _slotSize = bytes / FTP_FILECACHE_FILES;
+    for (size_t i = 0; i < FTP_FILECACHE_FILES; i++) _slots[i].data = _arena + i * _slotSize;
+    return true;
+}
+
+bool AsyncFTPFileCache::_usable(Slot &slot) {
+    if (!slot.valid || slot.stale) return false;
+    if (_ttl && millis() - slot.filledAt >= _ttl) {
+        _release(slot);
+        return false;
+    }
+    return true;
+}
+
+void AsyncFTPFileCache::_release(Slot &slot) {
+    if (slot.pins) slot.stale = true;
+    else           slot.valid = false;
+}
+
+int8_t AsyncFTPFileCache::_find(const char *path, size_t length) {
+    for (size_t i = 0; i < FTP_FILECACHE_FILES; i++) {
+        Slot &slot = _slots[i];
+        if (slot.pathLength == length && _usable(slot) && ftpSameName((const char*)slot.data, path, length, _caseless)) {
+            slot.lastUse = ++_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool AsyncFTPFileCache::open(const char *path, Handle &handle) {
+    if (!_arena) return false;
+    int8_t i = _find(path, strlen(path));
+    if (i < 0) return false;
+    _slots[i].pins++;
+    handle.slot = i;
+    handle.pos = 0;
+    handle.size = _slots[i].size;
+    return true;
+}
+
+bool AsyncFTPFileCache::fill(const char *path, fs::File &file, Handle &handle) {
+    if (!_arena) return false;
+    size_t length = strlen(path);
+    size_t size = file.size();
+    if (size > _maxFileSize || length + size > _slotSize) return false;
+
+    // Take a free slot, or evict the least recently used idle one.
+    int8_t victim = -1;
+    for (size_t i = 0; i < FTP_FILECACHE_FILES; i++) {
+        Slot &slot = _slots[i];
+        if (slot.pins) continue;
+        if (!_usable(slot)) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || slot.lastUse < _slots[victim].lastUse) victim = i;
+    }
+    if (victim < 0) return false;
+
+    Slot &slot = _slots[victim];
+    slot.valid = false;
+    memcpy(slot.data, path, length);
+    size_t got = 0;
+    while (got < size) {
+        size_t n = file.read(slot.data + length + got, size - got);
+        if (n == 0) return false;
+        got += n;
+    }
+    slot.valid = true;
+    slot.stale = false;
+    slot.pathLength = length;
+    slot.size = size;
+    slot.lastUse = ++_clock;
+    slot.filledAt = millis();
+    slot.pins = 1;
+    handle.slot = victim;
+    handle.pos = 0;
+    handle.size = size;
+    return true;
+}
+
+const uint8_t *AsyncFTPFileCache::read(Handle &handle, size_t &len) {
+    len = 0;
+    if (handle.slot < 0) return nullptr;
+    Slot &slot = _slots[handle.slot];
+    uint32_t pos = handle.pos < handle.size ? handle.pos : handle.size;
+    len = handle.size - pos;
+    handle.pos = handle.size;
+    return slot.data + slot.pathLength + pos;
+}
+
+void AsyncFTPFileCache::close(Handle &handle) {
+    if (handle.slot < 0) return;
+    Slot &slot = _slots[handle.slot];
+    handle.slot = -1;
+    if (--slot.pins == 0 && slot.stale) {
+        slot.valid = false;
+        slot.stale = false;
+    }
+}
+
+void AsyncFTPFileCache::invalidate(const char *path) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') length--;
+    bool root = length == 1 && path[0] == '/';
+    for (size_t i = 0; i < FTP_FILECACHE_FILES; i++) {
+        Slot &slot = _slots[i];
+        if (!slot.valid) continue;
+        const char *name = (const char*)slot.data;
+        if (root || (slot.pathLength >= length && ftpSameName(name, path, length, _caseless) &&
+                     (slot.pathLength == length || name[length] == '/')))
+            _release(slot);
+    }
+}
+
+void AsyncFTPFileCache::clear() {
+    for (size_t i = 0; i < FTP_FILECACHE_FILES; i++) {
+        if (_slots[i].valid) _release(_slots[i]);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef ASYNCFTPFILECACHE_H
+#define ASYNCFTPFILECACHE_H
+
+#include "AsyncFTPPort.h"
+#include "AsyncFTPBackend.h"
+
+#ifndef FTP_FILECACHE_SIZE
+#define FTP_FILECACHE_SIZE 0        // Bytes of RAM (PSRAM if present) for cached files (0 disables)
+#endif
+#ifndef FTP_FILECACHE_FILES
+#define FTP_FILECACHE_FILES 4       // Files cached at once; each gets an equal share
+#endif
+#ifndef FTP_FILECACHE_MAXFILE
+#define FTP_FILECACHE_MAXFILE 1536  // Largest file cached, in bytes
+#endif
+#ifndef FTP_FILECACHE_TTL
+#define FTP_FILECACHE_TTL 10000     // Milliseconds a cached file is trusted (0: until invalidated)
+#endif
+
+// LRU cache of small files' contents keyed by absolute path, for RETR.
+// Off unless given memory with AsyncFTP::setFileCache() or
+// FTP_FILECACHE_SIZE, so the server takes no RAM for it by default.
+//
+// The first RETR of a small file reads it whole into a slot; later ones
+// are sent straight from the slot without opening the file. The memory is
+// allocated once in begin(), from PSRAM when the board has it, and split
+// into FTP_FILECACHE_FILES fixed slots, so filling and evicting never
+// touch the heap. Files larger than the threshold or their slot are
+// always read from the filesystem.
+//
+// As with AsyncFTPDirCache, changes made through FTP invalidate the file
+// at once and changes made behind the server's back are picked up after
+// the TTL or through AsyncFTP::invalidateCache(). Paths match ignoring
+// case on a caseless backend, as in the directory cache. Only used from the
+// network task.
+class AsyncFTPFileCache {
+public:
+    ~AsyncFTPFileCache();
+    bool begin(size_t bytes, size_t maxFileSize, uint32_t ttl, bool caseless);
+
+    // A cached file being sent. It stays readable until closed, even if it
+    // is invalidated in the meantime.
+    struct Handle {
+        int8_t   slot = -1;
+        uint32_t pos = 0;
+        uint32_t size = 0;
+    };
+    bool open(const char* path, Handle& handle);
+    // Cache file (open for reading at its start) under path and open it,
+    // if it is small enough. On false the file's position is undefined.
+    bool fill(const char* path, fs::File& file, Handle& handle);
+    // The bytes from pos to the end of the file; advances pos to the end.
+    const uint8_t* read(Handle& handle, size_t& len);
+    void close(Handle& handle);
+
+    // Forget path and everything below it.
+    void invalidate(const char* path);
+    void clear();
+
+private:
+    struct Slot {
+        bool      valid = false;
+        bool      stale = false;    // invalidated while open
+        uint8_t   pins = 0;         // open handles
+        uint16_t  pathLength = 0;   // the path is stored at the start of data
+        uint32_t  size = 0;         // file bytes, after the path
+        uint32_t  lastUse = 0;
+        uint32_t  filledAt = 0;
+        uint8_t*  data = nullptr;
+    };
+
+    // Slot holding a usable copy of path, or -1.
+    int8_t _find(const char* path, size_t length);
+    bool   _usable(Slot& slot);
+    void   _release(Slot& slot);
+
+    uint8_t* _arena = nullptr;
+    size_t   _slotSize = 0;
+    size_t   _maxFileSize = 0;
+    uint32_t _ttl = 0;
+    uint32_t _clock = 0;
+    bool     _caseless = false;
+    Slot     _slots[FTP_FILECACHE_FILES];
+};
+
+#endif // ASYNCFTPFILECACHE_H
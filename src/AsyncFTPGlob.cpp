@@ -0,0 +1,145 @@
+#include "AsyncFTPGlob.h"
+
+static inline char fold(char c, bool caseless) {
+    return caseless ? (char)tolower((unsigned char)c) : c;
+}
+
+bool AsyncFTPGlob::_add(Kind kind, uint8_t index, uint8_t length) {
+    if (_count == FTP_GLOB_TOKENS) return false;
+    _tokens[_count++] = { kind, index, length };
+    return true;
+}
+
+const char *AsyncFTPGlob::_set(const char *pattern) {
+    const char *p = pattern + 1;
+    bool negate = *p == '!' || *p == '^';
+    if (negate) p++;
+    // A ']' right after the opening bracket is a member.
+    const char *end = p + (*p == ']');
+    while (*end && *end != ']') end++;
+    if (!*end || _setCount == FTP_GLOB_SETS) return nullptr;
+
+    uint8_t *bits = _sets[_setCount];
+    memset(bits, 0, 32);
+    while (p < end) {
+        uint8_t low = (uint8_t)*p, high = low;
+        if (p[1] == '-' && p + 2 < end) {
+            high = (uint8_t)p[2];
+            p += 3;
+        }
+        else
+            p++;
+        for (unsigned c = low; c <= high; c++) {
+            bits[c >> 3] |= 1 << (c & 7);
+            if (_caseless) {
+                uint8_t other = isupper(c) ? tolower(c) : toupper(c);
+                bits[other >> 3] |= 1 << (other & 7);
+            }
+        }
+    }
+    if (negate) {
+        for (size_t i = 0; i < 32; i++) bits[i] = ~bits[i];
+    }
+    if (!_add(SET, _setCount, 0)) return nullptr;
+    _setCount++;
+    return end + 1;
+}
+
+bool AsyncFTPGlob::compile(const char *pattern, bool literal, bool caseless) {
+    _all = false;
+    _caseless = caseless;
+    _count = 0;
+    _setCount = 0;
+    _minLength = 0;
+    _textLength = 0;
+    for (const char *p = pattern; *p; ) {
+        if (!literal) {
+            if (*p == '*') {
+                while (*p == '*') p++;
+                if (!_add(ANY, 0, 0)) return false;
+                continue;
+            }
+            if (*p == '?') {
+                p++;
+                _minLength++;
+                if (!_add(ONE, 0, 0)) return false;
+                continue;
+            }
+            if (*p == '[') {
+                const char *next = _set(p);
+                if (next) {
+                    p = next;
+                    _minLength++;
+                    continue;
+                }
+                if (_count == FTP_GLOB_TOKENS || _setCount == FTP_GLOB_SETS) return false;
+                // Unterminated: the '[' is an ordinary character.
+            }
+            if (*p == '\\' && p[1]) p++;
+        }
+        // Extend the literal run that ends the pattern so far, or start one.
+        if (_textLength == FTP_GLOB_LENGTH) return false;
+        Token *last = _count ? &_tokens[_count - 1] : nullptr;
+        if (last && last->kind == LITERAL) last->length++;
+        else if (!_add(LITERAL, _textLength, 1)) return false;
+        _text[_textLength++] = fold(*p++, caseless);
+        _minLength++;
+    }
+    return true;
+}
+
+bool AsyncFTPGlob::_step(const Token &token, const char *name, size_t length, size_t &pos) const {
+    switch (token.kind) {
+        case LITERAL:
+            if (length - pos < token.length) return false;
+            for (uint8_t i = 0; i < token.length; i++) {
+                if (fold(name[pos + i], _caseless) != _text[token.index + i]) return false;
+            }
+            pos += token.length;
+            return true;
+        case ONE:
+            if (pos == length) return false;
+            pos++;
+            return true;
+        case SET: {
+            if (pos == length) return false;
+            uint8_t c = (uint8_t)name[pos];
+            if (!(_sets[token.index][c >> 3] & (1 << (c & 7)))) return false;
+            pos++;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool AsyncFTPGlob::matches(const char *name, size_t length) const {
+    if (_all) return true;
+    if (length < _minLength) return false;
+    // On a mismatch, let the last '*' take one more character and retry
+    // from the token after it; earlier stars never need to change.
+    uint8_t token = 0;
+    size_t pos = 0;
+    int star = -1;
+    size_t starPos = 0;
+    for (;;) {
+        if (token < _count) {
+            const Token &t = _tokens[token];
+            if (t.kind == ANY) {
+                if (++token == _count) return true;
+                star = token;
+                starPos = pos;
+                continue;
+            }
+            if (_step(t, name, length, pos)) {
+                token++;
+                continue;
+            }
+        }
+        else if (pos == length)
+            return true;
+        if (star < 0 || starPos == length) return false;
+        token = star;
+        pos = ++starPos;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef ASYNCFTPGLOB_H
+#define ASYNCFTPGLOB_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_GLOB_TOKENS
+#define FTP_GLOB_TOKENS 24          // Wildcards and literal runs in one pattern
+#endif
+#ifndef FTP_GLOB_SETS
+#define FTP_GLOB_SETS 4             // [...] sets in one pattern
+#endif
+#define FTP_GLOB_LENGTH 255         // Longest pattern (one path segment)
+
+// A shell wildcard pattern for one name: '*', '?', sets such as [0-9] or
+// [!a-z], and '\' to quote the next character. compile() parses it once
+// into a fixed token array, so matching the entries of a large directory
+// allocates nothing and never looks at the pattern text again. Only the
+// last '*' is ever backtracked to, which keeps matching linear in practice.
+class AsyncFTPGlob {
+public:
+    // Compile pattern; literal: take it as a plain name, without wildcards.
+    // caseless: ignore ASCII case, as FAT does. False if the pattern is
+    // longer than FTP_GLOB_LENGTH or needs more tokens or sets than there
+    // are. Until compiled, every name matches.
+    bool compile(const char* pattern, bool literal, bool caseless);
+    void clear() { _all = true; }
+    bool matches(const char* name, size_t length) const;
+
+private:
+    enum Kind : uint8_t { LITERAL, ONE, ANY, SET };
+    struct Token {
+        Kind    kind;
+        uint8_t index;              // LITERAL: offset in _text; SET: index in _sets
+        uint8_t length;             // LITERAL: bytes
+    };
+    // Parse the set starting at pattern ("[...]"); returns the character
+    // after it, or null if the set is unterminated or there is no room.
+    const char* _set(const char* pattern);
+    bool _add(Kind kind, uint8_t index, uint8_t length);
+    bool _step(const Token& token, const char* name, size_t length, size_t& pos) const;
+
+    bool     _all = true;
+    bool     _caseless = false;
+    uint8_t  _count = 0;            // tokens
+    uint8_t  _setCount = 0;
+    uint16_t _minLength = 0;        // shortest name that can match
+    Token    _tokens[FTP_GLOB_TOKENS];
+    uint8_t  _sets[FTP_GLOB_SETS][32];  // bitmaps of the bytes each set takes
+    uint8_t  _textLength = 0;
+    char     _text[FTP_GLOB_LENGTH];    // literal runs, lower-cased if caseless
+};
+
+#endif // ASYNCFTPGLOB_H
@@ -0,0 +1,289 @@
+#include "AsyncFTPHash.h"
+#include <new>
+
+static const char *const NAMES[AsyncFTPHash::ALGORITHMS] = {"CRC32", "MD5", "SHA-256"};
+
+static void toHex(const uint8_t *digest, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0F];
+    }
+    hex[2 * len] = '\0';
+}
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len) {
+    // Half-byte table: 64 bytes instead of 1 KB, and still far faster than
+    // the flash reads feeding it.
+    static const uint32_t TABLE[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+        crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+const char *AsyncFTPHash::name(Algorithm algorithm) {
+    return algorithm < ALGORITHMS ? NAMES[algorithm] : "";
+}
+
+AsyncFTPHash::Algorithm AsyncFTPHash::find(const char *name) {
+    for (uint8_t i = 0; i < ALGORITHMS; i++) {
+        if (strcasecmp(name, NAMES[i]) == 0) return (Algorithm)i;
+    }
+    return ALGORITHMS;
+}
+
+#if defined(ARDUINO)
+
+AsyncFTPHash::~AsyncFTPHash() {
+    if (!_started) return;
+    mbedtls_md5_free(&_md5);
+    mbedtls_sha256_free(&_sha256);
+}
+
+void AsyncFTPHash::begin(Algorithm algorithm) {
+    if (!_started) {
+        mbedtls_md5_init(&_md5);
+        mbedtls_sha256_init(&_sha256);
+        _started = true;
+    }
+    _algorithm = algorithm;
+    _crc = 0;
+    if (algorithm == MD5)         mbedtls_md5_starts(&_md5);
+    else if (algorithm == SHA256) mbedtls_sha256_starts(&_sha256, 0);
+}
+
+void AsyncFTPHash::update(const uint8_t *data, size_t len) {
+    switch (_algorithm) {
+        case CRC32:  _crc = crc32Update(_crc, data, len); break;
+        case MD5:    mbedtls_md5_update(&_md5, data, len); break;
+        case SHA256: mbedtls_sha256_update(&_sha256, data, len); break;
+        default:     break;
+    }
+}
+
+void AsyncFTPHash::finish(char *hex) {
+    uint8_t digest[32];
+    size_t len = 0;
+    switch (_algorithm) {
+        case MD5:    mbedtls_md5_finish(&_md5, digest); len = 16; break;
+        case SHA256: mbedtls_sha256_finish(&_sha256, digest); len = 32; break;
+        default:
+            for (int i = 0; i < 4; i++) digest[i] = (uint8_t)(_crc >> (24 - 8 * i));
+            len = 4;
+            break;
+    }
+    toHex(digest, len, hex);
+}
+
+#else
+
+// Portable MD5 (RFC 1321) and SHA-256 (FIPS 180-4) for builds without mbedTLS.
+
+static inline uint32_t rotl(uint32_t x, uint8_t n) { return (x << n) | (x >> (32 - n)); }
+static inline uint32_t rotr(uint32_t x, uint8_t n) { return (x >> n) | (x << (32 - n)); }
+
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+static const uint8_t MD5_S[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+AsyncFTPHash::~AsyncFTPHash() {}
+
+void AsyncFTPHash::begin(Algorithm algorithm) {
+    static const uint32_t MD5_INIT[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    static const uint32_t SHA256_INIT[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    _algorithm = algorithm;
+    _crc = 0;
+    _length = 0;
+    if (algorithm == MD5)         memcpy(_state, MD5_INIT, sizeof(MD5_INIT));
+    else if (algorithm == SHA256) memcpy(_state, SHA256_INIT, sizeof(SHA256_INIT));
+}
+
+void AsyncFTPHash::_md5Block(const uint8_t *block) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+        else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+        else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) & 15; }
+        else             { f = c ^ (b | ~d);       g = (7 * i) & 15; }
+        f += a + MD5_K[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotl(f, MD5_S[(i >> 4) * 4 + (i & 3)]);
+    }
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+}
+
+void AsyncFTPHash::_sha256Block(const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4 * i] << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, _state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + SHA256_K[i] + w[i];
+        uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; i++) _state[i] += v[i];
+}
+
+void AsyncFTPHash::update(const uint8_t *data, size_t len) {
+    if (_algorithm == CRC32) {
+        _crc = crc32Update(_crc, data, len);
+        return;
+    }
+    while (len > 0) {
+        size_t used = _length % 64;
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(_block + used, data, n);
+        _length += n;
+        data += n;
+        len -= n;
+        if (used + n < 64) break;
+        if (_algorithm == MD5) _md5Block(_block);
+        else                   _sha256Block(_block);
+    }
+}
+
+void AsyncFTPHash::finish(char *hex) {
+    uint8_t digest[32];
+    if (_algorithm == CRC32) {
+        for (int i = 0; i < 4; i++) digest[i] = (uint8_t)(_crc >> (24 - 8 * i));
+        toHex(digest, 4, hex);
+        return;
+    }
+    // Pad with 0x80, zeros and the bit length: little-endian for MD5,
+    // big-endian for SHA-256.
+    uint64_t bits = _length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padLength = (_length % 64 < 56 ? 56 : 120) - _length % 64;
+    for (int i = 0; i < 8; i++)
+        pad[padLength + i] = (uint8_t)(_algorithm == MD5 ? bits >> (8 * i) : bits >> (56 - 8 * i));
+    update(pad, padLength + 8);
+
+    if (_algorithm == MD5) {
+        for (int i = 0; i < 16; i++) digest[i] = (uint8_t)(_state[i / 4] >> (8 * (i % 4)));
+        toHex(digest, 16, hex);
+    } else {
+        for (int i = 0; i < 32; i++) digest[i] = (uint8_t)(_state[i / 4] >> (24 - 8 * (i % 4)));
+        toHex(digest, 32, hex);
+    }
+}
+
+#endif
+
+//---------------------------------------------------------------------
+// AsyncFTPHashCache
+//---------------------------------------------------------------------
+
+AsyncFTPHashCache::~AsyncFTPHashCache() {
+    delete[] _entries;
+}
+
+bool AsyncFTPHashCache::begin(bool caseless) {
+    _caseless = caseless;
+    if (_entries || FTP_HASHCACHE_ENTRIES == 0) return _entries != nullptr;
+    _entries = new (std::nothrow) Entry[FTP_HASHCACHE_ENTRIES];
+    return _entries != nullptr;
+}
+
+bool AsyncFTPHashCache::find(const Key &key, char *hex) {
+    if (!_entries) return false;
+    size_t length = strlen(key.path);
+    for (size_t i = 0; i < FTP_HASHCACHE_ENTRIES; i++) {
+        Entry &entry = _entries[i];
+        if (!entry.used || entry.algorithm != key.algorithm || entry.start != key.start ||
+            entry.end != key.end || entry.pathLength != length || !ftpSameName(entry.path, key.path, length, _caseless))
+            continue;
+        if (entry.size != key.size || entry.lastWrite != key.lastWrite) {
+            // Changed behind the server's back.
+            entry.used = false;
+            continue;
+        }
+        entry.lastUse = ++_clock;
+        strcpy(hex, entry.hex);
+        return true;
+    }
+    return false;
+}
+
+void AsyncFTPHashCache::add(const Key &key, const char *hex) {
+    size_t length = strlen(key.path);
+    if (!_entries || length >= sizeof(Entry::path)) return;
+    // Take a free entry, or evict the least recently used one.
+    Entry *victim = &_entries[0];
+    for (size_t i = 0; i < FTP_HASHCACHE_ENTRIES; i++) {
+        Entry &entry = _entries[i];
+        if (!entry.used) {
+            victim = &entry;
+            break;
+        }
+        if (entry.lastUse < victim->lastUse) victim = &entry;
+    }
+    victim->used = true;
+    victim->algorithm = key.algorithm;
+    victim->pathLength = length;
+    victim->start = key.start;
+    victim->end = key.end;
+    victim->size = key.size;
+    victim->lastWrite = key.lastWrite;
+    victim->lastUse = ++_clock;
+    memcpy(victim->path, key.path, length);
+    strcpy(victim->hex, hex);
+}
+
+void AsyncFTPHashCache::invalidate(const char *path) {
+    if (!_entries) return;
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') length--;
+    bool root = length == 1 && path[0] == '/';
+    for (size_t i = 0; i < FTP_HASHCACHE_ENTRIES; i++) {
+        Entry &entry = _entries[i];
+        if (entry.used && (root || (entry.pathLength >= length && ftpSameName(entry.path, path, length, _caseless) &&
+                                    (entry.pathLength == length || entry.path[length] == '/'))))
+            entry.used = false;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef ASYNCFTPHASH_H
+#define ASYNCFTPHASH_H
+
+#include "AsyncFTPPort.h"
+#include "AsyncFTPBackend.h"
+
+#if defined(ARDUINO)
+// mbedTLS is part of the ESP32 core and uses the SHA accelerator.
+#include <mbedtls/md5.h>
+#include <mbedtls/sha256.h>
+#endif
+
+#ifndef FTP_HASHCACHE_ENTRIES
+#define FTP_HASHCACHE_ENTRIES 8     // Digests remembered (0 disables the cache)
+#endif
+
+// Incremental CRC32, MD5 or SHA-256 of a byte stream.
+class AsyncFTPHash {
+public:
+    enum Algorithm : uint8_t { CRC32, MD5, SHA256, ALGORITHMS };
+    // Longest digest, in hex, with its terminating NUL.
+    static const size_t HEX_MAX = 65;
+
+    // "CRC32", "MD5" or "SHA-256".
+    static const char* name(Algorithm algorithm);
+    // Algorithm with the given name (case-insensitive), or ALGORITHMS.
+    static Algorithm find(const char* name);
+
+    ~AsyncFTPHash();
+    void begin(Algorithm algorithm);
+    void update(const uint8_t* data, size_t len);
+    // Write the digest as lower-case hex into hex (HEX_MAX bytes).
+    void finish(char* hex);
+
+private:
+    void _md5Block(const uint8_t* block);
+    void _sha256Block(const uint8_t* block);
+
+    Algorithm _algorithm = CRC32;
+    uint32_t  _crc = 0;
+#if defined(ARDUINO)
+    mbedtls_md5_context    _md5;
+    mbedtls_sha256_context _sha256;
+    bool      _started = false;
+#else
+    uint32_t  _state[8];
+    uint64_t  _length = 0;          // bytes hashed
+    uint8_t   _block[64];
+#endif
+};
+
+// Digests computed earlier, keyed by path, algorithm and range. An entry is
+// only used while the file's size and modification time still match, and
+// changes made through FTP drop it at once. Paths match ignoring case on a
+// caseless backend. Only used from the network task.
+class AsyncFTPHashCache {
+public:
+    ~AsyncFTPHashCache();
+    bool begin(bool caseless);
+
+    struct Key {
+        const char* path;
+        AsyncFTPHash::Algorithm algorithm;
+        uint32_t start;
+        uint32_t end;               // exclusive
+        uint32_t size;              // of the whole file
+        uint32_t lastWrite;
+    };
+    // Copy the cached digest for key into hex; false if there is none.
+    bool find(const Key& key, char* hex);
+    void add(const Key& key, const char* hex);
+    // Forget path and everything below it.
+    void invalidate(const char* path);
+
+private:
+    struct Entry {
+        bool     used = false;
+        uint8_t  algorithm = 0;
+        uint16_t pathLength = 0;
+        uint32_t start = 0, end = 0, size = 0, lastWrite = 0;
+        uint32_t lastUse = 0;
+        char     hex[AsyncFTPHash::HEX_MAX];
+        char     path[256];
+    };
+    Entry*   _entries = nullptr;
+    uint32_t _clock = 0;
+    bool     _caseless = false;
+};
+
+#endif // ASYNCFTPHASH_H
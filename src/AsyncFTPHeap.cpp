@@ -0,0 +1,30 @@
+#include "AsyncFTPHeap.h"
+
+void AsyncFTPHeapBudget::configure(size_t budget, size_t minFree) {
+    _budget = budget;
+    _minFree = minFree;
+}
+
+bool AsyncFTPHeapBudget::admits(size_t bytes) const {
+    if (_budget > 0 && _reserved + bytes > _budget) return false;
+    // The free heap already shows what reservations have allocated; it has
+    // to cover the rest of them as well as the new one.
+    return ESP.getFreeHeap() >= _minFree + _pending + bytes;
+}
+
+bool AsyncFTPHeapBudget::reserve(size_t bytes) {
+    if (!admits(bytes)) return false;
+    _reserved += bytes;
+    _pending += bytes;
+    if (_reserved > _peak) _peak = _reserved;
+    return true;
+}
+
+void AsyncFTPHeapBudget::allocated(size_t bytes) {
+    _pending = bytes < _pending ? _pending - bytes : 0;
+}
+
+void AsyncFTPHeapBudget::release(size_t bytes, size_t pending) {
+    _reserved = bytes < _reserved ? _reserved - bytes : 0;
+    _pending = pending < _pending ? _pending - pending : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef ASYNCFTPHEAP_H
+#define ASYNCFTPHEAP_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_HEAP_MIN_FREE
+#define FTP_HEAP_MIN_FREE 24576     // Free heap left to the sketch, WiFi and lwIP
+#endif
+#ifndef FTP_HEAP_CONNECTION
+#define FTP_HEAP_CONNECTION 6144    // Heap of one TCP connection in AsyncTCP and lwIP, at worst
+#endif
+
+// Heap governor: accounts what open sessions and running transfers hold
+// beyond the memory begin() sets aside, and admits another one only if it
+// stays within the budget (when there is one) and leaves at least the
+// floor free. Reservations are worst-case estimates taken before the
+// memory is allocated, so a refusal comes with a proper reply instead of
+// a failed allocation halfway through. Until its holder reports a part
+// allocated, a reservation is still to come out of the free heap, so the
+// floor has to hold with all such parts taken away. Connection memory
+// never counts as allocated: lwIP takes and frees it as traffic flows.
+// Used on the network task only.
+class AsyncFTPHeapBudget {
+public:
+    // budget: bytes all reservations together may reach, 0 for no limit.
+    void configure(size_t budget, size_t minFree);
+    // Whether bytes could be reserved now.
+    bool admits(size_t bytes) const;
+    // Reserve bytes; false, with nothing reserved, if they are not admitted.
+    bool reserve(size_t bytes);
+    // bytes of a reservation have been allocated and show in the free heap.
+    void allocated(size_t bytes);
+    // Give back a reservation of bytes, pending of which were never
+    // reported allocated.
+    void release(size_t bytes, size_t pending);
+
+    size_t budget() const   { return _budget; }
+    size_t reserved() const { return _reserved; }
+    size_t peak() const     { return _peak; }
+
+private:
+    size_t _budget = 0;
+    size_t _minFree = FTP_HEAP_MIN_FREE;
+    size_t _reserved = 0;
+    size_t _pending = 0;            // reserved but not yet allocated
+    size_t _peak = 0;
+};
+
+#endif // ASYNCFTPHEAP_H
@@ -0,0 +1,158 @@
+#include "AsyncFTPIO.h"
+
+// The ring indices only grow; head - tail is the number of filled blocks.
+// Both sides use sequentially consistent atomics: wait() stores _starved and
+// then reads _head, while the I/O task stores _head and then reads _starved,
+// so at least one of them sees the other and a wake is never lost.
+
+const uint8_t *AsyncFTPReadAhead::peek(size_t &length) {
+    uint32_t tail = _tail.load();
+    if (tail == _head.load()) return nullptr;
+    size_t block = tail % FTP_IO_BLOCKS;
+    length = _length[block] - _offset;
+    return _blocks + block * _io->_blockSize + _offset;
+}
+
+void AsyncFTPReadAhead::consume(size_t length) {
+    uint32_t tail = _tail.load();
+    _offset += length;
+    if (_offset < _length[tail % FTP_IO_BLOCKS]) return;
+    _offset = 0;
+    _tail.store(tail + 1);
+    _io->_notify();
+}
+
+bool AsyncFTPReadAhead::done() {
+    // _eof is stored after the last _head, so read it first.
+    bool eof = _eof.load();
+    return eof && _tail.load() == _head.load();
+}
+
+bool AsyncFTPReadAhead::wait() {
+    _starved.store(true);
+    if (_tail.load() != _head.load() || _eof.load()) {
+        _starved.store(false);
+        return false;
+    }
+    return true;
+}
+
+AsyncFTPIO::~AsyncFTPIO() {
+    end();
+}
+
+bool AsyncFTPIO::begin(size_t blockSize) {
+    if (_taskHandle || FTP_IO_JOBS == 0) return _taskHandle != nullptr;
+    _blockSize = blockSize;
+    _memory = (uint8_t*)malloc(FTP_IO_JOBS * FTP_IO_BLOCKS * blockSize);
+    _stopped = xSemaphoreCreateBinary();
+    if (!_memory || !_stopped) {
+        end();
+        return false;
+    }
+    for (size_t i = 0; i < FTP_IO_JOBS; i++) {
+        _jobs[i]._blocks = _memory + i * FTP_IO_BLOCKS * blockSize;
+        _jobs[i]._io = this;
+    }
+    _stopping = false;
+    if (xTaskCreatePinnedToCore(_task, "ftp_io", FTP_IO_TASK_STACK, this, FTP_IO_TASK_PRIORITY,
+                                &_taskHandle, FTP_IO_TASK_CORE) != pdPASS) {
+        _taskHandle = nullptr;
+        end();
+        return false;
+    }
+    return true;
+}
+
+void AsyncFTPIO::end() {
+    if (_taskHandle) {
+        _stopping = true;
+        xTaskNotifyGive(_taskHandle);
+        xSemaphoreTake(_stopped, portMAX_DELAY);
+        _taskHandle = nullptr;
+    }
+    for (AsyncFTPReadAhead &job : _jobs) {
+        job._file.close();
+        job._blocks = nullptr;
+        job._state = AsyncFTPReadAhead::FREE;
+    }
+    free(_memory);
+    _memory = nullptr;
+    if (_stopped) vSemaphoreDelete(_stopped);
+    _stopped = nullptr;
+}
+
+AsyncFTPReadAhead *AsyncFTPIO::startRead(fs::File &file, uint32_t length, void (*wake)(void*), void *arg) {
+    if (!_taskHandle) return nullptr;
+    for (AsyncFTPReadAhead &job : _jobs) {
+        if (job._state != AsyncFTPReadAhead::FREE) continue;
+        // The I/O task ignores free jobs, so it is safe to set one up here;
+        // storing ACTIVE publishes it.
+        job._file = file;
+        job._remaining = length;
+        job._wake = wake;
+        job._wakeArg = arg;
+        job._head = 0;
+        job._tail = 0;
+        job._offset = 0;
+        job._eof = length == 0;
+        job._starved = false;
+        job._state = AsyncFTPReadAhead::ACTIVE;
+        _notify();
+        return &job;
+    }
+    return nullptr;
+}
+
+void AsyncFTPIO::finishRead(AsyncFTPReadAhead *job) {
+    job->_state = AsyncFTPReadAhead::CANCELLED;
+    _notify();
+}
+
+void AsyncFTPIO::_notify() {
+    xTaskNotifyGive(_taskHandle);
+}
+
+void AsyncFTPIO::_task(void *arg) {
+    AsyncFTPIO *io = (AsyncFTPIO*)arg;
+    io->_run();
+    xSemaphoreGive(io->_stopped);
+    vTaskDelete(NULL);
+}
+
+void AsyncFTPIO::_run() {
+    while (!_stopping) {
+        // One block per job and round, so a large file cannot hold up the others.
+        bool busy = false;
+        for (AsyncFTPReadAhead &job : _jobs) {
+            uint8_t state = job._state;
+            if (state == AsyncFTPReadAhead::CANCELLED) {
+                job._file.close();
+                job._state = AsyncFTPReadAhead::FREE;
+            }
+            else if (state == AsyncFTPReadAhead::ACTIVE && _fill(job))
+                busy = true;
+        }
+        // Every job is full, finished or free: sleep until the network side
+        // releases a block or starts or cancels a job.
+        if (!busy) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+bool AsyncFTPIO::_fill(AsyncFTPReadAhead &job) {
+    uint32_t head = job._head.load();
+    if (job._remaining == 0 || head - job._tail.load() >= FTP_IO_BLOCKS) return false;
+
+    size_t block = head % FTP_IO_BLOCKS;
+    size_t want = job._remaining < _blockSize ? job._remaining : _blockSize;
+    size_t got = job._file.read(job._blocks + block * _blockSize, want);
+    // A short read means the file ended early or failed; send what there is.
+    job._remaining = got < want ? 0 : job._remaining - got;
+    if (got > 0) {
+        job._length[block] = got;
+        job._head.store(head + 1);
+    }
+    if (job._remaining == 0) job._eof.store(true);
+    if (job._starved.exchange(false)) job._wake(job._wakeArg);
+    return true;
+}
@@ -0,0 +1,96 @@
+#ifndef ASYNCFTPIO_H
+#define ASYNCFTPIO_H
+
+#include "AsyncFTPPort.h"
+#include <atomic>
+
+#ifndef FTP_IO_JOBS
+#define FTP_IO_JOBS 2           // RETRs read ahead at once (0: always read on the network task)
+#endif
+#ifndef FTP_IO_BLOCKS
+#define FTP_IO_BLOCKS 2         // Blocks read ahead per RETR
+#endif
+#ifndef FTP_IO_TASK_PRIORITY
+#define FTP_IO_TASK_PRIORITY 2  // Below the AsyncTCP task, so reads never delay network events
+#endif
+#ifndef FTP_IO_TASK_STACK
+#define FTP_IO_TASK_STACK 4096
+#endif
+#ifndef FTP_IO_TASK_CORE
+#define FTP_IO_TASK_CORE tskNO_AFFINITY
+#endif
+
+class AsyncFTPIO;
+
+// Read-ahead buffers for one RETR: a single-producer/single-consumer ring
+// of FTP_IO_BLOCKS blocks, each as large as the backend's readSize. The I/O task fills blocks from the file; the
+// network side hands them to the socket and releases them.
+class AsyncFTPReadAhead {
+public:
+    // Network side. The next ready bytes, or null if none are ready yet.
+    const uint8_t* peek(size_t& length);
+    // Mark length bytes of the ready data as sent.
+    void consume(size_t length);
+    // Every byte of the file has been consumed.
+    bool done();
+    // Call when peek() returns null and done() is false: asks the I/O task
+    // to call the wake function once more data is ready. Returns false if
+    // data became ready meanwhile, in which case no call is made.
+    bool wait();
+
+private:
+    friend class AsyncFTPIO;
+    enum State : uint8_t { FREE, ACTIVE, CANCELLED };
+
+    std::atomic<uint8_t>  _state{FREE};
+    std::atomic<uint32_t> _head{0};     // blocks filled (I/O task)
+    std::atomic<uint32_t> _tail{0};     // blocks released (network side)
+    std::atomic<bool>     _eof{false};  // set after the last block is filled
+    std::atomic<bool>     _starved{false};
+    size_t    _length[FTP_IO_BLOCKS];
+    size_t    _offset = 0;              // consumed bytes of the tail block
+    uint8_t*  _blocks = nullptr;
+    fs::File  _file;
+    uint32_t  _remaining = 0;           // bytes still to read (I/O task)
+    void    (*_wake)(void*) = nullptr;
+    void*     _wakeArg = nullptr;
+    AsyncFTPIO* _io = nullptr;
+};
+
+// File-I/O task that reads RETR files ahead of the network, so a slow flash
+// or SD read never stalls the AsyncTCP task and overlaps with transmission.
+// Jobs and their buffers are allocated once in begin().
+class AsyncFTPIO {
+public:
+    ~AsyncFTPIO();
+    // blockSize: bytes per read, the backend's readSize.
+    bool begin(size_t blockSize);
+    // Stop the task and close any file it still holds.
+    void end();
+
+    // Network side. Hand file over to the I/O task, which reads its next
+    // length bytes. wake(arg) is called on the I/O task when data becomes
+    // ready after AsyncFTPReadAhead::wait(), so it must not use the
+    // transport; an AsyncFTPPoke gets there. Returns null if every job
+    // is busy; the caller then reads the file itself.
+    AsyncFTPReadAhead* startRead(fs::File& file, uint32_t length, void (*wake)(void*), void* arg);
+    // Give the job back; the I/O task closes its file.
+    void finishRead(AsyncFTPReadAhead* job);
+
+private:
+    friend class AsyncFTPReadAhead;
+    static void _task(void* arg);
+    void _run();
+    // Read one block for the job; returns false if it has no room or nothing left.
+    bool _fill(AsyncFTPReadAhead& job);
+    void _notify();
+
+    AsyncFTPReadAhead _jobs[FTP_IO_JOBS > 0 ? FTP_IO_JOBS : 1];
+    uint8_t*          _memory = nullptr;
+    size_t            _blockSize = 0;
+    TaskHandle_t      _taskHandle = nullptr;
+    SemaphoreHandle_t _stopped = nullptr;
+    std::atomic<bool> _stopping{false};
+};
+
+#endif // ASYNCFTPIO_H
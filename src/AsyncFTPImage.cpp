@@ -0,0 +1,125 @@
+#include "AsyncFTPImage.h"
+#include "AsyncFTPLog.h"
+
+static const char IMAGE_MAGIC[8] = {'F', 'T', 'P', 'I', 'M', 'G', '0', '1'};
+static const size_t IMAGE_HEADER = 16;
+
+// Paths are absolute; the image stores them without the leading '/'.
+static const char* imagePath(const char* path) {
+    while (*path == '/') path++;
+    return path;
+}
+
+static uint32_t readLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+AsyncFTPImage::~AsyncFTPImage() {
+    end();
+}
+
+bool AsyncFTPImage::begin(const char* name) {
+    end();
+    size_t size = 0;
+    uint32_t handle = 0;
+    const uint8_t* data = asyncftpMapPartition(name, size, handle);
+    if (!data) return false;
+    _data = data;
+    _size = size;
+    _handle = handle;
+
+    // Check everything once, so lookups can trust the image. A partition
+    // is usually larger than the image written to it.
+    bool valid = size >= IMAGE_HEADER && memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0;
+    uint32_t count = valid ? readLE32(data + 8) : 0;
+    uint32_t length = valid ? readLE32(data + 12) : 0;
+    valid = valid && length >= IMAGE_HEADER && length <= size && count <= (length - IMAGE_HEADER) / sizeof(Entry) &&
+            ((uintptr_t)data % alignof(Entry)) == 0;
+    _entries = (const Entry*)(data + IMAGE_HEADER);
+    for (uint32_t i = 0; valid && i < count; i++) {
+        const Entry& entry = _entries[i];
+        valid = entry.name < length && memchr(data + entry.name, '\0', length - entry.name) &&
+                entry.data <= length && entry.size <= length - entry.data &&
+                (i == 0 || strcmp((const char*)data + _entries[i - 1].name,
+                                  (const char*)data + entry.name) < 0);
+    }
+    if (!valid) {
+        FTP_LOGW("%s is not a valid FTP image", name);
+        end();
+        return false;
+    }
+    _count = count;
+    return true;
+}
+
+void AsyncFTPImage::end() {
+    if (_data) asyncftpUnmapPartition(_data, _size, _handle);
+    _data = nullptr;
+    _entries = nullptr;
+    _count = 0;
+}
+
+uint32_t AsyncFTPImage::_lowerBound(const char* key) const {
+    uint32_t low = 0, high = _count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (strcmp(_name(mid), key) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+bool AsyncFTPImage::find(const char* path, File& file) const {
+    file = File();
+    path = imagePath(path);
+    uint32_t i = _lowerBound(path);
+    if (i == _count || strcmp(_name(i), path) != 0) return false;
+    file.data = _data + _entries[i].data;
+    file.size = _entries[i].size;
+    file.lastWrite = _entries[i].lastWrite;
+    return true;
+}
+
+bool AsyncFTPImage::isDirectory(const char* path) const {
+    if (!_data) return false;
+    path = imagePath(path);
+    if (!*path) return true;
+    // Paths under path/ sort right after everything less than "path/".
+    char prefix[FTP_IMAGE_PATHMAX + 2];
+    size_t len = strlen(path);
+    if (len > FTP_IMAGE_PATHMAX) return false;
+    memcpy(prefix, path, len);
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+    uint32_t i = _lowerBound(prefix);
+    return i < _count && strncmp(_name(i), prefix, len + 1) == 0;
+}
+
+bool AsyncFTPImage::nextEntry(const char* path, uint32_t& cursor, FTPDirEntry& entry) const {
+    path = imagePath(path);
+    size_t len = strlen(path);
+    if (len > FTP_IMAGE_PATHMAX) return false;
+    char prefix[FTP_IMAGE_PATHMAX + 2];
+    memcpy(prefix, path, len);
+    if (len > 0) prefix[len++] = '/';
+    prefix[len] = '\0';
+    if (cursor == 0) cursor = _lowerBound(prefix);
+    if (cursor >= _count || strncmp(_name(cursor), prefix, len) != 0) return false;
+
+    const char* rest = _name(cursor) + len;
+    const char* slash = strchr(rest, '/');
+    size_t nameLength = slash ? (size_t)(slash - rest) : strlen(rest);
+    entry.name = rest;
+    entry.nameLength = nameLength > 255 ? 255 : (uint8_t)nameLength;
+    entry.isDirectory = slash != nullptr;
+    entry.size = slash ? 0 : _entries[cursor].size;
+    entry.lastWrite = slash ? 0 : _entries[cursor].lastWrite;
+    // A subdirectory's files are contiguous; step over all of them.
+    cursor++;
+    while (slash && cursor < _count) {
+        const char* next = _name(cursor);
+        if (strncmp(next, prefix, len) != 0 || strncmp(next + len, rest, nameLength + 1) != 0) break;
+        cursor++;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef ASYNCFTPIMAGE_H
+#define ASYNCFTPIMAGE_H
+
+#include "AsyncFTPPort.h"
+#include "AsyncFTPDirCache.h"
+
+#define FTP_IMAGE_PATHMAX 256       // Longest directory path looked up in an image
+
+// A read-only file tree in one memory-mapped flash partition (an image
+// file on the host), served with FTP_FS::IMAGE. Files are sent straight
+// from the mapping: no filesystem, no locks and no copies. Build images
+// with extras/mkftpimage.py. The format, all integers little-endian:
+//
+//   header   "FTPIMG01", uint32 entry count, uint32 image length
+//   entries  uint32 name offset, data offset, size, last write (seconds)
+//   names    NUL-terminated paths without a leading '/', in strcmp order
+//   data     file contents
+//
+// Directories are implied by the paths of the files in them.
+class AsyncFTPImage {
+public:
+    ~AsyncFTPImage();
+    // Map the partition (host: file) name; false if it is missing or not
+    // a valid image.
+    bool begin(const char* name);
+    void end();
+    bool mounted() const { return _data != nullptr; }
+
+    struct File {
+        const uint8_t* data = nullptr;      // null: no such file
+        uint32_t size = 0;
+        uint32_t lastWrite = 0;
+    };
+    // Look up the file at the absolute path.
+    bool find(const char* path, File& file) const;
+    bool isDirectory(const char* path) const;
+    // Entries of the directory at the absolute path, one per call; start
+    // with cursor 0. False once there are no more.
+    bool nextEntry(const char* path, uint32_t& cursor, FTPDirEntry& entry) const;
+
+private:
+    struct Entry {
+        uint32_t name, data, size, lastWrite;
+    };
+    const char* _name(uint32_t i) const { return (const char*)_data + _entries[i].name; }
+    // First entry whose name is not less than key.
+    uint32_t _lowerBound(const char* key) const;
+
+    const uint8_t* _data = nullptr;
+    size_t   _size = 0;
+    uint32_t _handle = 0;
+    const Entry* _entries = nullptr;
+    uint32_t _count = 0;
+};
+
+#endif // ASYNCFTPIMAGE_H
@@ -0,0 +1,82 @@
+#include "AsyncFTPLog.h"
+
+AsyncFTPLog::Record AsyncFTPLog::_records[FTP_LOG_RECORDS];
+std::atomic<uint32_t> AsyncFTPLog::_writePos{0};
+uint32_t AsyncFTPLog::_readPos = 0;
+std::atomic<uint32_t> AsyncFTPLog::_dropped{0};
+TaskHandle_t AsyncFTPLog::_taskHandle = nullptr;
+
+// Slot i starts out writable at position i.
+bool AsyncFTPLog::_init() {
+    for (uint32_t i = 0; i < FTP_LOG_RECORDS; i++) _records[i].sequence.store(i);
+    return true;
+}
+bool AsyncFTPLog::_ready = AsyncFTPLog::_init();
+
+void AsyncFTPLog::begin() {
+    if (_taskHandle) return;
+    if (xTaskCreatePinnedToCore(_task, "ftp_log", FTP_LOG_TASK_STACK, nullptr, FTP_LOG_TASK_PRIORITY,
+                                &_taskHandle, tskNO_AFFINITY) != pdPASS)
+        _taskHandle = nullptr;
+}
+
+void AsyncFTPLog::write(uint8_t level, const char *format, ...) {
+    // Claim the slot at the write position, unless the log task has not
+    // read it yet.
+    uint32_t pos = _writePos.load(std::memory_order_relaxed);
+    Record *record;
+    for (;;) {
+        record = &_records[pos % FTP_LOG_RECORDS];
+        int32_t diff = (int32_t)(record->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (_writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+            _dropped++;
+            return;
+        }
+        else
+            pos = _writePos.load(std::memory_order_relaxed);
+    }
+
+    record->level = level;
+    record->time = millis();
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->sequence.store(pos + 1, std::memory_order_release);
+
+    // Waking the task costs more than the message; do it only for bursts.
+    if ((pos + 1) % (FTP_LOG_RECORDS / 2) == 0 && _taskHandle) xTaskNotifyGive(_taskHandle);
+}
+
+uint32_t AsyncFTPLog::dropped() {
+    return _dropped.load();
+}
+
+void AsyncFTPLog::_drain() {
+    static const char levels[] = "-EWID";
+    for (;;) {
+        Record &record = _records[_readPos % FTP_LOG_RECORDS];
+        if (record.sequence.load(std::memory_order_acquire) != _readPos + 1) break;
+        Serial.printf("[%lu.%03lu] %c ftp: %s\n", (unsigned long)(record.time / 1000),
+                      (unsigned long)(record.time % 1000), levels[record.level < 5 ? record.level : 0],
+                      record.text);
+        record.sequence.store(_readPos + FTP_LOG_RECORDS, std::memory_order_release);
+        _readPos++;
+    }
+}
+
+void AsyncFTPLog::_task(void *arg) {
+    uint32_t reportedDrops = 0;
+    for (;;) {
+        _drain();
+        uint32_t drops = _dropped.load();
+        if (drops != reportedDrops) {
+            Serial.printf("ftp: %lu log messages dropped\n", (unsigned long)(drops - reportedDrops));
+            reportedDrops = drops;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(FTP_LOG_INTERVAL));
+    }
+}
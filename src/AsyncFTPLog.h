@@ -0,0 +1,93 @@
+#ifndef ASYNCFTPLOG_H
+#define ASYNCFTPLOG_H
+
+#include "AsyncFTPPort.h"
+#include <atomic>
+
+#define FTP_LOG_NONE    0
+#define FTP_LOG_ERROR   1
+#define FTP_LOG_WARN    2
+#define FTP_LOG_INFO    3
+#define FTP_LOG_DEBUG   4
+
+#ifndef FTP_LOG_LEVEL
+#define FTP_LOG_LEVEL FTP_LOG_INFO  // Messages above this level are compiled out
+#endif
+#ifndef FTP_LOG_RECORDS
+#define FTP_LOG_RECORDS 32          // Messages buffered for the log task (a power of two)
+#endif
+#ifndef FTP_LOG_LINE
+#define FTP_LOG_LINE 96             // Longest message; longer ones are truncated
+#endif
+#ifndef FTP_LOG_INTERVAL
+#define FTP_LOG_INTERVAL 50         // ms between prints of buffered messages
+#endif
+#ifndef FTP_LOG_TASK_PRIORITY
+#define FTP_LOG_TASK_PRIORITY 1     // Only runs when nothing else has work
+#endif
+#ifndef FTP_LOG_TASK_STACK
+#define FTP_LOG_TASK_STACK 3072
+#endif
+
+// Log macros. A disabled level expands to nothing, so its arguments are not
+// even evaluated.
+#if FTP_LOG_LEVEL >= FTP_LOG_ERROR
+#define FTP_LOGE(...) AsyncFTPLog::write(FTP_LOG_ERROR, __VA_ARGS__)
+#else
+#define FTP_LOGE(...) do {} while (0)
+#endif
+#if FTP_LOG_LEVEL >= FTP_LOG_WARN
+#define FTP_LOGW(...) AsyncFTPLog::write(FTP_LOG_WARN, __VA_ARGS__)
+#else
+#define FTP_LOGW(...) do {} while (0)
+#endif
+#if FTP_LOG_LEVEL >= FTP_LOG_INFO
+#define FTP_LOGI(...) AsyncFTPLog::write(FTP_LOG_INFO, __VA_ARGS__)
+#else
+#define FTP_LOGI(...) do {} while (0)
+#endif
+#if FTP_LOG_LEVEL >= FTP_LOG_DEBUG
+#define FTP_LOGD(...) AsyncFTPLog::write(FTP_LOG_DEBUG, __VA_ARGS__)
+#else
+#define FTP_LOGD(...) do {} while (0)
+#endif
+
+// Asynchronous logger. write() formats the message into a slot of a fixed
+// lock-free ring and returns; a low-priority task prints the slots to
+// Serial every FTP_LOG_INTERVAL ms, or as soon as the ring is half full, so
+// a slow or unplugged UART never holds up the network task. When the ring
+// is full messages are dropped and counted, never waited for.
+class AsyncFTPLog {
+public:
+    // Start the log task; messages written before are kept until it runs.
+    static void begin();
+    static void write(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+    // Messages lost because the ring was full.
+    static uint32_t dropped();
+
+private:
+    static_assert((FTP_LOG_RECORDS & (FTP_LOG_RECORDS - 1)) == 0, "FTP_LOG_RECORDS must be a power of two");
+
+    // Bounded multi-producer queue: a slot may be written when its sequence
+    // equals the write position and read when it is one past it.
+    struct Record {
+        std::atomic<uint32_t> sequence;
+        uint8_t  level;
+        uint32_t time;                  // millis()
+        char     text[FTP_LOG_LINE];
+    };
+    static Record _records[FTP_LOG_RECORDS];
+    static std::atomic<uint32_t> _writePos;
+    static uint32_t _readPos;           // log task only
+    static std::atomic<uint32_t> _dropped;
+    static TaskHandle_t _taskHandle;
+    static bool _ready;
+
+    static bool _init();
+
+    static void _task(void* arg);
+    // Print every ready message.
+    static void _drain();
+};
+
+#endif // ASYNCFTPLOG_H
@@ -0,0 +1,106 @@
+#ifndef ASYNCFTPPORT_H
+#define ASYNCFTPPORT_H
+
+// Platform layer for AsyncFTP.
+//
+// The protocol code reaches the outside world only through these interfaces:
+//  - Transport: AsyncClient / AsyncServer from AsyncTCP (onData, onAck,
+//    onPoll, onDisconnect, add/send/space, ackLater/ack, connect, localIP;
+//    server begin/status/setNoDelay).
+//  - Storage: fs::FS / fs::File (open, openNextFile, read, write, seek,
+//    mkdir, rmdir, remove, rename) and the LittleFS and SD filesystem objects
+//    (also totalBytes/usedBytes);
+//    asyncftpMapPartition()/asyncftpUnmapPartition() for read-only images.
+//  - Core: String, IPAddress, Serial, millis()/micros(),
+//    ESP.getFreeHeap()/getMinFreeHeap() and psramFound()/ps_malloc().
+//  - Tasks: the FreeRTOS task, notification and semaphore calls used by the
+//    file-I/O worker (AsyncFTPIO.h), and AsyncFTPPoke, with which another
+//    task has a connection's onPoll handler run on the network task at once
+//    rather than at the next 500 ms tick.
+//
+// On the ESP32 they come from the Arduino core and AsyncTCP. Any other build
+// gets them from AsyncFTPHost.h, the POSIX implementation in extras/host
+// (epoll sockets and a directory-rooted filesystem).
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#include <FS.h>
+#include <LittleFS.h>
+#include <SD.h>
+#include <AsyncTCP.h>
+#include <esp_partition.h>
+#include <lwip/tcpip.h>
+#include <lwip/priv/tcp_priv.h>
+#include <atomic>
+
+// Raise a poll event on one connection from any task. AsyncTCP offers no
+// way to run code on its task, but it turns lwIP's poll callback into an
+// event for that task; fire() has lwIP's own thread call that callback as
+// its 500 ms timer would, so the connection's onPoll handler runs at once.
+// bind() and unbind() belong to the network task. A poke that finds its
+// connection gone, or bound to another client, does nothing.
+class AsyncFTPPoke {
+public:
+    void bind(AsyncClient *client) {
+        _client = client;
+        _pcb = client ? client->pcb() : nullptr;
+    }
+    void unbind() { bind(nullptr); }
+    void fire() {
+        if (!_pcb.load() || _pending.exchange(true)) return;
+        // With lwIP's message pool exhausted, the periodic poll still comes.
+        if (tcpip_callback(_run, this) != ERR_OK) _pending = false;
+    }
+
+private:
+    // On lwIP's thread, where the list of connections is stable.
+    static void _run(void *arg) {
+        AsyncFTPPoke *poke = (AsyncFTPPoke *)arg;
+        poke->_pending = false;
+        tcp_pcb *target = poke->_pcb;
+        for (tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next) {
+            if (pcb != target) continue;
+            if (pcb->callback_arg == poke->_client.load() && pcb->poll) pcb->poll(pcb->callback_arg, pcb);
+            break;
+        }
+    }
+
+    std::atomic<AsyncClient *> _client{nullptr};
+    std::atomic<tcp_pcb *> _pcb{nullptr};
+    std::atomic<bool> _pending{false};
+};
+
+// Map the data partition labelled name into the address space, read-only.
+// Returns its address and sets size, or returns null; handle is for
+// asyncftpUnmapPartition().
+inline const uint8_t *asyncftpMapPartition(const char *name, size_t &size, uint32_t &handle) {
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (!partition) return nullptr;
+    const void *data = nullptr;
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_partition_mmap_handle_t mapping;
+    if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA,
+                           &data, &mapping) != ESP_OK) return nullptr;
+#else
+    spi_flash_mmap_handle_t mapping;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA,
+                           &data, &mapping) != ESP_OK) return nullptr;
+#endif
+    size = partition->size;
+    handle = mapping;
+    return (const uint8_t *)data;
+}
+
+inline void asyncftpUnmapPartition(const uint8_t *data, size_t size, uint32_t handle) {
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_partition_munmap(handle);
+#else
+    spi_flash_munmap(handle);
+#endif
+}
+#else
+#include <AsyncFTPHost.h>
+#endif
+
+#endif // ASYNCFTPPORT_H
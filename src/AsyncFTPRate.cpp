@@ -0,0 +1,25 @@
+#include "AsyncFTPRate.h"
+
+size_t AsyncFTPTokenBucket::available(uint32_t rate, size_t want) {
+    if (rate == 0) return want;
+    uint32_t now = millis();
+    // At least one full-size segment, or a low limit would never send one.
+    uint64_t capacity = (uint64_t)rate * FTP_RATE_BURST;
+    if (capacity < 1460 * 1000) capacity = 1460 * 1000;
+    if (_full) {
+        _full = false;
+        _milliTokens = capacity;
+    }
+    else {
+        _milliTokens += (uint64_t)rate * (uint32_t)(now - _last);
+        if (_milliTokens > capacity) _milliTokens = capacity;
+    }
+    _last = now;
+    uint64_t tokens = _milliTokens / 1000;
+    return tokens < want ? (size_t)tokens : want;
+}
+
+void AsyncFTPTokenBucket::take(size_t len) {
+    uint64_t milli = (uint64_t)len * 1000;
+    _milliTokens = milli < _milliTokens ? _milliTokens - milli : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef ASYNCFTPRATE_H
+#define ASYNCFTPRATE_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_SEND_QUANTUM
+#define FTP_SEND_QUANTUM 2920       // Bytes a transfer may queue per turn while others run (two segments)
+#endif
+#ifndef FTP_RATE_BURST
+#define FTP_RATE_BURST 500          // Milliseconds of a rate limit that may be sent at once
+#endif
+
+// Token bucket for a rate limit: one per session, and one the server's
+// transfers share. Tokens accrue at the rate given on each call, so a limit
+// that changes takes effect at once. The bucket starts full and holds
+// FTP_RATE_BURST ms worth, enough to carry a throttled transfer from one
+// AsyncTCP poll (every 500 ms) to the next.
+class AsyncFTPTokenBucket {
+public:
+    // Bytes that may be sent now at rate bytes per second (0: unlimited),
+    // at most want.
+    size_t available(uint32_t rate, size_t want);
+    // Account for bytes sent after available().
+    void take(size_t len);
+
+private:
+    uint64_t _milliTokens = 0;      // bytes * 1000, for sub-byte accrual per ms
+    uint32_t _last = 0;             // millis() of the last refill
+    bool     _full = true;
+};
+
+#endif // ASYNCFTPRATE_H
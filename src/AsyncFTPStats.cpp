@@ -0,0 +1,26 @@
+#include "AsyncFTPStats.h"
+
+void FTPHistogram::add(uint32_t value) {
+    uint8_t bucket = 0;
+    for (uint32_t v = value; v && bucket < BUCKETS - 1; v >>= 1) bucket++;
+    buckets[bucket]++;
+    count++;
+    sum += value;
+    if (value > max) max = value;
+}
+
+uint32_t FTPHistogram::percentile(uint8_t percent) const {
+    if (count == 0) return 0;
+    uint64_t rank = ((uint64_t)count * percent + 99) / 100;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (uint8_t i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            if (i == BUCKETS - 1) return max;
+            uint32_t bound = ((uint32_t)1 << i) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
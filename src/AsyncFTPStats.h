@@ -0,0 +1,84 @@
+#ifndef ASYNCFTPSTATS_H
+#define ASYNCFTPSTATS_H
+
+#include "AsyncFTPPort.h"
+#include <functional>
+
+#ifndef FTP_STATS_COMMANDS
+#define FTP_STATS_COMMANDS 48   // Command slots in AsyncFTPStats; the last counts unknown verbs
+#endif
+
+// Log2 histogram of 32-bit samples. Bucket 0 counts zeros and bucket i
+// values in [2^(i-1), 2^i); the last bucket also takes anything larger.
+struct FTPHistogram {
+    static const uint8_t BUCKETS = 24;
+    uint32_t count = 0;
+    uint32_t max = 0;
+    uint64_t sum = 0;
+    uint32_t buckets[BUCKETS] = {};
+
+    void add(uint32_t value);
+    uint32_t mean() const { return count ? (uint32_t)(sum / count) : 0; }
+    // Upper bound of the bucket holding the given percentile (0-100), at
+    // most max. Exact to within a factor of two.
+    uint32_t percentile(uint8_t percent) const;
+};
+
+// Server-wide counters, as returned by AsyncFTP::getStats(). Byte counts
+// are data connection payload; control traffic is not included.
+struct AsyncFTPStats {
+    uint32_t uptime = 0;                    // ms since begin()
+    uint32_t connections = 0;               // control connections accepted
+    uint32_t rejectedConnections = 0;       // refused with 421, every session busy
+    uint32_t rejectedDataConnections = 0;   // passive connections nobody was waiting for
+    uint8_t  sessions = 0;                  // open now
+    uint8_t  maxSessions = 0;
+    uint64_t bytesIn = 0;                   // uploads
+    uint64_t bytesOut = 0;                  // downloads and listings
+    uint32_t transfers = 0;                 // ended with 226
+    uint32_t failedTransfers = 0;           // ended with an error reply or aborted
+    FTPHistogram transferTime;              // ms, data command to final reply
+    FTPHistogram throughput;                // KB/s of each successful transfer
+    FTPHistogram passiveWait;               // us, PASV/EPSV reply to data connection
+    FTPHistogram serviceTime;               // us, spent handling each command
+    uint32_t freeHeap = 0;
+    uint32_t minFreeHeap = 0;               // low-water mark since boot
+    uint32_t heapBudget = 0;                // setHeapBudget(); 0: none
+    uint32_t heapReserved = 0;              // by open sessions and transfers
+    uint32_t heapReservedPeak = 0;
+    uint32_t lowMemoryConnections = 0;      // refused with 421, not enough heap
+    uint32_t lowMemoryTransfers = 0;        // refused with 425 or 452, not enough heap
+
+    struct Command {
+        char     verb[5] = "";
+        uint32_t count = 0;
+        uint32_t maxTime = 0;               // us
+        uint64_t totalTime = 0;             // us
+    };
+    uint8_t  commandCount = 0;              // entries used in commands
+    Command  commands[FTP_STATS_COMMANDS];
+};
+
+// Counters of one open session, from AsyncFTP::getSessionStats().
+struct AsyncFTPSessionStats {
+    IPAddress remoteIP;
+    uint32_t connected = 0;                 // ms since the session opened
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint32_t commands = 0;
+    uint32_t transfers = 0;                 // data commands, successful or not
+};
+
+// One finished data transfer, passed to the AsyncFTP::onTransfer() callback.
+struct AsyncFTPTransfer {
+    const char* command;                    // "RETR", "STOR", "APPE", "LIST" or "MLSD"
+    const char* path;                       // absolute; the directory for LIST and MLSD
+    uint8_t  session;                       // index, as for getSessionStats()
+    bool     ok;                            // ended with 226
+    uint32_t bytes;
+    uint32_t duration;                      // ms
+};
+
+typedef std::function<void(const AsyncFTPTransfer& transfer)> AsyncFTPTransferHandler;
+
+#endif // ASYNCFTPSTATS_H
@@ -0,0 +1,339 @@
+#include "AsyncFTPTar.h"
+#include "AsyncFTPLog.h"
+
+// ustar header layout (POSIX.1-1988).
+static const size_t TAR_NAME = 0, TAR_NAME_SIZE = 100;
+static const size_t TAR_MODE = 100;
+static const size_t TAR_UID = 108;
+static const size_t TAR_GID = 116;
+static const size_t TAR_SIZE = 124;
+static const size_t TAR_MTIME = 136;
+static const size_t TAR_CHECKSUM = 148;
+static const size_t TAR_TYPE = 156;
+static const size_t TAR_MAGIC = 257;
+static const size_t TAR_PREFIX = 345, TAR_PREFIX_SIZE = 155;
+
+static unsigned headerChecksum(const uint8_t *header) {
+    // The checksum field itself counts as spaces.
+    unsigned sum = 8 * ' ';
+    for (size_t i = 0; i < AsyncFTPTarWriter::BLOCK; i++) {
+        if (i < TAR_CHECKSUM || i >= TAR_CHECKSUM + 8) sum += header[i];
+    }
+    return sum;
+}
+
+static void fillHeader(uint8_t *header, const char *name, size_t nameLength, const char *prefix,
+                       size_t prefixLength, char type, uint32_t size, uint32_t lastWrite) {
+    memset(header, 0, AsyncFTPTarWriter::BLOCK);
+    memcpy(header + TAR_NAME, name, nameLength < TAR_NAME_SIZE ? nameLength : TAR_NAME_SIZE);
+    snprintf((char*)header + TAR_MODE, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char*)header + TAR_UID, 8, "%07o", 0);
+    snprintf((char*)header + TAR_GID, 8, "%07o", 0);
+    snprintf((char*)header + TAR_SIZE, 12, "%011o", (unsigned)size);
+    snprintf((char*)header + TAR_MTIME, 12, "%011o", (unsigned)lastWrite);
+    header[TAR_TYPE] = type;
+    memcpy(header + TAR_MAGIC, "ustar\0" "00", 8);
+    memcpy(header + TAR_PREFIX, prefix, prefixLength);
+    snprintf((char*)header + TAR_CHECKSUM, 7, "%06o", headerChecksum(header));
+    header[TAR_CHECKSUM + 7] = ' ';
+}
+
+//---------------------------------------------------------------------
+// AsyncFTPTarWriter
+//---------------------------------------------------------------------
+
+bool AsyncFTPTarWriter::begin(fs::File &dir, const char *base) {
+    size_t length = strlen(base);
+    if (!dir || length + 1 > FTP_TAR_PATHMAX) return false;
+    memcpy(_path, base, length);
+    if (length > 0) _path[length++] = '/';
+    _path[length] = '\0';
+    _dirs[0] = dir;
+    _pathLength[0] = length;
+    _depth = 1;
+    _rootPending = length > 0;
+    _remaining = 0;
+    _zeros = 0;
+    _finished = false;
+    return true;
+}
+
+void AsyncFTPTarWriter::end() {
+    _file.close();
+    while (_depth > 0) _dirs[--_depth].close();
+}
+
+size_t AsyncFTPTarWriter::_header(uint8_t *out, const char *path, size_t pathLength, bool directory,
+                                  uint32_t size, uint32_t lastWrite) {
+    char type = directory ? '5' : '0';
+    if (pathLength <= TAR_NAME_SIZE) {
+        fillHeader(out, path, pathLength, "", 0, type, size, lastWrite);
+        return BLOCK;
+    }
+    // Split at a '/' so that the name part fits in 100 characters and the
+    // prefix in 155; the slash itself is implied.
+    for (size_t i = pathLength - TAR_NAME_SIZE - 1; i <= TAR_PREFIX_SIZE && i + 1 < pathLength; i++) {
+        if (path[i] != '/') continue;
+        fillHeader(out, path + i + 1, pathLength - i - 1, path, i, type, size, lastWrite);
+        return BLOCK;
+    }
+    // No such slash: a GNU long-name entry carries the whole path.
+    fillHeader(out, "././@LongLink", 13, "", 0, 'L', pathLength + 1, 0);
+    memset(out + BLOCK, 0, BLOCK);
+    memcpy(out + BLOCK, path, pathLength);
+    fillHeader(out + 2 * BLOCK, path, pathLength, "", 0, type, size, lastWrite);
+    return 3 * BLOCK;
+}
+
+size_t AsyncFTPTarWriter::read(uint8_t *buffer, size_t size) {
+    size_t len = 0;
+    while (len < size) {
+        if (_zeros > 0) {
+            size_t n = _zeros < size - len ? _zeros : size - len;
+            memset(buffer + len, 0, n);
+            len += n;
+            _zeros -= n;
+            continue;
+        }
+        if (_file) {
+            size_t n = _file.read(buffer + len, _remaining < size - len ? _remaining : size - len);
+            if (n == 0) {
+                // Shrunk since its header went out: keep the archive readable.
+                FTP_LOGW("tar: %s ended early", _file.name());
+                _zeros += _remaining;
+                _remaining = 0;
+            }
+            len += n;
+            _remaining -= n;
+            if (_remaining == 0) {
+                _file.close();
+                _zeros += _pad;
+            }
+            continue;
+        }
+        if (_finished || size - len < MIN_BUFFER) break;
+
+        if (_rootPending) {
+            _rootPending = false;
+            len += _header(buffer + len, _path, _pathLength[0], true, 0, (uint32_t)_dirs[0].getLastWrite());
+            continue;
+        }
+        if (_depth == 0) {
+            // Two zero blocks end the archive.
+            _finished = true;
+            _zeros = 2 * BLOCK;
+            continue;
+        }
+        fs::File entry = _dirs[_depth - 1].openNextFile();
+        if (!entry) {
+            _dirs[--_depth].close();
+            continue;
+        }
+        // Older cores return the full path from name().
+        const char *name = entry.name();
+        const char *slash = strrchr(name, '/');
+        if (slash) name = slash + 1;
+        size_t base = _pathLength[_depth - 1];
+        size_t nameLength = strlen(name);
+        bool directory = entry.isDirectory();
+        if (base + nameLength + 1 > FTP_TAR_PATHMAX) {
+            FTP_LOGW("tar: %s left out, path too long", name);
+            continue;
+        }
+        memcpy(_path + base, name, nameLength);
+        size_t pathLength = base + nameLength;
+        if (directory) _path[pathLength++] = '/';
+        _path[pathLength] = '\0';
+
+        uint32_t fileSize = directory ? 0 : entry.size();
+        len += _header(buffer + len, _path, pathLength, directory, fileSize, (uint32_t)entry.getLastWrite());
+        if (directory) {
+            if (_depth <= FTP_TAR_DEPTH) {
+                _dirs[_depth] = entry;
+                _pathLength[_depth] = pathLength;
+                _depth++;
+            }
+            else
+                FTP_LOGW("tar: contents of %s left out, more than %u levels deep", _path, FTP_TAR_DEPTH);
+        }
+        else if (fileSize > 0) {
+            _file = entry;
+            _remaining = fileSize;
+            _pad = (BLOCK - fileSize % BLOCK) % BLOCK;
+        }
+    }
+    return len;
+}
+
+//---------------------------------------------------------------------
+// AsyncFTPTarReader
+//---------------------------------------------------------------------
+
+// Parse an octal header field; false if it holds anything else.
+static bool parseOctal(const uint8_t *field, size_t size, uint32_t &value) {
+    size_t i = 0;
+    while (i < size && field[i] == ' ') i++;
+    uint64_t result = 0;
+    for (; i < size && field[i] != '\0' && field[i] != ' '; i++) {
+        if (field[i] < '0' || field[i] > '7') return false;
+        result = result * 8 + (field[i] - '0');
+        if (result > UINT32_MAX) return false;
+    }
+    value = (uint32_t)result;
+    return true;
+}
+
+// Copy the length bytes of src into out (FTP_TAR_PATHMAX + 1 bytes) as a
+// relative path: no leading '/', no "." or empty segments, no trailing '/'.
+// False if it has a ".." segment, is empty or is too long.
+static bool cleanPath(const char *src, size_t length, char *out) {
+    size_t len = 0;
+    const char *end = src + length;
+    while (src < end) {
+        while (src < end && *src == '/') src++;
+        const char *segment = src;
+        while (src < end && *src != '/') src++;
+        size_t segmentLength = src - segment;
+        if (segmentLength == 0 || (segmentLength == 1 && segment[0] == '.')) continue;
+        if (segmentLength == 2 && segment[0] == '.' && segment[1] == '.') return false;
+        if (len + (len > 0) + segmentLength > FTP_TAR_PATHMAX) return false;
+        if (len > 0) out[len++] = '/';
+        memcpy(out + len, segment, segmentLength);
+        len += segmentLength;
+    }
+    out[len] = '\0';
+    return len > 0;
+}
+
+void AsyncFTPTarReader::begin() {
+    _state = HEADER;
+    _fill = 0;
+    _remaining = 0;
+    _skip = 0;
+    _haveLongName = false;
+    _path[0] = '\0';
+}
+
+AsyncFTPTarReader::Result AsyncFTPTarReader::parse(const uint8_t *data, size_t len, size_t &used) {
+    used = 0;
+    while (used < len) {
+        switch (_state) {
+            case HEADER: {
+                size_t n = AsyncFTPTarWriter::BLOCK - _fill;
+                if (n > len - used) n = len - used;
+                memcpy(_block + _fill, data + used, n);
+                _fill += n;
+                used += n;
+                if (_fill < AsyncFTPTarWriter::BLOCK) break;
+                _fill = 0;
+                Result result = _parseHeader();
+                if (result != MORE) return result;
+                break;
+            }
+            case DATA_BYTES: {
+                // File bytes are handed out in place, from the start of the input.
+                if (used > 0) return MORE;
+                used = _remaining < len ? _remaining : len;
+                _remaining -= used;
+                if (_remaining == 0) {
+                    _skip = _pad;
+                    _state = _skip ? SKIP : HEADER;
+                }
+                return DATA;
+            }
+            case LONGNAME: {
+                size_t n = _remaining < len - used ? _remaining : len - used;
+                for (size_t i = 0; i < n; i++) {
+                    if (_longLength < FTP_TAR_PATHMAX) _longName[_longLength++] = (char)data[used + i];
+                }
+                used += n;
+                _remaining -= n;
+                if (_remaining == 0) {
+                    // The name is NUL-terminated within its data.
+                    _longName[_longLength] = '\0';
+                    _longLength = strlen(_longName);
+                    _haveLongName = true;
+                    _skip = _pad;
+                    _state = _skip ? SKIP : HEADER;
+                }
+                break;
+            }
+            case SKIP: {
+                size_t n = _skip < len - used ? _skip : len - used;
+                used += n;
+                _skip -= n;
+                if (_skip == 0) _state = HEADER;
+                break;
+            }
+            case DONE:
+                used = len;
+                return END;
+        }
+    }
+    return MORE;
+}
+
+AsyncFTPTarReader::Result AsyncFTPTarReader::_parseHeader() {
+    bool empty = true;
+    for (size_t i = 0; i < AsyncFTPTarWriter::BLOCK && empty; i++) empty = _block[i] == 0;
+    if (empty) {
+        _state = DONE;
+        return END;
+    }
+    uint32_t checksum, size, lastWrite = 0;
+    if (!parseOctal(_block + TAR_CHECKSUM, 8, checksum) || checksum != headerChecksum(_block) ||
+        !parseOctal(_block + TAR_SIZE, 12, size)) {
+        _state = DONE;
+        return INVALID;
+    }
+    parseOctal(_block + TAR_MTIME, 12, lastWrite);
+    char type = (char)_block[TAR_TYPE];
+    _pad = (AsyncFTPTarWriter::BLOCK - size % AsyncFTPTarWriter::BLOCK) % AsyncFTPTarWriter::BLOCK;
+
+    if (type == 'L') {
+        _longLength = 0;
+        _remaining = size;
+        _state = size ? LONGNAME : HEADER;
+        return MORE;
+    }
+
+    // The path: a preceding long name, or the ustar prefix and name.
+    char raw[TAR_PREFIX_SIZE + 1 + TAR_NAME_SIZE + 1];
+    const char *name = raw;
+    size_t nameLength = 0;
+    if (_haveLongName) {
+        name = _longName;
+        nameLength = _longLength;
+    }
+    else {
+        if (memcmp(_block + TAR_MAGIC, "ustar", 5) == 0 && _block[TAR_PREFIX]) {
+            nameLength = strnlen((const char*)_block + TAR_PREFIX, TAR_PREFIX_SIZE);
+            memcpy(raw, _block + TAR_PREFIX, nameLength);
+            raw[nameLength++] = '/';
+        }
+        size_t length = strnlen((const char*)_block + TAR_NAME, TAR_NAME_SIZE);
+        memcpy(raw + nameLength, _block + TAR_NAME, length);
+        nameLength += length;
+    }
+    _haveLongName = false;
+
+    bool file = type == '0' || type == '\0' || type == '7';
+    _directory = type == '5' || (file && nameLength > 0 && name[nameLength - 1] == '/');
+    if ((!file && !_directory) || !cleanPath(name, nameLength, _path)) {
+        // Not something we unpack: skip its data, if any.
+        _skip = size + _pad;
+        _state = _skip ? SKIP : HEADER;
+        return MORE;
+    }
+    _size = _directory ? 0 : size;
+    _lastWrite = lastWrite;
+    if (_directory || size == 0) {
+        _skip = size + _pad;
+        _state = _skip ? SKIP : HEADER;
+    }
+    else {
+        _remaining = size;
+        _state = DATA_BYTES;
+    }
+    return ENTRY;
+}
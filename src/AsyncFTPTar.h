@@ -0,0 +1,91 @@
+#ifndef ASYNCFTPTAR_H
+#define ASYNCFTPTAR_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_TAR_DEPTH
+#define FTP_TAR_DEPTH 8             // Directory levels archived below the requested one
+#endif
+#define FTP_TAR_PATHMAX 256         // Longest path inside an archive
+
+// Streams a directory tree as a ustar archive, a buffer at a time, without
+// a temporary file. Only one directory per level is open at once, so the
+// memory used is fixed; directories deeper than FTP_TAR_DEPTH are left out.
+// Paths longer than ustar's 100 (or prefix and name) characters get a GNU
+// long-name entry, which every common tar reads.
+class AsyncFTPTarWriter {
+public:
+    static const size_t BLOCK = 512;
+    // read() emits a header only when the long-name entry, its name and the
+    // header itself fit, so buffers must hold at least this much.
+    static const size_t MIN_BUFFER = 3 * BLOCK;
+
+    // Archive the open directory dir, storing its entries under base/ (at
+    // the top level if base is empty). dir stays open until end().
+    bool begin(fs::File& dir, const char* base);
+    // Write the next bytes of the archive into buffer; returns 0 at the end.
+    size_t read(uint8_t* buffer, size_t size);
+    void end();
+
+private:
+    // Write the header(s) for one entry; returns their length.
+    size_t _header(uint8_t* out, const char* path, size_t pathLength, bool directory,
+                   uint32_t size, uint32_t lastWrite);
+
+    fs::File _dirs[FTP_TAR_DEPTH + 1];
+    uint16_t _pathLength[FTP_TAR_DEPTH + 1]; // length of _path at each open level
+    uint8_t  _depth = 0;                     // open directories
+    char     _path[FTP_TAR_PATHMAX + 1];     // archive path of the innermost directory, with '/'
+    bool     _rootPending = false;           // base/ itself still needs its header
+    fs::File _file;                          // file whose contents are being sent
+    uint32_t _remaining = 0;                 // of _file
+    uint16_t _pad = 0;                       // zeros after _file's contents
+    uint32_t _zeros = 0;                     // padding still to send
+    bool     _finished = false;              // the end-of-archive blocks are queued
+};
+
+// Parses a tar stream fed in arbitrary pieces, for unpacking uploads.
+// Regular files and directories are reported; links, devices and pax
+// headers are skipped, as are entries whose path would leave the archive
+// (absolute paths are taken as relative, ".." is refused).
+class AsyncFTPTarReader {
+public:
+    enum Result : uint8_t {
+        MORE,       // used bytes consumed; feed the rest
+        ENTRY,      // a file or directory starts: see path(), isDirectory(), size()
+        DATA,       // the first used bytes of the input belong to the current file
+        END,        // end of archive; anything after it is ignored
+        INVALID     // not a tar stream (bad header checksum)
+    };
+
+    void begin();
+    // Parse the next len bytes. Sets used to the bytes consumed, which is
+    // less than len when a result has to be handled first.
+    Result parse(const uint8_t* data, size_t len, size_t& used);
+
+    const char* path() const        { return _path; }
+    bool        isDirectory() const { return _directory; }
+    uint32_t    size() const        { return _size; }
+    uint32_t    lastWrite() const   { return _lastWrite; }
+    bool        finished() const    { return _state == DONE; }
+
+private:
+    enum State : uint8_t { HEADER, DATA_BYTES, SKIP, LONGNAME, DONE };
+    Result _parseHeader();
+
+    State    _state = HEADER;
+    uint8_t  _block[AsyncFTPTarWriter::BLOCK];
+    size_t   _fill = 0;                      // bytes in _block
+    uint32_t _remaining = 0;                 // file or long-name bytes still to come
+    uint32_t _skip = 0;                      // bytes to drop before the next header
+    uint16_t _pad = 0;                       // padding after the current data
+    char     _path[FTP_TAR_PATHMAX + 1];
+    char     _longName[FTP_TAR_PATHMAX + 1];
+    uint16_t _longLength = 0;
+    bool     _haveLongName = false;
+    bool     _directory = false;
+    uint32_t _size = 0;
+    uint32_t _lastWrite = 0;
+};
+
+#endif // ASYNCFTPTAR_H
@@ -0,0 +1,937 @@
+#include "AsyncFTPZlib.h"
+
+// RFC 1951 tables.
+static const uint16_t LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t CODELEN_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const uint32_t MIN_MATCH = 3;
+static const uint32_t MAX_MATCH = 258;
+static const uint32_t MIN_LOOKAHEAD = MAX_MATCH + MIN_MATCH + 1;
+static const uint32_t TOO_FAR = 4096;       // a 3-byte match further back than this costs more than it saves
+static const uint32_t ADLER_BASE = 65521;
+static const uint32_t ADLER_NMAX = 5552;    // bytes before the Adler-32 sums can overflow
+
+static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t s1 = adler & 0xFFFF, s2 = adler >> 16;
+    while (len) {
+        size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+        len -= n;
+        while (n--) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+    return (s2 << 16) | s1;
+}
+
+static inline uint8_t highBit(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+// Index into LENGTH_BASE for a match length.
+static inline uint8_t lengthCode(uint32_t length) {
+    if (length == MAX_MATCH) return 28;
+    uint32_t x = length - MIN_MATCH;
+    if (x < 8) return x;
+    uint8_t n = highBit(x);
+    return 4 * (n - 1) + ((x >> (n - 2)) & 3);
+}
+
+// Index into DIST_BASE for a distance.
+static inline uint8_t distCode(uint32_t dist) {
+    uint32_t x = dist - 1;
+    if (x < 2) return x;
+    uint8_t n = highBit(x);
+    return 2 * n + ((x >> (n - 1)) & 1);
+}
+
+static inline uint8_t fixedLitLength(int sym) {
+    return sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+}
+
+//---------------------------------------------------------------------
+// Huffman code construction for the compressor
+//---------------------------------------------------------------------
+
+// Code lengths of at most maxBits for the symbols' frequencies. At least two
+// symbols always get a code, as some decoders reject a single-code tree.
+static void buildLengths(const uint16_t *freq, int n, uint8_t *lengths, uint8_t maxBits) {
+    uint16_t syms[286];
+    uint32_t key[286];
+    int used = 0;
+    memset(lengths, 0, n);
+    for (int i = 0; i < n; i++) {
+        if (!freq[i]) continue;
+        // Insertion sort by frequency; there are at most a few hundred.
+        int j = used++;
+        while (j > 0 && freq[syms[j - 1]] > freq[i]) {
+            syms[j] = syms[j - 1];
+            j--;
+        }
+        syms[j] = i;
+    }
+    if (used < 2) {
+        lengths[0] = lengths[1] = 1;
+        if (used == 1 && syms[0] > 1) lengths[syms[0]] = 1, lengths[1] = 0;
+        return;
+    }
+
+    // Moffat and Katajainen's in-place minimum-redundancy code lengths.
+    for (int i = 0; i < used; i++) key[i] = freq[syms[i]];
+    int root = 0, leaf = 2, next;
+    key[0] += key[1];
+    for (next = 1; next < used - 1; next++) {
+        if (leaf >= used || key[root] < key[leaf]) {
+            key[next] = key[root];
+            key[root++] = next;
+        } else {
+            key[next] = key[leaf++];
+        }
+        if (leaf >= used || (root < next && key[root] < key[leaf])) {
+            key[next] += key[root];
+            key[root++] = next;
+        } else {
+            key[next] += key[leaf++];
+        }
+    }
+    key[used - 2] = 0;
+    for (next = used - 3; next >= 0; next--) key[next] = key[key[next]] + 1;
+    int avail = 1, usedNodes = 0, depth = 0;
+    root = used - 2;
+    next = used - 1;
+    while (avail > 0) {
+        while (root >= 0 && (int)key[root] == depth) {
+            usedNodes++;
+            root--;
+        }
+        while (avail > usedNodes) {
+            key[next--] = depth;
+            avail--;
+        }
+        avail = 2 * usedNodes;
+        depth++;
+        usedNodes = 0;
+    }
+
+    // Limit the depth, keeping the code complete (Kraft sum of exactly 1).
+    uint16_t count[33] = {0};
+    for (int i = 0; i < used; i++) count[key[i] > 32 ? 32 : key[i]]++;
+    for (int i = maxBits + 1; i <= 32; i++) {
+        count[maxBits] += count[i];
+        count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = maxBits; i > 0; i--) total += (uint32_t)count[i] << (maxBits - i);
+    while (total != (1u << maxBits)) {
+        count[maxBits]--;
+        for (int i = maxBits - 1; i > 0; i--) {
+            if (count[i]) {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    // The most frequent symbols get the shortest codes.
+    for (int bits = 1, j = used; bits <= maxBits; bits++)
+        for (int k = count[bits]; k > 0; k--) lengths[syms[--j]] = bits;
+}
+
+// Canonical codes, bit-reversed since deflate sends them LSB first.
+static void buildCodes(const uint8_t *lengths, int n, uint16_t *codes) {
+    uint16_t count[16] = {0}, next[16];
+    for (int i = 0; i < n; i++) count[lengths[i]]++;
+    count[0] = 0;
+    uint16_t code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        uint8_t len = lengths[i];
+        if (!len) continue;
+        uint16_t c = next[len]++, r = 0;
+        for (uint8_t b = 0; b < len; b++, c >>= 1) r = (r << 1) | (c & 1);
+        codes[i] = r;
+    }
+}
+
+// Run-length encode the literal/length and distance code lengths into the
+// code length alphabet (16: repeat previous, 17/18: runs of zeros).
+// Returns the number of symbols; extra holds each one's repeat bits.
+static int encodeLengths(const uint8_t *lengths, int n, uint8_t *syms, uint8_t *extra) {
+    int count = 0;
+    for (int i = 0; i < n;) {
+        uint8_t len = lengths[i];
+        int run = 1;
+        while (i + run < n && lengths[i + run] == len) run++;
+        i += run;
+        if (len == 0) {
+            while (run >= 11) {
+                int r = run < 138 ? run : 138;
+                syms[count] = 18, extra[count++] = r - 11;
+                run -= r;
+            }
+            if (run >= 3) {
+                syms[count] = 17, extra[count++] = run - 3;
+                run = 0;
+            }
+        } else {
+            syms[count] = len, extra[count++] = 0;
+            run--;
+            while (run >= 3) {
+                int r = run < 6 ? run : 6;
+                syms[count] = 16, extra[count++] = r - 3;
+                run -= r;
+            }
+        }
+        while (run-- > 0) syms[count] = len, extra[count++] = 0;
+    }
+    return count;
+}
+
+//---------------------------------------------------------------------
+// AsyncFTPDeflate
+//---------------------------------------------------------------------
+
+struct DeflateConfig {
+    uint16_t good;      // shorten the search when the previous match is this long
+    uint16_t maxLazy;   // do not look for a better match beyond this length
+    uint16_t nice;      // stop the search at a match this long
+    uint16_t chain;     // hash chain steps per search
+    bool     lazy;
+};
+
+// zlib's tuning, so levels mean what users expect.
+static const DeflateConfig LEVELS[10] = {
+    {0, 0, 0, 0, false},
+    {4, 4, 8, 4, false},
+    {4, 5, 16, 8, false},
+    {4, 6, 32, 32, false},
+    {4, 4, 16, 16, true},
+    {8, 16, 32, 32, true},
+    {8, 16, 128, 128, true},
+    {8, 32, 128, 256, true},
+    {32, 128, 258, 1024, true},
+    {32, 258, 258, 4096, true},
+};
+
+AsyncFTPDeflate::~AsyncFTPDeflate() {
+    free(_memory);
+}
+
+size_t AsyncFTPDeflate::_buffers(uint8_t windowBits) {
+    size_t wsize = (size_t)1 << windowBits;
+    size_t symMax = wsize / 2;
+    size_t outSize = wsize + 64;
+    return 2 * wsize + wsize * sizeof(uint16_t) + (sizeof(uint16_t) << (windowBits - 1)) +
+           symMax * (sizeof(uint16_t) + 1) + outSize;
+}
+
+size_t AsyncFTPDeflate::memory(uint8_t windowBits) {
+    if (windowBits < 9) windowBits = 9;
+    if (windowBits > 15) windowBits = 15;
+    return sizeof(AsyncFTPDeflate) + _buffers(windowBits);
+}
+
+bool AsyncFTPDeflate::begin(uint8_t level, uint8_t windowBits) {
+    if (level > 9) level = 9;
+    if (windowBits < 9) windowBits = 9;
+    if (windowBits > 15) windowBits = 15;
+    _level = level;
+    _good = LEVELS[level].good;
+    _maxLazy = LEVELS[level].maxLazy;
+    _nice = LEVELS[level].nice;
+    _maxChain = LEVELS[level].chain;
+    _lazy = LEVELS[level].lazy;
+
+    _windowBits = windowBits;
+    _wsize = 1u << windowBits;
+    _hashBits = windowBits - 1;
+    _symMax = _wsize / 2;
+    // A block's raw bytes stay below the window, so a stored block (the
+    // worst case) fits the output buffer and its bytes are still in memory.
+    _blockMax = _wsize - MIN_LOOKAHEAD;
+    free(_memory);
+    _memory = (uint8_t*)malloc(_buffers(windowBits));
+    if (!_memory) return false;
+    uint8_t *p = _memory;
+    _prev = (uint16_t*)p;     p += _wsize * sizeof(uint16_t);
+    _head = (uint16_t*)p;     p += sizeof(uint16_t) << _hashBits;
+    _symDist = (uint16_t*)p;  p += _symMax * sizeof(uint16_t);
+    _window = p;              p += 2 * _wsize;
+    _symLit = p;              p += _symMax;
+    _out = p;
+    memset(_head, 0, sizeof(uint16_t) << _hashBits);
+    memset(_litFreq, 0, sizeof(_litFreq));
+    memset(_distFreq, 0, sizeof(_distFreq));
+
+    _strstart = _lookahead = _blockStart = _symCount = 0;
+    _matchLength = _prevLength = MIN_MATCH - 1;
+    _matchDist = _prevDist = 0;
+    _matchAvailable = false;
+    _outLen = _outPos = 0;
+    _bitBuf = _bitCount = 0;
+    _adler = 1;
+    _headerDone = _finishing = _finished = false;
+    return true;
+}
+
+size_t AsyncFTPDeflate::write(const uint8_t *data, size_t len) {
+    size_t used = 0;
+    while (used < len && !_finishing) {
+        _process();
+        // Still a full lookahead: blocked on the output buffer.
+        if (_lookahead >= MIN_LOOKAHEAD) break;
+        if (_strstart + _lookahead == 2 * _wsize) {
+            // Window full: drop its older half, after ending a block that starts there.
+            if (_blockStart < _wsize && !_emitBlock(false)) break;
+            _slide();
+        }
+        size_t room = 2 * _wsize - _strstart - _lookahead;
+        size_t n = len - used < room ? len - used : room;
+        memcpy(_window + _strstart + _lookahead, data + used, n);
+        _adler = adler32(_adler, data + used, n);
+        _lookahead += n;
+        used += n;
+    }
+    return used;
+}
+
+void AsyncFTPDeflate::finish() {
+    _finishing = true;
+}
+
+const uint8_t *AsyncFTPDeflate::output(size_t &len) {
+    if (_outPos == _outLen && _memory) {
+        _outPos = _outLen = 0;
+        _process();
+    }
+    len = _outLen - _outPos;
+    return _out + _outPos;
+}
+
+void AsyncFTPDeflate::consume(size_t len) {
+    _outPos += len;
+}
+
+void AsyncFTPDeflate::_slide() {
+    memcpy(_window, _window + _wsize, _wsize);
+    _strstart -= _wsize;
+    _blockStart -= _wsize;
+    for (uint32_t i = 0, n = 1u << _hashBits; i < n; i++)
+        _head[i] = _head[i] >= _wsize ? _head[i] - _wsize : 0;
+    for (uint32_t i = 0; i < _wsize; i++)
+        _prev[i] = _prev[i] >= _wsize ? _prev[i] - _wsize : 0;
+}
+
+void AsyncFTPDeflate::_insert(uint32_t pos) {
+    const uint8_t *p = _window + pos;
+    uint32_t h = ((p[0] << 16) | (p[1] << 8) | p[2]) * 0x9E3779B1u >> (32 - _hashBits);
+    _prev[pos & (_wsize - 1)] = _head[h];
+    _head[h] = pos;
+}
+
+// Longest match at _strstart that beats best, following the chain from
+// head. Position 0 doubles as the end of a chain.
+uint32_t AsyncFTPDeflate::_longestMatch(uint32_t head, uint32_t best, uint32_t &dist) {
+    const uint32_t maxDist = _wsize - MIN_LOOKAHEAD;
+    const uint32_t limit = _strstart > maxDist ? _strstart - maxDist : 0;
+    const uint32_t maxLen = _lookahead < MAX_MATCH ? _lookahead : MAX_MATCH;
+    const uint32_t nice = _nice < maxLen ? _nice : maxLen;
+    const uint8_t *scan = _window + _strstart;
+    uint32_t chain = _maxChain;
+    if (best >= _good) chain >>= 2;
+    if (best >= maxLen) return best;
+
+    for (uint32_t cur = head; cur > limit && chain--; cur = _prev[cur & (_wsize - 1)]) {
+        const uint8_t *match = _window + cur;
+        if (match[best] != scan[best] || match[0] != scan[0] || match[1] != scan[1]) continue;
+        uint32_t len = 2;
+        while (len < maxLen && match[len] == scan[len]) len++;
+        if (len > best) {
+            best = len;
+            dist = _strstart - cur;
+            if (len >= nice) break;
+        }
+    }
+    return best;
+}
+
+void AsyncFTPDeflate::_tallyLiteral(uint8_t c) {
+    _symLit[_symCount] = c;
+    _symDist[_symCount++] = 0;
+    _litFreq[c]++;
+}
+
+void AsyncFTPDeflate::_tallyMatch(uint32_t dist, uint32_t length) {
+    _symLit[_symCount] = length - MIN_MATCH;
+    _symDist[_symCount++] = dist;
+    _litFreq[257 + lengthCode(length)]++;
+    _distFreq[distCode(dist)]++;
+}
+
+void AsyncFTPDeflate::_process() {
+    if (_finished || !_memory) return;
+    for (;;) {
+        uint32_t tallied = _strstart - (_matchAvailable ? 1 : 0);
+        if (_symCount >= _symMax - 1 || tallied - _blockStart >= _blockMax) {
+            if (!_emitBlock(false)) return;
+        }
+        if (_lookahead < MIN_LOOKAHEAD && !_finishing) return;
+        if (_lookahead == 0) {
+            if (_matchAvailable) {
+                _tallyLiteral(_window[_strstart - 1]);
+                _matchAvailable = false;
+            }
+            _emitBlock(true);
+            return;
+        }
+        _step();
+    }
+}
+
+// One step of LZ77: zlib's deflate_fast for the low levels, deflate_slow
+// (one byte of lazy evaluation) for the others, and plain copying for 0.
+void AsyncFTPDeflate::_step() {
+    if (_level == 0) {
+        uint32_t n = _blockMax - (_strstart - _blockStart);
+        if (n > _lookahead) n = _lookahead;
+        _strstart += n;
+        _lookahead -= n;
+        return;
+    }
+
+    uint32_t head = 0;
+    if (_lookahead >= MIN_MATCH) {
+        const uint8_t *p = _window + _strstart;
+        head = _head[((p[0] << 16) | (p[1] << 8) | p[2]) * 0x9E3779B1u >> (32 - _hashBits)];
+        _insert(_strstart);
+    }
+    const uint32_t maxDist = _wsize - MIN_LOOKAHEAD;
+
+    if (!_lazy) {
+        uint32_t dist = 0, length = MIN_MATCH - 1;
+        if (head && _strstart - head <= maxDist) length = _longestMatch(head, MIN_MATCH - 1, dist);
+        if (length >= MIN_MATCH) {
+            _tallyMatch(dist, length);
+            uint32_t last = _strstart + _lookahead - MIN_MATCH;
+            _lookahead -= length;
+            while (--length) {
+                if (++_strstart <= last) _insert(_strstart);
+            }
+            _strstart++;
+        } else {
+            _tallyLiteral(_window[_strstart]);
+            _strstart++;
+            _lookahead--;
+        }
+        return;
+    }
+
+    _prevLength = _matchLength;
+    _prevDist = _matchDist;
+    _matchLength = MIN_MATCH - 1;
+    if (head && _prevLength < _maxLazy && _strstart - head <= maxDist) {
+        _matchLength = _longestMatch(head, _prevLength, _matchDist);
+        if (_matchLength <= _prevLength) _matchLength = MIN_MATCH - 1;
+        if (_matchLength == MIN_MATCH && _matchDist > TOO_FAR) _matchLength = MIN_MATCH - 1;
+    }
+    if (_prevLength >= MIN_MATCH && _matchLength <= _prevLength) {
+        // The match at the previous byte wins.
+        uint32_t last = _strstart + _lookahead - MIN_MATCH;
+        _tallyMatch(_prevDist, _prevLength);
+        _lookahead -= _prevLength - 1;
+        _prevLength -= 2;
+        do {
+            if (++_strstart <= last) _insert(_strstart);
+        } while (--_prevLength != 0);
+        _matchAvailable = false;
+        _matchLength = MIN_MATCH - 1;
+        _strstart++;
+    } else if (_matchAvailable) {
+        _tallyLiteral(_window[_strstart - 1]);
+        _strstart++;
+        _lookahead--;
+    } else {
+        _matchAvailable = true;
+        _strstart++;
+        _lookahead--;
+    }
+}
+
+void AsyncFTPDeflate::_putBits(uint32_t value, uint8_t count) {
+    _bitBuf |= value << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        _out[_outLen++] = (uint8_t)_bitBuf;
+        _bitBuf >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+void AsyncFTPDeflate::_alignBits() {
+    if (_bitCount) _putBits(0, 8 - _bitCount);
+}
+
+void AsyncFTPDeflate::_sendSymbols(const uint8_t *litLengths, const uint16_t *litCodes,
+                                   const uint8_t *distLengths, const uint16_t *distCodes) {
+    for (uint32_t i = 0; i < _symCount; i++) {
+        uint32_t dist = _symDist[i];
+        if (!dist) {
+            _putBits(litCodes[_symLit[i]], litLengths[_symLit[i]]);
+            continue;
+        }
+        uint32_t length = _symLit[i] + MIN_MATCH;
+        uint8_t lc = lengthCode(length);
+        _putBits(litCodes[257 + lc], litLengths[257 + lc]);
+        if (LENGTH_EXTRA[lc]) _putBits(length - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+        uint8_t dc = distCode(dist);
+        _putBits(distCodes[dc], distLengths[dc]);
+        if (DIST_EXTRA[dc]) _putBits(dist - DIST_BASE[dc], DIST_EXTRA[dc]);
+    }
+    _putBits(litCodes[256], litLengths[256]);
+}
+
+bool AsyncFTPDeflate::_emitBlock(bool final) {
+    if (_outPos != _outLen) return false;
+    _outPos = _outLen = 0;
+    if (!_headerDone) {
+        // CMF: deflate with our window; FLG: level hint, check bits.
+        uint8_t cmf = ((_windowBits - 8) << 4) | 8;
+        uint8_t flevel = _level < 2 ? 0 : _level < 6 ? 1 : _level == 6 ? 2 : 3;
+        uint8_t flg = flevel << 6;
+        flg |= 31 - ((cmf << 8) | flg) % 31;
+        _out[_outLen++] = cmf;
+        _out[_outLen++] = flg;
+        _headerDone = true;
+    }
+
+    uint32_t blockEnd = _strstart - (_matchAvailable ? 1 : 0);
+    uint32_t raw = blockEnd - _blockStart;
+    _litFreq[256] = 1;
+
+    // Size in bits of each way to send the block.
+    uint32_t extra = 0;
+    for (int i = 0; i < 29; i++) extra += _litFreq[257 + i] * LENGTH_EXTRA[i];
+    for (int i = 0; i < 30; i++) extra += _distFreq[i] * (DIST_EXTRA[i] + 0u);
+    uint32_t stored = 3 + ((8 - (_bitCount + 3) % 8) % 8) + 32 + 8 * raw;
+    uint32_t fixed = 3 + extra;
+    for (int i = 0; i < 286; i++) fixed += _litFreq[i] * fixedLitLength(i);
+    for (int i = 0; i < 30; i++) fixed += _distFreq[i] * 5;
+
+    uint8_t litLengths[288], distLengths[30];
+    uint16_t litCodes[288], distCodes[30];
+    uint8_t clSyms[286 + 30], clExtra[286 + 30], clLengths[19];
+    uint16_t clFreq[19] = {0}, clCodes[19];
+    int hlit = 0, hdist = 0, hclen = 0, clCount = 0;
+    uint32_t dynamic = UINT32_MAX;
+    if (_level > 0) {
+        buildLengths(_litFreq, 286, litLengths, 15);
+        buildLengths(_distFreq, 30, distLengths, 15);
+        for (hlit = 286; hlit > 257 && !litLengths[hlit - 1];) hlit--;
+        for (hdist = 30; hdist > 1 && !distLengths[hdist - 1];) hdist--;
+        uint8_t all[286 + 30];
+        memcpy(all, litLengths, hlit);
+        memcpy(all + hlit, distLengths, hdist);
+        clCount = encodeLengths(all, hlit + hdist, clSyms, clExtra);
+        for (int i = 0; i < clCount; i++) clFreq[clSyms[i]]++;
+        buildLengths(clFreq, 19, clLengths, 7);
+        for (hclen = 19; hclen > 4 && !clLengths[CODELEN_ORDER[hclen - 1]];) hclen--;
+
+        dynamic = 3 + 14 + 3 * hclen + extra + 2 * clFreq[16] + 3 * clFreq[17] + 7 * clFreq[18];
+        for (int i = 0; i < 19; i++) dynamic += clFreq[i] * clLengths[i];
+        for (int i = 0; i < 286; i++) dynamic += _litFreq[i] * litLengths[i];
+        for (int i = 0; i < 30; i++) dynamic += _distFreq[i] * distLengths[i];
+    }
+
+    if (_level == 0 || (stored <= fixed && stored <= dynamic)) {
+        _putBits(final ? 1 : 0, 3);
+        _alignBits();
+        _putBits(raw & 0xFFFF, 16);
+        _putBits(~raw & 0xFFFF, 16);
+        memcpy(_out + _outLen, _window + _blockStart, raw);
+        _outLen += raw;
+    } else if (fixed <= dynamic) {
+        _putBits(final ? 3 : 2, 3);
+        // The fixed code counts symbols 286 and 287, unused as they are.
+        for (int i = 0; i < 288; i++) litLengths[i] = fixedLitLength(i);
+        memset(distLengths, 5, sizeof(distLengths));
+        buildCodes(litLengths, 288, litCodes);
+        buildCodes(distLengths, 30, distCodes);
+        _sendSymbols(litLengths, litCodes, distLengths, distCodes);
+    } else {
+        _putBits(final ? 5 : 4, 3);
+        _putBits(hlit - 257, 5);
+        _putBits(hdist - 1, 5);
+        _putBits(hclen - 4, 4);
+        for (int i = 0; i < hclen; i++) _putBits(clLengths[CODELEN_ORDER[i]], 3);
+        buildCodes(clLengths, 19, clCodes);
+        for (int i = 0; i < clCount; i++) {
+            uint8_t s = clSyms[i];
+            _putBits(clCodes[s], clLengths[s]);
+            if (s == 16) _putBits(clExtra[i], 2);
+            else if (s == 17) _putBits(clExtra[i], 3);
+            else if (s == 18) _putBits(clExtra[i], 7);
+        }
+        buildCodes(litLengths, 286, litCodes);
+        buildCodes(distLengths, 30, distCodes);
+        _sendSymbols(litLengths, litCodes, distLengths, distCodes);
+    }
+
+    _blockStart = blockEnd;
+    _symCount = 0;
+    memset(_litFreq, 0, sizeof(_litFreq));
+    memset(_distFreq, 0, sizeof(_distFreq));
+    if (final) {
+        _alignBits();
+        for (int shift = 24; shift >= 0; shift -= 8) _out[_outLen++] = (uint8_t)(_adler >> shift);
+        _finished = true;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+// AsyncFTPInflate
+//---------------------------------------------------------------------
+
+AsyncFTPInflate::~AsyncFTPInflate() {
+    free(_window);
+}
+
+const uint8_t *AsyncFTPInflate::output(size_t &len) {
+    uint32_t start = (_wpos - _pending) & (_wsize - 1);
+    len = _pending < _wsize - start ? _pending : _wsize - start;
+    return _window + start;
+}
+
+#if FTP_MODEZ_ROM_INFLATE
+
+void AsyncFTPInflate::begin(uint8_t maxBits) {
+    _maxBits = maxBits > 15 ? 15 : maxBits;
+    _wsize = 1u << _maxBits;
+    _wpos = _pending = 0;
+    tinfl_init(&_tinfl);
+    // tinfl needs its whole window before it sees the header; it rejects a
+    // stream whose window is larger than this one.
+    free(_window);
+    _window = (uint8_t*)malloc(_wsize);
+    _state = _window ? HEADER : FAILED;
+}
+
+size_t AsyncFTPInflate::write(const uint8_t *data, size_t len) {
+    // tinfl keeps matches in the window, so decoded bytes are taken before
+    // it may write there again.
+    if (_pending || _state == DONE || _state == FAILED) return 0;
+    size_t in = len, out = _wsize - _wpos;
+    tinfl_status status = tinfl_decompress(&_tinfl, data, &in, _window, _window + _wpos, &out,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT |
+                                           TINFL_FLAG_COMPUTE_ADLER32);
+    _wpos = (_wpos + out) & (_wsize - 1);
+    _pending = out;
+    if (status == TINFL_STATUS_DONE) _state = DONE;
+    else if (status < 0)             _state = FAILED;
+    return in;
+}
+
+void AsyncFTPInflate::consume(size_t len) {
+    _pending -= len;
+}
+
+#else
+
+void AsyncFTPInflate::begin(uint8_t maxBits) {
+    free(_window);
+    _window = nullptr;
+    _maxBits = maxBits > 15 ? 15 : maxBits;
+    _state = HEADER;
+    _final = false;
+    _inLen = _inPos = 0;
+    _bitBuf = _bitCount = 0;
+    _wsize = _wpos = _pending = _history = _copyLeft = 0;
+    _s1 = 1;
+    _s2 = 0;
+}
+
+size_t AsyncFTPInflate::write(const uint8_t *data, size_t len) {
+    if (_inPos) {
+        memmove(_in, _in + _inPos, _inLen - _inPos);
+        _inLen -= _inPos;
+        _inPos = 0;
+    }
+    size_t n = sizeof(_in) - _inLen;
+    if (n > len) n = len;
+    memcpy(_in + _inLen, data, n);
+    _inLen += n;
+    _run();
+    return n;
+}
+
+void AsyncFTPInflate::consume(size_t len) {
+    _pending -= len;
+    _run();
+}
+
+bool AsyncFTPInflate::_need(uint8_t bits) {
+    while (_bitCount < bits) {
+        if (_inPos == _inLen) return false;
+        _bitBuf |= (uint32_t)_in[_inPos++] << _bitCount;
+        _bitCount += 8;
+    }
+    return true;
+}
+
+uint32_t AsyncFTPInflate::_take(uint8_t bits) {
+    uint32_t value = _bitBuf & ((1u << bits) - 1);
+    _bitBuf >>= bits;
+    _bitCount -= bits;
+    return value;
+}
+
+// Decode one symbol a bit at a time (as in zlib's puff): -1 if the input
+// ran out, -2 for a code that is not in the table.
+int AsyncFTPInflate::_decode(const Huffman &h) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        if (!_need(1)) return -1;
+        code |= _take(1);
+        int count = h.count[len];
+        if (code - count < first) return h.symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -2;
+}
+
+// Returns 0 for a complete code, > 0 if incomplete, < 0 if over-subscribed.
+int AsyncFTPInflate::_construct(Huffman &h, const uint8_t *lengths, int n) {
+    uint16_t offs[16];
+    memset(h.count, 0, sizeof(h.count));
+    for (int i = 0; i < n; i++) h.count[lengths[i]]++;
+    if (h.count[0] == n) return 0;
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= h.count[len];
+        if (left < 0) return left;
+    }
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h.count[len];
+    for (int i = 0; i < n; i++)
+        if (lengths[i]) h.symbol[offs[lengths[i]]++] = i;
+    return left;
+}
+
+int AsyncFTPInflate::_readTables() {
+    if (!_need(14)) return 0;
+    int nlen = _take(5) + 257;
+    int ndist = _take(5) + 1;
+    int ncode = _take(4) + 4;
+    if (nlen > 286 || ndist > 30) return -1;
+    for (int i = 0; i < 19; i++) {
+        if (i < ncode) {
+            if (!_need(3)) return 0;
+            _lengths[CODELEN_ORDER[i]] = _take(3);
+        } else {
+            _lengths[CODELEN_ORDER[i]] = 0;
+        }
+    }
+    if (_construct(_lencode, _lengths, 19) != 0) return -1;
+
+    for (int index = 0; index < nlen + ndist;) {
+        int sym = _decode(_lencode);
+        if (sym == -1) return 0;
+        if (sym < 0) return -1;
+        if (sym < 16) {
+            _lengths[index++] = sym;
+            continue;
+        }
+        uint8_t len = 0;
+        int repeat;
+        if (sym == 16) {
+            if (index == 0) return -1;
+            len = _lengths[index - 1];
+            if (!_need(2)) return 0;
+            repeat = 3 + _take(2);
+        } else if (sym == 17) {
+            if (!_need(3)) return 0;
+            repeat = 3 + _take(3);
+        } else {
+            if (!_need(7)) return 0;
+            repeat = 11 + _take(7);
+        }
+        if (index + repeat > nlen + ndist) return -1;
+        while (repeat--) _lengths[index++] = len;
+    }
+    if (_lengths[256] == 0) return -1;
+    // Incomplete codes are only allowed for a single code of length 1.
+    int err = _construct(_lencode, _lengths, nlen);
+    if (err < 0 || (err > 0 && nlen != _lencode.count[0] + _lencode.count[1])) return -1;
+    err = _construct(_distcode, _lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist != _distcode.count[0] + _distcode.count[1])) return -1;
+    return 1;
+}
+
+void AsyncFTPInflate::_put(uint8_t c) {
+    _window[_wpos] = c;
+    _wpos = (_wpos + 1) & (_wsize - 1);
+    _pending++;
+    if (_history < _wsize) _history++;
+    _s1 += c;
+    _s2 += _s1;
+    if (_s2 >= 0x7FFF0000u) {
+        _s1 %= ADLER_BASE;
+        _s2 %= ADLER_BASE;
+    }
+}
+
+// One literal, one match or the end of the block.
+int AsyncFTPInflate::_readSymbol() {
+    int sym = _decode(_lencode);
+    if (sym == -1) return 0;
+    if (sym < 0 || sym > 285) return -1;
+    if (sym < 256) {
+        _put(sym);
+        return 1;
+    }
+    if (sym == 256) {
+        _state = _final ? TRAILER : BLOCK;
+        return 1;
+    }
+    sym -= 257;
+    if (!_need(LENGTH_EXTRA[sym])) return 0;
+    uint32_t length = LENGTH_BASE[sym] + _take(LENGTH_EXTRA[sym]);
+    int dsym = _decode(_distcode);
+    if (dsym == -1) return 0;
+    if (dsym < 0 || dsym > 29) return -1;
+    if (!_need(DIST_EXTRA[dsym])) return 0;
+    uint32_t dist = DIST_BASE[dsym] + _take(DIST_EXTRA[dsym]);
+    if (dist > _history) return -1;
+    while (length--) _put(_window[(_wpos - dist) & (_wsize - 1)]);
+    return 1;
+}
+
+void AsyncFTPInflate::_run() {
+    for (;;) {
+        // Each unit of input is decoded in one go; if it is cut short, the
+        // reader is rewound to its start to wait for more.
+        size_t inPos = _inPos;
+        uint32_t bitBuf = _bitBuf;
+        uint8_t bitCount = _bitCount;
+        int result = 1;
+
+        switch (_state) {
+        case HEADER: {
+            if (!_need(16)) { result = 0; break; }
+            uint8_t cmf = _take(8), flg = _take(8);
+            uint8_t bits = (cmf >> 4) + 8;
+            if ((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 || (flg & 0x20) || bits > _maxBits) {
+                result = -1;
+                break;
+            }
+            _wsize = 1u << bits;
+            _window = (uint8_t*)malloc(_wsize);
+            if (!_window) { result = -1; break; }
+            _state = BLOCK;
+            break;
+        }
+        case BLOCK:
+            if (!_need(3)) { result = 0; break; }
+            _final = _take(1);
+            switch (_take(2)) {
+            case 0:
+                _state = STORED;
+                break;
+            case 1:
+                for (int i = 0; i < 288; i++) _lengths[i] = fixedLitLength(i);
+                _construct(_lencode, _lengths, 288);
+                // Distance codes 30 and 31 have codes too; decoding one is an error.
+                memset(_lengths, 5, 32);
+                _construct(_distcode, _lengths, 32);
+                _state = CODES;
+                break;
+            case 2:
+                _state = TABLES;
+                break;
+            default:
+                result = -1;
+            }
+            break;
+        case STORED: {
+            _take(_bitCount & 7);
+            if (!_need(16)) { result = 0; break; }
+            uint32_t len = _take(16);
+            if (!_need(16)) { result = 0; break; }
+            if (_take(16) != (~len & 0xFFFF)) { result = -1; break; }
+            _copyLeft = len;
+            _state = COPY;
+            break;
+        }
+        case COPY:
+            // The reader is byte aligned and empty here.
+            while (_copyLeft) {
+                if (_pending == _wsize) return;
+                if (_inPos == _inLen) return;
+                _put(_in[_inPos++]);
+                _copyLeft--;
+            }
+            _state = _final ? TRAILER : BLOCK;
+            break;
+        case TABLES:
+            result = _readTables();
+            if (result > 0) _state = CODES;
+            break;
+        case CODES:
+            // Room for the longest match before decoding another symbol.
+            if (_pending + MAX_MATCH > _wsize) return;
+            result = _readSymbol();
+            break;
+        case TRAILER: {
+            _take(_bitCount & 7);
+            uint32_t adler = 0;
+            for (int i = 0; i < 4 && result; i++) {
+                if (!_need(8)) result = 0;
+                else adler = (adler << 8) | _take(8);
+            }
+            if (!result) break;
+            _s1 %= ADLER_BASE;
+            _s2 %= ADLER_BASE;
+            if (adler != ((_s2 << 16) | _s1)) { result = -1; break; }
+            _state = DONE;
+            break;
+        }
+        case DONE:
+        case FAILED:
+            return;
+        }
+
+        if (result < 0) {
+            _state = FAILED;
+            return;
+        }
+        if (result == 0) {
+            _inPos = inPos;
+            _bitBuf = bitBuf;
+            _bitCount = bitCount;
+            return;
+        }
+    }
+}
+
+#endif // FTP_MODEZ_ROM_INFLATE
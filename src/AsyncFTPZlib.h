@@ -0,0 +1,193 @@
+#ifndef ASYNCFTPZLIB_H
+#define ASYNCFTPZLIB_H
+
+#include "AsyncFTPPort.h"
+
+#ifndef FTP_MODEZ_LEVEL
+#define FTP_MODEZ_LEVEL 6           // Default MODE Z compression level (0-9, OPTS MODE Z LEVEL)
+#endif
+#ifndef FTP_MODEZ_WINDOW_BITS
+#define FTP_MODEZ_WINDOW_BITS 12    // Compression window of 2^n bytes (9-15); 8 x 2^n bytes of RAM per download
+#endif
+#ifndef FTP_MODEZ_INFLATE_BITS
+#define FTP_MODEZ_INFLATE_BITS 15   // Largest window accepted on uploads (9-15); 2^n bytes of RAM per upload
+#endif
+#ifndef FTP_MODEZ_ROM_INFLATE
+#if defined(ARDUINO)
+#define FTP_MODEZ_ROM_INFLATE 1     // Decompress uploads with the miniz inflater in the ESP32's ROM
+#else
+#define FTP_MODEZ_ROM_INFLATE 0
+#endif
+#endif
+
+#if FTP_MODEZ_ROM_INFLATE
+#if __has_include(<rom/miniz.h>)
+#include <rom/miniz.h>
+#else
+#include <esp32/rom/miniz.h>
+#endif
+#endif
+
+// Streaming zlib (RFC 1950/1951) compressor for MODE Z downloads.
+//
+// Input is taken a piece at a time and compressed output is handed out
+// from an internal buffer, so the caller can pace both sides by the send
+// window. All memory is allocated in begin(): the window twice over, its
+// hash chains, one block of symbols and one block of output. Blocks end
+// before they cover a window's worth of input, and each is sent stored,
+// with fixed or with dynamic Huffman codes, whichever is smallest; so a
+// block never outgrows the output buffer.
+//
+// The ESP32 ROM has miniz's compressor too, but its state is fixed at a
+// 32 KB window with 64 KB of hash chains, well over 100 KB per download;
+// this one needs 8 x 2^FTP_MODEZ_WINDOW_BITS bytes.
+class AsyncFTPDeflate {
+public:
+    ~AsyncFTPDeflate();
+    bool begin(uint8_t level, uint8_t windowBits = FTP_MODEZ_WINDOW_BITS);
+    // Heap a compressor with this window takes, itself included.
+    static size_t memory(uint8_t windowBits = FTP_MODEZ_WINDOW_BITS);
+
+    // Take up to len bytes of input; returns how many were taken, 0 when
+    // the output has to be drained first.
+    size_t write(const uint8_t* data, size_t len);
+    // No more input: compress the rest and end the stream.
+    void finish();
+    // Compressed bytes ready to send (len 0 if none).
+    const uint8_t* output(size_t& len);
+    void consume(size_t len);
+    // The stream has ended and all of it has been consumed.
+    bool done() const { return _finished && _outPos == _outLen; }
+
+private:
+    // Bytes allocated in begin() for a window of 2^windowBits (9-15).
+    static size_t _buffers(uint8_t windowBits);
+    void _process();
+    void _step();
+    void _insert(uint32_t pos);
+    uint32_t _longestMatch(uint32_t head, uint32_t best, uint32_t& dist);
+    void _tallyLiteral(uint8_t c);
+    void _tallyMatch(uint32_t dist, uint32_t length);
+    // Write out the symbols gathered so far as one block; false if the
+    // output buffer is still in use.
+    bool _emitBlock(bool final);
+    void _slide();
+    void _putBits(uint32_t value, uint8_t count);
+    void _alignBits();
+    void _sendSymbols(const uint8_t* litLengths, const uint16_t* litCodes,
+                      const uint8_t* distLengths, const uint16_t* distCodes);
+
+    uint8_t*  _memory = nullptr;
+    uint8_t*  _window = nullptr;        // 2 * _wsize bytes
+    uint16_t* _prev = nullptr;          // hash chains, _wsize entries
+    uint16_t* _head = nullptr;          // 1 << _hashBits entries
+    uint8_t*  _symLit = nullptr;        // literal, or match length - 3
+    uint16_t* _symDist = nullptr;       // 0 for a literal
+    uint8_t*  _out = nullptr;
+    uint32_t  _wsize = 0;
+    uint8_t   _windowBits = 0;
+    uint8_t   _hashBits = 0;
+    uint32_t  _symMax = 0;
+    uint32_t  _blockMax = 0;            // raw bytes per block
+
+    uint8_t   _level = 0;
+    uint16_t  _good = 0, _maxLazy = 0, _nice = 0, _maxChain = 0;
+    bool      _lazy = false;
+
+    uint32_t  _strstart = 0;
+    uint32_t  _lookahead = 0;
+    uint32_t  _blockStart = 0;
+    uint32_t  _symCount = 0;
+    // Lazy matching: the match found at _strstart - 1, not yet tallied.
+    uint32_t  _matchLength = 0, _matchDist = 0;
+    uint32_t  _prevLength = 0, _prevDist = 0;
+    bool      _matchAvailable = false;
+
+    uint16_t  _litFreq[286];
+    uint16_t  _distFreq[30];
+
+    size_t    _outLen = 0;
+    size_t    _outPos = 0;
+    uint32_t  _bitBuf = 0;
+    uint8_t   _bitCount = 0;
+    uint32_t  _adler = 1;
+    bool      _headerDone = false;
+    bool      _finishing = false;
+    bool      _finished = false;
+};
+
+// Streaming zlib decompressor for MODE Z uploads.
+//
+// Compressed input can arrive in pieces of any size; decoded bytes are
+// handed out of the window as they are produced. The stream is rejected if
+// its header asks for a window larger than maxBits.
+//
+// Uploads are data a remote client controls, so with FTP_MODEZ_ROM_INFLATE
+// (the default on the ESP32) they are decoded by miniz's tinfl in ROM into a
+// window of 2^maxBits allocated in begin(). Other builds use the decoder in
+// AsyncFTPZlib.cpp, which buffers input internally and allocates the window
+// once the stream header gives its size.
+class AsyncFTPInflate {
+public:
+    ~AsyncFTPInflate();
+    // Start a stream; a window that cannot be allocated shows as failed().
+    void begin(uint8_t maxBits = FTP_MODEZ_INFLATE_BITS);
+    // Heap a decompressor takes at most, itself and the largest window included.
+    static size_t memory(uint8_t maxBits = FTP_MODEZ_INFLATE_BITS) {
+        return sizeof(AsyncFTPInflate) + ((size_t)1 << maxBits);
+    }
+
+    // Take up to len bytes of compressed input; returns how many were
+    // taken, 0 when the output has to be drained first.
+    size_t write(const uint8_t* data, size_t len);
+    // Decompressed bytes ready to be taken (len 0 if none).
+    const uint8_t* output(size_t& len);
+    void consume(size_t len);
+    // The whole stream, checksum included, has been decoded and taken.
+    bool done() const { return _state == DONE && _pending == 0; }
+    bool failed() const { return _state == FAILED; }
+
+private:
+    enum State : uint8_t { HEADER, BLOCK, STORED, COPY, TABLES, CODES, TRAILER, DONE, FAILED };
+
+    uint8_t   _maxBits = FTP_MODEZ_INFLATE_BITS;
+    State     _state = HEADER;
+    uint8_t*  _window = nullptr;
+    uint32_t  _wsize = 0;
+    uint32_t  _wpos = 0;
+    uint32_t  _pending = 0;             // decoded bytes not taken yet
+
+#if FTP_MODEZ_ROM_INFLATE
+    tinfl_decompressor _tinfl;
+#else
+    struct Huffman {
+        uint16_t count[16];             // codes of each length
+        uint16_t symbol[288];           // symbols in canonical order
+    };
+
+    void _run();
+    bool _need(uint8_t bits);
+    uint32_t _take(uint8_t bits);
+    int  _decode(const Huffman& h);
+    static int _construct(Huffman& h, const uint8_t* lengths, int n);
+    // Each returns 1 when done, 0 when more input is needed, -1 on bad data.
+    int  _readTables();
+    int  _readSymbol();
+    void _put(uint8_t c);
+
+    bool      _final = false;
+    uint8_t   _in[1024];                // holds the largest unit (a table header) with room to spare
+    size_t    _inLen = 0;
+    size_t    _inPos = 0;
+    uint32_t  _bitBuf = 0;
+    uint8_t   _bitCount = 0;
+    uint32_t  _history = 0;             // bytes a match may reach back, at most _wsize
+    uint32_t  _copyLeft = 0;            // of the current stored block
+    uint32_t  _s1 = 1, _s2 = 0;         // Adler-32 of the output
+    Huffman   _lencode;
+    Huffman   _distcode;
+    uint8_t   _lengths[320];
+#endif
+};
+
+#endif // ASYNCFTPZLIB_H